@@ -0,0 +1,311 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <memory>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <iostream>
+#include "MpscQueue.h"
+#include "StreamingDetectMerger.h"
+
+/**
+ * Служба асинхронного объединения: батчи принимаются по одному из любых потоков и в любом порядке,
+ *  объединение идет в собственном потоке службы одновременно с распознаванием следующих батчей.
+ *  Батчи передаются потоку службы через очередь без блокировок (MpscQueue), поэтому поток распознавания
+ *  не ждет ни объединения, ни других потоков.
+ *
+ *  Кадр объявляется числом батчей в каждой строке сетки (beginFrame). Строка сшивается, как только пришли
+ *  все ее батчи и сшиты все строки выше (StreamingDetectMerger): горизонтальные дефекты объединяются
+ *  через всю строку, поэтому единица готовности - строка, а не отдельный батч. Дефекты кадра выдаются
+ *  через future или обратный вызов сразу после прихода последнего батча и сшивки оставшихся строк.
+ *  Результат совпадает с mergeDefectsMy с точностью до порядка дефектов.
+ *
+ *  Одновременно может собираться несколько кадров, объединители и их арены переиспользуются между кадрами.
+ *  Номера кадров не повторяются за время жизни службы: служба помнит собранные кадры и отбрасывает
+ *  с сообщением их запоздавшие батчи и повторные объявления. Сплошной диапазон собранных номеров хранится
+ *  двумя границами, поэтому при номерах, идущих подряд, память на это не растет.
+ *  Батчи кадра, пришедшие раньше его объявления, откладываются до объявления, но не больше maxEarlyTiles
+ *  на всю службу: лишние отбрасываются с сообщением. Кадры, не собранные к уничтожению службы,
+ *  отбрасываются (future получает broken_promise), о батчах необъявленных кадров выводится сообщение.
+ */
+class AsyncDetectMerger
+{
+public:
+    // Обработчик результата кадра, вызывается в потоке службы
+    using FrameCallback = std::function<void(std::vector<DetectResult> resultDetects)>;
+
+    // maxEarlyTiles - сколько батчей необъявленных кадров служба держит до их объявления
+    explicit AsyncDetectMerger(size_t maxEarlyTiles = 65536)
+        : maxEarlyTiles(maxEarlyTiles), worker([this] { mergeLoop(); }) {}
+
+    ~AsyncDetectMerger()
+    {
+        Message stop;
+        stop.kind = Message::Stop;
+        post(std::move(stop));
+        worker.join();
+        if (earlyTiles > 0) {
+            std::cerr << "объединение: отброшено " << earlyTiles << " батчей необъявленных кадров\n";
+        }
+    }
+
+    AsyncDetectMerger(const AsyncDetectMerger&) = delete;
+    AsyncDetectMerger& operator=(const AsyncDetectMerger&) = delete;
+
+    /**
+     * Объявление кадра.
+     *
+     * @param frameId - номер кадра, не повторяющийся за время жизни службы
+     * @param rowSizes - число батчей в каждой строке сетки сверху вниз
+     * @param callback - получает дефекты кадра в потоке службы
+     */
+    void beginFrame(int64_t frameId, std::vector<int> rowSizes, FrameCallback callback)
+    {
+        Message message;
+        message.kind = Message::Frame;
+        message.frameId = frameId;
+        message.rowSizes = std::move(rowSizes);
+        message.callback = std::move(callback);
+        post(std::move(message));
+    }
+
+    // Объявление кадра с выдачей дефектов через future
+    std::future<std::vector<DetectResult>> beginFrame(int64_t frameId, std::vector<int> rowSizes)
+    {
+        auto promise = std::make_shared<std::promise<std::vector<DetectResult>>>();
+        std::future<std::vector<DetectResult>> merged = promise->get_future();
+        beginFrame(frameId, std::move(rowSizes), [promise](std::vector<DetectResult> resultDetects) {
+            promise->set_value(std::move(resultDetects));
+            });
+        return merged;
+    }
+
+    /**
+     * Передача батча кадра. Вызывается из любых потоков, не блокируется.
+     *
+     * @param frameId - номер кадра
+     * @param row, col - положение батча в сетке кадра, батчи строки упорядочены слева направо
+     * @param batch - батч, координаты относительно всего кадра
+     */
+    void submit(int64_t frameId, int row, int col, BatchResult batch)
+    {
+        Message message;
+        message.kind = Message::Tile;
+        message.frameId = frameId;
+        message.row = row;
+        message.col = col;
+        message.batch = std::move(batch);
+        post(std::move(message));
+    }
+
+private:
+    struct Message
+    {
+        enum Kind { Frame, Tile, Stop } kind = Tile;
+        int64_t frameId = 0;
+        std::vector<int> rowSizes;  // Frame: батчей в строках
+        FrameCallback callback;     // Frame: обработчик результата
+        int row = 0;                // Tile: положение батча
+        int col = 0;
+        BatchResult batch;          // Tile: батч
+    };
+
+    struct FrameState
+    {
+        bool declared = false;
+        FrameCallback callback;
+        std::vector<int> rowOffsets;            // начала строк в tiles, rows + 1 смещений
+        std::vector<BatchResult> tiles;         // батчи по строкам
+        std::vector<char> received;             // пришел ли батч
+        std::vector<int> rowReceived;           // пришедших батчей каждой строки
+        int nextRow = 0;                        // первая несшитая строка
+        std::unique_ptr<StreamingDetectMerger> merger;
+        std::vector<DetectResult> resultDetects;
+        std::vector<Message> early;             // батчи, пришедшие до объявления кадра
+
+        int rows() const { return static_cast<int>(rowOffsets.size()) - 1; }
+        int rowSize(int row) const { return rowOffsets[row + 1] - rowOffsets[row]; }
+    };
+
+    void post(Message message)
+    {
+        queue.push(std::move(message));
+        posted.fetch_add(1, std::memory_order_release);
+        posted.notify_one();
+    }
+
+    void mergeLoop()
+    {
+        for (;;) {
+            // Счетчик читается до опроса очереди: элемент, не связанный к моменту опроса, увеличит его позже
+            uint64_t seen = posted.load(std::memory_order_acquire);
+            Message message;
+            while (queue.pop(message)) {
+                if (message.kind == Message::Stop) {
+                    return;
+                }
+                handle(std::move(message));
+            }
+            posted.wait(seen, std::memory_order_acquire);
+        }
+    }
+
+    void handle(Message message)
+    {
+        int64_t frameId = message.frameId;
+        if (finished(frameId)) {
+            if (message.kind == Message::Frame) {
+                std::cerr << "объединение: кадр " << frameId << " уже собран, повторное объявление отброшено\n";
+            }
+            else {
+                std::cerr << "объединение: батч (" << message.row << ", " << message.col << ") уже собранного кадра "
+                    << frameId << " отброшен\n";
+            }
+            return;
+        }
+        auto found = frames.find(frameId);
+        if (message.kind == Message::Frame) {
+            if (found == frames.end()) {
+                found = frames.emplace(frameId, FrameState()).first;
+            }
+            else if (found->second.declared) {
+                std::cerr << "объединение: кадр " << frameId << " уже объявлен\n";
+                return;
+            }
+            FrameState& frame = found->second;
+            declare(frame, std::move(message));
+            std::vector<Message> early = std::move(frame.early);
+            earlyTiles -= early.size();
+            for (auto& tile : early) {
+                addTile(frame, std::move(tile));
+            }
+        }
+        else if (found == frames.end() || !found->second.declared) {
+            if (earlyTiles >= maxEarlyTiles) {
+                std::cerr << "объединение: батч (" << message.row << ", " << message.col << ") необъявленного кадра "
+                    << frameId << " отброшен, отложено уже " << earlyTiles << " батчей\n";
+                return;
+            }
+            if (found == frames.end()) {
+                found = frames.emplace(frameId, FrameState()).first;
+            }
+            found->second.early.push_back(std::move(message));
+            ++earlyTiles;
+            return;
+        }
+        else {
+            addTile(found->second, std::move(message));
+        }
+        FrameState& frame = found->second;
+
+        // Сшивка строк, все батчи которых пришли, сверху вниз
+        while (frame.nextRow < frame.rows() && frame.rowReceived[frame.nextRow] == frame.rowSize(frame.nextRow)) {
+            auto rowBegin = frame.tiles.begin() + frame.rowOffsets[frame.nextRow];
+            std::vector<BatchResult> batchesRow(std::make_move_iterator(rowBegin),
+                std::make_move_iterator(rowBegin + frame.rowSize(frame.nextRow)));
+            frame.merger->pushRow(std::move(batchesRow), frame.resultDetects);
+            ++frame.nextRow;
+        }
+        if (frame.nextRow == frame.rows()) {
+            frame.merger->finish(frame.resultDetects);
+            spareMergers.push_back(std::move(frame.merger));
+            FrameCallback callback = std::move(frame.callback);
+            std::vector<DetectResult> resultDetects = std::move(frame.resultDetects);
+            frames.erase(found);
+            markFinished(frameId);
+            if (callback) {
+                callback(std::move(resultDetects));
+            }
+        }
+    }
+
+    void declare(FrameState& frame, Message message)
+    {
+        frame.declared = true;
+        frame.callback = std::move(message.callback);
+        frame.rowOffsets.assign(1, 0);
+        for (int size : message.rowSizes) {
+            frame.rowOffsets.push_back(frame.rowOffsets.back() + std::max(0, size));
+        }
+        frame.tiles.resize(frame.rowOffsets.back());
+        frame.received.assign(frame.rowOffsets.back(), 0);
+        frame.rowReceived.assign(frame.rows(), 0);
+        if (spareMergers.empty()) {
+            frame.merger = std::make_unique<StreamingDetectMerger>();
+        }
+        else {
+            frame.merger = std::move(spareMergers.back());
+            spareMergers.pop_back();
+        }
+    }
+
+    bool finished(int64_t frameId) const
+    {
+        return (frameId >= finishedBegin && frameId < finishedEnd) || finishedIds.count(frameId) > 0;
+    }
+
+    // Номер собранного кадра продлевает диапазон [finishedBegin, finishedEnd) или запоминается отдельно,
+    // отдельные номера, примыкающие к диапазону, переносятся в него
+    void markFinished(int64_t frameId)
+    {
+        if (finishedBegin == finishedEnd) {
+            finishedBegin = frameId;
+            finishedEnd = frameId + 1;
+        }
+        else if (frameId == finishedEnd) {
+            ++finishedEnd;
+        }
+        else if (frameId == finishedBegin - 1) {
+            --finishedBegin;
+        }
+        else {
+            finishedIds.insert(frameId);
+            return;
+        }
+        while (finishedIds.erase(finishedEnd) > 0) {
+            ++finishedEnd;
+        }
+        while (finishedIds.erase(finishedBegin - 1) > 0) {
+            --finishedBegin;
+        }
+    }
+
+    // Батч вне сетки кадра или повторный батч отбрасывается с сообщением
+    bool addTile(FrameState& frame, Message message)
+    {
+        if (message.row < 0 || message.row >= frame.rows() || message.col < 0 || message.col >= frame.rowSize(message.row)) {
+            std::cerr << "объединение: батч (" << message.row << ", " << message.col << ") вне сетки кадра "
+                << message.frameId << "\n";
+            return false;
+        }
+        int tile = frame.rowOffsets[message.row] + message.col;
+        if (frame.received[tile]) {
+            std::cerr << "объединение: батч (" << message.row << ", " << message.col << ") кадра "
+                << message.frameId << " передан повторно\n";
+            return false;
+        }
+        frame.received[tile] = 1;
+        frame.tiles[tile] = std::move(message.batch);
+        ++frame.rowReceived[message.row];
+        return true;
+    }
+
+    MpscQueue<Message> queue;
+    std::atomic<uint64_t> posted{ 0 };      // число переданных сообщений, на нем ждет поток службы
+
+    // Состояние потока службы
+    std::map<int64_t, FrameState> frames;
+    std::vector<std::unique_ptr<StreamingDetectMerger>> spareMergers;
+    int64_t finishedBegin = 0;              // сплошной диапазон номеров собранных кадров
+    int64_t finishedEnd = 0;
+    std::set<int64_t> finishedIds;          // номера собранных кадров вне диапазона
+    size_t earlyTiles = 0;                  // отложено батчей необъявленных кадров
+    const size_t maxEarlyTiles;
+
+    std::thread worker;     // объявлен последним: запускается после создания остальных членов
+};
@@ -0,0 +1,371 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <bit>
+#include <opencv2/core.hpp>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BITMASK_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BITMASK_SSE2 1
+#endif
+
+/**
+ * Ядра над строками битовой маски. Пиксель x строки хранится в бите x % 64 слова x / 64.
+ *  Векторные версии используются при сборке с AVX2 (или SSE2), остаток строки и остальные сборки - скалярные.
+ */
+
+// dst[w] |= src[w]
+inline void orWords(uint64_t* dst, const uint64_t* src, int count)
+{
+    int w = 0;
+#if defined(BITMASK_AVX2)
+    for (; w + 4 <= count; w += 4) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + w));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + w));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + w), _mm256_or_si256(a, b));
+    }
+#elif defined(BITMASK_SSE2)
+    for (; w + 2 <= count; w += 2) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + w));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + w));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + w), _mm_or_si128(a, b));
+    }
+#endif
+    for (; w < count; ++w) {
+        dst[w] |= src[w];
+    }
+}
+
+// dst[w] |= (src[w] << shift) | (src[w - 1] >> (64 - shift)), 0 < shift < 64, src[-1] считается нулем.
+// Сдвиг строки вправо по изображению на shift пикселей
+inline void orWordsShiftedLeft(uint64_t* dst, const uint64_t* src, int count, int shift)
+{
+    if (count <= 0) {
+        return;
+    }
+    dst[0] |= src[0] << shift;
+    int w = 1;
+#if defined(BITMASK_AVX2)
+    __m128i left = _mm_cvtsi32_si128(shift);
+    __m128i right = _mm_cvtsi32_si128(64 - shift);
+    for (; w + 4 <= count; w += 4) {
+        __m256i current = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + w));
+        __m256i previous = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + w - 1));
+        __m256i shifted = _mm256_or_si256(_mm256_sll_epi64(current, left), _mm256_srl_epi64(previous, right));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + w));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + w), _mm256_or_si256(d, shifted));
+    }
+#elif defined(BITMASK_SSE2)
+    __m128i left = _mm_cvtsi32_si128(shift);
+    __m128i right = _mm_cvtsi32_si128(64 - shift);
+    for (; w + 2 <= count; w += 2) {
+        __m128i current = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + w));
+        __m128i previous = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + w - 1));
+        __m128i shifted = _mm_or_si128(_mm_sll_epi64(current, left), _mm_srl_epi64(previous, right));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + w));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + w), _mm_or_si128(d, shifted));
+    }
+#endif
+    for (; w < count; ++w) {
+        dst[w] |= (src[w] << shift) | (src[w - 1] >> (64 - shift));
+    }
+}
+
+// dst[w] = (src[w] >> shift) | (src[w + 1] << (64 - shift)), 0 < shift < 64, src[srcCount] и дальше считаются нулями.
+// Сдвиг строки влево по изображению на shift пикселей (вырезание ROI)
+inline void copyWordsShiftedRight(uint64_t* dst, const uint64_t* src, int count, int srcCount, int shift)
+{
+    int w = 0;
+    [[maybe_unused]] int vectorEnd = std::min(count, srcCount - 1);    // src[w + 1] должен существовать
+#if defined(BITMASK_AVX2)
+    __m128i right = _mm_cvtsi32_si128(shift);
+    __m128i left = _mm_cvtsi32_si128(64 - shift);
+    for (; w + 4 <= vectorEnd; w += 4) {
+        __m256i current = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + w));
+        __m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + w + 1));
+        __m256i shifted = _mm256_or_si256(_mm256_srl_epi64(current, right), _mm256_sll_epi64(next, left));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + w), shifted);
+    }
+#elif defined(BITMASK_SSE2)
+    __m128i right = _mm_cvtsi32_si128(shift);
+    __m128i left = _mm_cvtsi32_si128(64 - shift);
+    for (; w + 2 <= vectorEnd; w += 2) {
+        __m128i current = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + w));
+        __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + w + 1));
+        __m128i shifted = _mm_or_si128(_mm_srl_epi64(current, right), _mm_sll_epi64(next, left));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + w), shifted);
+    }
+#endif
+    for (; w < count; ++w) {
+        uint64_t current = (w < srcCount) ? src[w] : 0;
+        uint64_t next = (w + 1 < srcCount) ? src[w + 1] : 0;
+        dst[w] = (current >> shift) | (next << (64 - shift));
+    }
+}
+
+#if defined(BITMASK_AVX2)
+// Число единичных бит в каждом 64-битном элементе v: подсчет по полубайтам через таблицу в регистре
+inline __m256i popcountLanes(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowNibble = _mm256_set1_epi8(0x0f);
+    __m256i low = _mm256_and_si256(v, lowNibble);
+    __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowNibble);
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low), _mm256_shuffle_epi8(lookup, high));
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+inline int64_t sumLanes(__m256i v)
+{
+    return _mm256_extract_epi64(v, 0) + _mm256_extract_epi64(v, 1) + _mm256_extract_epi64(v, 2) + _mm256_extract_epi64(v, 3);
+}
+#endif
+
+// Число единичных бит в count словах
+inline int popcountWords(const uint64_t* words, int count)
+{
+    int w = 0;
+    int64_t total = 0;
+#if defined(BITMASK_AVX2)
+    __m256i accumulator = _mm256_setzero_si256();
+    for (; w + 4 <= count; w += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + w));
+        accumulator = _mm256_add_epi64(accumulator, popcountLanes(v));
+    }
+    total += sumLanes(accumulator);
+#endif
+    for (; w < count; ++w) {
+        total += std::popcount(words[w]);
+    }
+    return static_cast<int>(total);
+}
+
+// Число единичных бит в a & b (both) и в a | b (either) за один проход по count словам
+inline void popcountAndOrWords(const uint64_t* a, const uint64_t* b, int count, int64_t& both, int64_t& either)
+{
+    int w = 0;
+    both = 0;
+    either = 0;
+#if defined(BITMASK_AVX2)
+    __m256i andAccumulator = _mm256_setzero_si256();
+    __m256i orAccumulator = _mm256_setzero_si256();
+    for (; w + 4 <= count; w += 4) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + w));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + w));
+        andAccumulator = _mm256_add_epi64(andAccumulator, popcountLanes(_mm256_and_si256(va, vb)));
+        orAccumulator = _mm256_add_epi64(orAccumulator, popcountLanes(_mm256_or_si256(va, vb)));
+    }
+    both += sumLanes(andAccumulator);
+    either += sumLanes(orAccumulator);
+#endif
+    for (; w < count; ++w) {
+        both += std::popcount(a[w] & b[w]);
+        either += std::popcount(a[w] | b[w]);
+    }
+}
+
+// Упаковка count <= 64 байт строки CV_8UC1 в одно слово: бит i - ненулевой байт src[i]
+inline uint64_t packWord(const uchar* src, int count)
+{
+    uint64_t word = 0;
+    int i = 0;
+#if defined(BITMASK_AVX2)
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 32 <= count; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        uint32_t isZero = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)));
+        word |= static_cast<uint64_t>(~isZero) << i;
+    }
+#elif defined(BITMASK_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        uint32_t isZero = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+        word |= static_cast<uint64_t>(~isZero & 0xffffu) << i;
+    }
+#endif
+    // Хвост без ветвлений: на краях масок нули и единицы чередуются непредсказуемо
+    for (; i < count; ++i) {
+        word |= static_cast<uint64_t>(src[i] != 0) << i;
+    }
+    return word;
+}
+
+
+/**
+ * Бинарная маска с упаковкой 1 бит на пиксель (в 8 раз меньше CV_8UC1).
+ *  Строки выровнены на 64 бита, биты за пределами cols всегда нулевые.
+ *  Ненулевой пиксель исходной маски - единичный бит.
+ */
+class BitMask
+{
+public:
+    BitMask() = default;
+
+    BitMask(int rows, int cols)
+        : rowCount(rows), colCount(cols), stride((cols + 63) / 64), words(static_cast<size_t>(rows) * ((cols + 63) / 64), 0)
+    {
+    }
+
+    // Упаковка маски CV_8UC1
+    static BitMask fromMat(const cv::Mat& mask)
+    {
+        BitMask bits(mask.rows, mask.cols);
+        for (int y = 0; y < mask.rows; ++y) {
+            packRow(mask.ptr<uchar>(y), mask.cols, bits.row(y));
+        }
+        return bits;
+    }
+
+    // Новый размер с обнулением. Память слов переиспользуется, если ее хватает
+    void reset(int rows, int cols)
+    {
+        rowCount = rows;
+        colCount = cols;
+        stride = (cols + 63) / 64;
+        words.assign(static_cast<size_t>(rows) * stride, 0);
+    }
+
+    // Наложение (OR) маски CV_8UC1, левый верхний угол которой попадает в точку offset, без промежуточной BitMask.
+    // rowWords - буфер под упакованную строку при сдвиге не на целое слово
+    void orMat(const cv::Mat& mask, cv::Point2i offset, std::vector<uint64_t>& rowWords)
+    {
+        int wordOffset = offset.x / 64;
+        int shift = offset.x % 64;
+        int srcStride = (mask.cols + 63) / 64;
+        for (int y = 0; y < mask.rows; ++y) {
+            uint64_t* dst = row(y + offset.y) + wordOffset;
+            if (shift == 0) {
+                packRow(mask.ptr<uchar>(y), mask.cols, dst);
+                continue;
+            }
+            rowWords.assign(srcStride, 0);
+            packRow(mask.ptr<uchar>(y), mask.cols, rowWords.data());
+            orRowShifted(dst, rowWords.data(), srcStride, shift, stride - wordOffset);
+        }
+    }
+
+    size_t capacityWords() const { return words.capacity(); }
+    void reserve(size_t wordCount) { words.reserve(wordCount); }
+
+    // Распаковка в CV_8UC1 (0 / 255)
+    cv::Mat toMat() const
+    {
+        cv::Mat mask = cv::Mat::zeros(rowCount, colCount, CV_8UC1);
+        for (int y = 0; y < rowCount; ++y) {
+            const uint64_t* src = row(y);
+            uchar* dst = mask.ptr<uchar>(y);
+            for (int w = 0; w < stride; ++w) {
+                uint64_t word = src[w];
+                while (word) {
+                    dst[w * 64 + std::countr_zero(word)] = 255;
+                    word &= word - 1;
+                }
+            }
+        }
+        return mask;
+    }
+
+    int rows() const { return rowCount; }
+    int cols() const { return colCount; }
+    cv::Size size() const { return cv::Size(colCount, rowCount); }
+    bool empty() const { return rowCount == 0 || colCount == 0; }
+    size_t bytes() const { return words.size() * sizeof(uint64_t); }
+
+    uint64_t* row(int y) { return words.data() + static_cast<size_t>(y) * stride; }
+    const uint64_t* row(int y) const { return words.data() + static_cast<size_t>(y) * stride; }
+
+    // Наложение (OR) маски src, левый верхний угол которой попадает в точку offset. src должна целиком помещаться
+    void orShifted(const BitMask& src, cv::Point2i offset)
+    {
+        int wordOffset = offset.x / 64;
+        int shift = offset.x % 64;
+        int available = stride - wordOffset;
+        for (int y = 0; y < src.rowCount; ++y) {
+            uint64_t* dst = row(y + offset.y) + wordOffset;
+            const uint64_t* s = src.row(y);
+            if (shift == 0) {
+                orWords(dst, s, src.stride);
+            }
+            else {
+                orRowShifted(dst, s, src.stride, shift, available);
+            }
+        }
+    }
+
+    // Есть ли хотя бы один единичный пиксель в области rect. Останавливается на первом найденном слове
+    bool anyNonZero(const cv::Rect2i& rect) const
+    {
+        bool found = false;
+        forEachRowWords(rect, [&](const uint64_t* src, int first, int last, uint64_t firstMask, uint64_t lastMask) {
+            if (first == last) {
+                found = (src[first] & firstMask & lastMask) != 0;
+                return found;
+            }
+            found = (src[first] & firstMask) || (src[last] & lastMask);
+            for (int w = first + 1; w < last && !found; ++w) {
+                found = src[w] != 0;
+            }
+            return found;
+            });
+        return found;
+    }
+
+private:
+    // Упаковка строки CV_8UC1 через OR в слова dst (биты за пределами cols не затрагиваются)
+    static void packRow(const uchar* src, int cols, uint64_t* dst)
+    {
+        for (int x = 0; x < cols; x += 64) {
+            dst[x / 64] |= packWord(src + x, std::min(64, cols - x));
+        }
+    }
+
+    // OR строки из count слов со сдвигом влево на shift бит (0 < shift < 64). available - слов строки dst
+    static void orRowShifted(uint64_t* dst, const uint64_t* src, int count, int shift, int available)
+    {
+        orWordsShiftedLeft(dst, src, count, shift);
+        // При сдвиге старшие биты последнего слова src переходят в следующее слово строки
+        if (available > count) {
+            dst[count] |= src[count - 1] >> (64 - shift);
+        }
+    }
+
+    // Обход строк области: onRow(слова строки, первое и последнее слово, маски крайних слов).
+    // onRow возвращает true, чтобы прекратить обход
+    template <typename OnRow>
+    void forEachRowWords(const cv::Rect2i& rect, OnRow&& onRow) const
+    {
+        if (rect.width <= 0 || rect.height <= 0) {
+            return;
+        }
+        int first = rect.x / 64;
+        int last = (rect.x + rect.width - 1) / 64;
+        uint64_t firstMask = ~uint64_t(0) << (rect.x % 64);
+        int lastBits = (rect.x + rect.width) % 64;
+        uint64_t lastMask = lastBits ? (uint64_t(1) << lastBits) - 1 : ~uint64_t(0);
+        for (int y = rect.y; y < rect.y + rect.height; ++y) {
+            if (onRow(row(y), first, last, firstMask, lastMask)) {
+                return;
+            }
+        }
+    }
+
+    int rowCount = 0;
+    int colCount = 0;
+    int stride = 0;                 // слов на строку
+    std::vector<uint64_t> words;
+};
+
+// Отношение площади пересечения масок одного размера к площади их объединения, 0 - обе маски пусты
+inline double maskIoU(const BitMask& a, const BitMask& b)
+{
+    int64_t both = 0;
+    int64_t either = 0;
+    popcountAndOrWords(a.row(0), b.row(0), a.rows() * ((a.cols() + 63) / 64), both, either);
+    return (either == 0) ? 0.0 : static_cast<double>(both) / static_cast<double>(either);
+}
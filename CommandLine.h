@@ -0,0 +1,21 @@
+#pragma once
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Разбор аргументов командной строки замеряющих и проверочных программ (bench_main.cpp, check_main.cpp).
+ */
+
+// Разбиение списка "a,b,c" по separator, пустые элементы пропускаются
+inline std::vector<std::string> splitList(const std::string& text, char separator)
+{
+    std::vector<std::string> items;
+    std::istringstream stream(text);
+    for (std::string item; std::getline(stream, item, separator);) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
@@ -3,6 +3,8 @@
 #include <opencv2/core.hpp>
 #include <opencv2/opencv.hpp>
 #include <list>
+#include <vector>
+#include <span>
 
 // Определение enum для классов дефектов
 enum class DefectType {
@@ -32,6 +34,35 @@ enum class DefectType {
     Default
 };
 
+// Фрагмент маски объединенного дефекта: маска одного куска и ее смещение относительно рамки дефекта
+struct MaskFragment
+{
+    cv::Mat mask;           // Маска куска (данные не копируются, cv::Mat разделяет буфер с исходным куском)
+    cv::Point2i offset;     // Положение левого верхнего угла маски куска внутри рамки дефекта
+};
+
+// Векторное представление тонкого дефекта (нити, близны): ломаная с толщиной линии
+struct DefectPolyline
+{
+    std::vector<cv::Point2i> points;    // Вершины ломаной в координатах исходного изображения
+    int thickness = 1;                  // Толщина линии в пикселях
+};
+
+// Признаки дефекта, накапливаемые при объединении кусков (см. DefectFeatures.h).
+// Моменты хранятся центральными относительно центра масс: так они складываются без потери точности
+// на координатах длинного рулона. Сырые моменты: m00 = area, m10 = area * centroid.x, m20 = mu20 + area * centroid.x^2 и т.д.
+struct DefectFeatures
+{
+    int64_t area = -1;          // Число пикселей дефекта, -1 - признаки не посчитаны
+    cv::Point2d centroid;       // Центр масс в координатах изображения
+    double mu20 = 0.0;          // Центральные моменты второго порядка (суммы по пикселям, не нормированные)
+    double mu11 = 0.0;
+    double mu02 = 0.0;
+    double length = 0.0;        // Оценка длины скелета: сумма длин кусков
+    float maxProb = 0.0f;       // Наибольшая вероятность кусков
+    double probMass = 0.0;      // Сумма вероятностей кусков, взвешенных их площадью (средняя = probMass / area)
+};
+
 // Структура, описывающая один найденный дефект
 struct DetectResult
 {
@@ -46,6 +77,16 @@ struct DetectResult
     // Белые пиксели - дефектная область, черные - не дефектная
 
     int64_t klass;          // Класс дефекта
+
+    std::vector<MaskFragment> fragments;    // Куски маски объединенного дефекта, еще не собранные в mask.
+    // Если не пуст, mask пуста и собирается по требованию (materializeMask в DetectMerger.h)
+
+    std::vector<DefectPolyline> lines;      // Векторная геометрия тонкого дефекта. Если не пуста, mask может быть пустой:
+    // маска строится растеризацией линий по требованию (materializeMask)
+
+    DefectFeatures features;    // Площадь, моменты, длина и вероятности. Заполняются объединением для кусков, попавших
+    // в компоненты, и для объединенных дефектов; у остальных - по первому запросу (defectFeatures). Детектор может
+    // заполнить их для куска сам, тогда они не пересчитываются
 };
 
 
@@ -59,3 +100,21 @@ struct BatchResult
     std::list<DetectResult> detects;    // Список дефектов
 };
 
+
+// Кадр дефектов без копирования: структура массивов, которыми владеет вызывающий код.
+// Дефекты батча t (t = row * cols + col) занимают индексы [tileOffsets[t], tileOffsets[t + 1]) во всех массивах дефектов
+struct DetectFrameView
+{
+    int rows = 0;                           // число строк сетки батчей
+    int cols = 0;                           // число батчей в строке
+
+    std::span<const cv::Rect2i> batchRects; // рамки батчей по строкам, rows * cols (может быть пуст:
+    // тогда не ищутся внутренние дефекты, и все куски проходят через объединение)
+    std::span<const int> tileOffsets;       // rows * cols + 1 смещений, tileOffsets[0] == 0
+
+    std::span<const cv::Rect2i> rects;      // рамки дефектов
+    std::span<const float> probs;           // точности распознания
+    std::span<const int64_t> klasses;       // классы дефектов
+    std::span<const cv::Mat> masks;         // маски дефектов (может быть пуст). Копируются только заголовки cv::Mat,
+    // пиксели остаются в буферах вызывающего кода и должны жить, пока живут результаты объединения
+};
@@ -0,0 +1,308 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <bit>
+#include "DataStructs.h"
+#include "BitMask.h"
+
+/**
+ * Признаки дефекта (DefectFeatures в DataStructs.h), накапливаемые при объединении.
+ *  Признаки куска считаются один раз, когда кусок поступает в компоненты объединения: растровая маска - за один
+ *  проход по ее упакованным строкам, векторная геометрия - по отрезкам, без растеризации. При слиянии компонент
+ *  признаки складываются за O(1) (mergeFeatures), поэтому признаки объединенного дефекта выдаются вместе с ним
+ *  без сборки и повторного просмотра его маски. Куски, выданные без объединения (внутренние и необъединяемые),
+ *  проходом по маске не платят: их признаки считаются по первому запросу (defectFeatures).
+ *
+ *  Площадь и моменты складываются как суммы по пикселям: куски разных батчей не пересекаются, и сумма
+ *  совпадает с признаками собранной маски. Куски одного батча могут пересекаться - такие куски компоненты
+ *  пересчитываются при выдаче (DefectComponents::componentFeatures в DetectMerger.h).
+ *  Длина скелета - сумма длин кусков: для векторного куска - длина его ломаных, для растрового - протяженность
+ *  вдоль главной оси (для прямоугольника - его длинная сторона). Протяженный дефект режется батчами поперек,
+ *  поэтому длины кусков складываются в его длину.
+ */
+// Суммы по единичным пикселям строки: число, сумма координат x и сумма их квадратов
+struct RowSums
+{
+    int64_t count = 0;
+    int64_t sumX = 0;
+    int64_t sumXX = 0;
+};
+
+// Добавление единичных бит слова, первый бит которого - столбец base
+inline void addWordSums(uint64_t word, int64_t base, RowSums& sums)
+{
+    // Суммы по байту: число бит, сумма и сумма квадратов их номеров
+    struct ByteSums
+    {
+        std::array<int, 256> count{};
+        std::array<int, 256> sum{};
+        std::array<int, 256> sumSquares{};
+    };
+    static const ByteSums table = [] {
+        ByteSums sums;
+        for (int bits = 0; bits < 256; ++bits) {
+            for (int i = 0; i < 8; ++i) {
+                if (bits & (1 << i)) {
+                    ++sums.count[bits];
+                    sums.sum[bits] += i;
+                    sums.sumSquares[bits] += i * i;
+                }
+            }
+        }
+        return sums;
+    }();
+
+    // Одна серия единиц (сплошное слово, строка заполненной маски или поперечник линии) - по формулам:
+    // n пикселей с x0, сумма номеров 0..n-1 = n(n-1)/2, сумма их квадратов = (n-1)n(2n-1)/6
+    int low = std::countr_zero(word);
+    uint64_t run = word >> low;
+    if ((run & (run + 1)) == 0) {
+        int64_t n = std::countr_one(run);
+        int64_t x0 = base + low;
+        int64_t sum = n * (n - 1) / 2;
+        sums.count += n;
+        sums.sumX += n * x0 + sum;
+        sums.sumXX += n * x0 * x0 + 2 * x0 * sum + (n - 1) * n * (2 * n - 1) / 6;
+        return;
+    }
+    for (int b = 0; b < 8 && word; ++b, word >>= 8) {
+        int bits = static_cast<int>(word & 0xff);
+        if (bits == 0) {
+            continue;
+        }
+        int64_t x = base + 8 * b;
+        int count = table.count[bits];
+        sums.count += count;
+        sums.sumX += count * x + table.sum[bits];
+        sums.sumXX += count * x * x + 2 * x * table.sum[bits] + table.sumSquares[bits];
+    }
+}
+
+// Суммы строки маски CV_8UC1 длиной cols. Строка упаковывается по 64 пикселя, без промежуточного буфера
+inline RowSums maskRowSums(const uchar* row, int cols)
+{
+    RowSums sums;
+    for (int x = 0; x < cols; x += 64) {
+        uint64_t word = packWord(row + x, std::min(64, cols - x));
+        if (word) {
+            addWordSums(word, x, sums);
+        }
+    }
+    return sums;
+}
+
+// Признаки из сумм по пикселям в локальных координатах с началом origin. Вероятность не заполняется
+inline DefectFeatures featuresFromSums(int64_t count, double sumX, double sumY, double sumXX, double sumXY, double sumYY,
+    cv::Point2d origin)
+{
+    DefectFeatures features;
+    features.area = count;
+    if (count == 0) {
+        features.centroid = origin;
+        return features;
+    }
+    double meanX = sumX / count;
+    double meanY = sumY / count;
+    features.centroid = origin + cv::Point2d(meanX, meanY);
+    features.mu20 = std::max(0.0, sumXX - meanX * sumX);
+    features.mu11 = sumXY - meanX * sumY;
+    features.mu02 = std::max(0.0, sumYY - meanY * sumY);
+    return features;
+}
+
+// Наибольшее собственное значение матрицы центральных моментов (сумма по пикселям вдоль главной оси)
+inline double principalMoment(const DefectFeatures& features)
+{
+    double half = (features.mu20 - features.mu02) / 2;
+    return (features.mu20 + features.mu02) / 2 + std::sqrt(half * half + features.mu11 * features.mu11);
+}
+
+// Протяженность вдоль главной оси: длина отрезка с тем же моментом, sqrt(12 * дисперсия)
+inline double majorAxisLength(const DefectFeatures& features)
+{
+    return (features.area > 0) ? std::sqrt(12.0 * principalMoment(features) / features.area) : 0.0;
+}
+
+// Угол главной оси с осью x в радианах, (-pi/2, pi/2]
+inline double orientation(const DefectFeatures& features)
+{
+    return 0.5 * std::atan2(2.0 * features.mu11, features.mu20 - features.mu02);
+}
+
+// Средняя по пикселям вероятность
+inline double meanProb(const DefectFeatures& features)
+{
+    return (features.area > 0) ? features.probMass / features.area : features.maxProb;
+}
+
+// Признаки объединения двух непересекающихся частей за O(1): центральные моменты сдвигаются к общему центру масс
+inline DefectFeatures mergeFeatures(const DefectFeatures& a, const DefectFeatures& b)
+{
+    DefectFeatures merged;
+    merged.area = a.area + b.area;
+    merged.length = a.length + b.length;
+    merged.maxProb = std::max(a.maxProb, b.maxProb);
+    merged.probMass = a.probMass + b.probMass;
+    if (merged.area == 0) {
+        merged.centroid = (a.centroid + b.centroid) * 0.5;
+        return merged;
+    }
+    cv::Point2d delta = b.centroid - a.centroid;
+    double weight = static_cast<double>(a.area) * b.area / merged.area;
+    merged.centroid = a.centroid + delta * (static_cast<double>(b.area) / merged.area);
+    merged.mu20 = a.mu20 + b.mu20 + delta.x * delta.x * weight;
+    merged.mu11 = a.mu11 + b.mu11 + delta.x * delta.y * weight;
+    merged.mu02 = a.mu02 + b.mu02 + delta.y * delta.y * weight;
+    return merged;
+}
+
+// Признаки части a без ее подчасти b: обратное к mergeFeatures для площади, центра масс и моментов.
+// Длина и вероятности берутся из a
+inline DefectFeatures subtractFeatures(const DefectFeatures& a, const DefectFeatures& b)
+{
+    DefectFeatures rest = a;
+    rest.area = a.area - b.area;
+    if (b.area == 0) {
+        return rest;
+    }
+    if (rest.area <= 0) {
+        rest.area = 0;
+        rest.mu20 = rest.mu11 = rest.mu02 = 0.0;
+        return rest;
+    }
+    rest.centroid = (a.centroid * static_cast<double>(a.area) - b.centroid * static_cast<double>(b.area)) / static_cast<double>(rest.area);
+    cv::Point2d delta = b.centroid - rest.centroid;
+    double weight = static_cast<double>(rest.area) * b.area / a.area;
+    rest.mu20 = std::max(0.0, a.mu20 - b.mu20 - delta.x * delta.x * weight);
+    rest.mu11 = a.mu11 - b.mu11 - delta.x * delta.y * weight;
+    rest.mu02 = std::max(0.0, a.mu02 - b.mu02 - delta.y * delta.y * weight);
+    return rest;
+}
+
+// Признаки по суммам строк: rowSums(y) - суммы строки y маски высотой rows, левый верхний угол маски - origin
+template <typename RowSumsOf>
+DefectFeatures featuresFromRows(int rows, cv::Point2i origin, RowSumsOf&& rowSums)
+{
+    int64_t count = 0, sumX = 0, sumXX = 0;
+    double sumY = 0.0, sumXY = 0.0, sumYY = 0.0;
+    for (int y = 0; y < rows; ++y) {
+        RowSums row = rowSums(y);
+        count += row.count;
+        sumX += row.sumX;
+        sumXX += row.sumXX;
+        sumY += static_cast<double>(y) * row.count;
+        sumXY += static_cast<double>(y) * row.sumX;
+        sumYY += static_cast<double>(y) * y * row.count;
+    }
+    DefectFeatures features = featuresFromSums(count, static_cast<double>(sumX), sumY, static_cast<double>(sumXX),
+        sumXY, sumYY, cv::Point2d(origin));
+    features.length = majorAxisLength(features);
+    return features;
+}
+
+// Признаки растровой маски, левый верхний угол которой - точка origin изображения
+inline DefectFeatures rasterFeatures(const cv::Mat& mask, cv::Point2i origin)
+{
+    return featuresFromRows(mask.rows, origin, [&](int y) { return maskRowSums(mask.ptr<uchar>(y), mask.cols); });
+}
+
+// То же для упакованной маски
+inline DefectFeatures rasterFeatures(const BitMask& mask, cv::Point2i origin)
+{
+    int stride = (mask.cols() + 63) / 64;
+    return featuresFromRows(mask.rows(), origin, [&](int y) {
+        RowSums sums;
+        const uint64_t* words = mask.row(y);
+        for (int w = 0; w < stride; ++w) {
+            if (words[w]) {
+                addWordSums(words[w], 64 * w, sums);
+            }
+        }
+        return sums;
+        });
+}
+
+// Признаки векторной геометрии без растеризации: отрезок толщины t - прямоугольник длины L и ширины t,
+// концы ломаной - квадраты t x t. Площадь - оценка: растеризация может отличаться на пиксели по краям линии
+inline DefectFeatures polylineFeatures(const std::vector<DefectPolyline>& lines)
+{
+    // Прямоугольник со сторонами along (вдоль direction) и across с центром center
+    auto bar = [](cv::Point2d center, cv::Point2d direction, double along, double across) {
+        DefectFeatures features;
+        double area = along * across;
+        features.area = static_cast<int64_t>(std::llround(area));
+        features.centroid = center;
+        double alongMoment = area * along * along / 12;
+        double acrossMoment = area * across * across / 12;
+        features.mu20 = alongMoment * direction.x * direction.x + acrossMoment * direction.y * direction.y;
+        features.mu02 = alongMoment * direction.y * direction.y + acrossMoment * direction.x * direction.x;
+        features.mu11 = (alongMoment - acrossMoment) * direction.x * direction.y;
+        return features;
+    };
+
+    DefectFeatures features;
+    features.area = 0;
+    for (const auto& line : lines) {
+        if (line.points.empty()) {
+            continue;
+        }
+        double thickness = std::max(1, line.thickness);
+        for (size_t i = 0; i + 1 < line.points.size(); ++i) {
+            cv::Point2d a(line.points[i]);
+            cv::Point2d b(line.points[i + 1]);
+            double length = std::hypot(b.x - a.x, b.y - a.y);
+            if (length > 0) {
+                features = mergeFeatures(features, bar((a + b) * 0.5, (b - a) / length, length, thickness));
+                features.length += length;
+            }
+        }
+        cv::Point2d ends[] = { cv::Point2d(line.points.front()), cv::Point2d(line.points.back()) };
+        for (const auto& end : ends) {
+            features = mergeFeatures(features, bar(end, cv::Point2d(1, 0), thickness / 2, thickness));
+        }
+    }
+    return features;
+}
+
+// Вероятности признаков части дефекта с точностью prob
+inline DefectFeatures withProb(DefectFeatures features, float prob)
+{
+    features.maxProb = prob;
+    features.probMass = static_cast<double>(prob) * features.area;
+    return features;
+}
+
+// Признаки куска: плотная маска, а если ее нет - векторная геометрия (как в drawDefectMask). Фрагменты
+// складываются без проверки пересечений: объединение заполняет признаки своих дефектов само
+// (DefectComponents::componentFeatures в DetectMerger.h), сюда попадают только дефекты, собранные вручную
+inline DefectFeatures pieceFeatures(const DetectResult& defect)
+{
+    DefectFeatures features;
+    features.area = 0;
+    if (!defect.mask.empty()) {
+        features = rasterFeatures(defect.mask, defect.rect.tl());
+    }
+    else if (defect.fragments.empty() && !defect.lines.empty()) {
+        features = polylineFeatures(defect.lines);
+    }
+    for (const auto& fragment : defect.fragments) {
+        features = mergeFeatures(features, rasterFeatures(fragment.mask, defect.rect.tl() + fragment.offset));
+    }
+    if (defect.mask.empty() && !defect.fragments.empty() && !defect.lines.empty()) {
+        features = mergeFeatures(features, polylineFeatures(defect.lines));
+    }
+    return withProb(features, defect.prob);
+}
+
+// Признаки дефекта: если они не заполнены (детектором или объединением), считаются при первом обращении
+// и запоминаются в defect.features, как маска в materializeMask
+inline const DefectFeatures& defectFeatures(DetectResult& defect)
+{
+    if (defect.features.area < 0) {
+        defect.features = pieceFeatures(defect);
+    }
+    return defect.features;
+}
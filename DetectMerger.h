@@ -1,8 +1,22 @@
 #pragma once 
 #include <vector> 
 #include <unordered_map>
+#include <map>
+#include <array>
+#include <algorithm>
+#include <iterator>
 #include <iostream>
+#include <climits>
 #include "DataStructs.h" 
+#include "MergePolicy.h"
+#include "DisjointSet.h"
+#include "IntervalIndex.h"
+#include "BitMask.h"
+#include "MaskProfile.h"
+#include "MaskPool.h"
+#include "PolylineGeometry.h"
+#include "DefectFeatures.h"
+#include "MergeStats.h"
 
 /**
  * Функция, преобразующая дефекты из разных частей изображения в список дефектов всего изображения.
@@ -14,50 +28,24 @@
  *    Координаты как батчей, так и дефектов, указаны относительно исходного изображения
  *
  * @param resultDetects - выходной список дефектов.
+ *    Маска объединенного дефекта не собирается, а возвращается списком фрагментов (DetectResult::fragments),
+ *    плотную маску при необходимости строит materializeMask
  * @return
  */
 
 
  // Сопоставление ID класса дефекта с его строковым представлением
-std::unordered_map<int, std::string> defectClassMapping = {
-    {0, "C.2.3"}, {1, "C.2.1"}, {2, "T.1.4"}, {3, "C.2.4"},
-    {4, "B.4"}, {5, "O.1.1"}, {6, "C.2.2"}, {7, "T.1.2"},
-    {8, "T.2.2.2"}, {9, "C.3.1"}, {10, "T.3.1"}, {11, "B.7"},
-    {12, "B.3"}, {13, "T.2.6"}, {14, "C.3.2"}, {15, "O.1.2"},
-    {16, "O.2.3"}, {17, "T.1.3"}, {18, "T.1.1"}, {19, "T.2.1"},
-    {20, "T.2.2.1"}, {21, "C.1.2"}, {22, "T.3.2"}, {23, "B.1"}
-};
+std::unordered_map<int, std::string> defectClassMapping = [] {
+    std::unordered_map<int, std::string> mapping;
+    for (const auto& info : defectClasses) {
+        mapping.emplace(info.klass, info.code);
+    }
+    return mapping;
+}();
 
-// Функция для преобразования id класса дефекта в DefectType
-DefectType classifyDefect(int klass) {
-    auto it = defectClassMapping.find(klass);
-    if (it != defectClassMapping.end()) {
-        const std::string& defectClass = it->second;
-        if (defectClass == "B.7") return DefectType::Seam;  // Шов
-        else if (defectClass == "T.1.1") return DefectType::Blisna;     // Близна
-        else if (defectClass == "T.1.2") return DefectType::ThreadSpan; // Пролет
-        else if (defectClass == "T.1.3") return DefectType::DoubleThreadY;  // Двойная нить по основе 
-        else if (defectClass == "T.1.4") return DefectType::DoubleThreadX;  // Двойная нить по утку 
-        else if (defectClass == "T.2.1") return DefectType::ViolationOfWeaving; // Нарушение ткацкого переплетения 
-        else if (defectClass == "T.2.2.1") return DefectType::Dissection;   // Рассечка
-        else if (defectClass == "T.2.2.2") return DefectType::StuffedFluff; // Редкое место (Затканный пух) 
-        else if (defectClass == "T.2.6") return DefectType::IncompleteDoubleThread; // Недолет
-        else if (defectClass == "T.3.1") return DefectType::SparseThread;   // Недосека (разреженное расположение)
-        else if (defectClass == "T.3.2") return DefectType::LightStrip;     // Забоина (Светлая полоса)
-        else if (defectClass == "O.1.1") return DefectType::Fold;   // Складка
-        else if (defectClass == "O.1.2") return DefectType::Crease; // Залом
-        else if (defectClass == "O.2.3") return DefectType::HangingString;  // Висячая нить
-        else if (defectClass == "B.3") return DefectType::WaterLeak;    // Затек воды
-        else if (defectClass == "B.4") return DefectType::Spot;     // Пятно
-        else if (defectClass == "C.1.2") return DefectType::Contamination;  // Засоренность
-        else if (defectClass == "C.2.1") return DefectType::Knot;   // Узел
-        else if (defectClass == "C.2.2") return DefectType::Thickening; // Слет (утолщенное место)
-        else if (defectClass == "C.2.3") return DefectType::ThreadThickeningY;  // Утолщение нити по основе 
-        else if (defectClass == "C.2.4") return DefectType::ThreadThickeningX;  // Утолщение нити по утку 
-        else if (defectClass == "C.3.1") return DefectType::DifferentThreadY;   // Отличающаяся нить по основе  
-        else if (defectClass == "C.3.2") return DefectType::DifferentThreadX;   // Отличающаяся нить по утку 
-    }
-    return DefectType::Default;
+// Функция для преобразования id класса дефекта в DefectType (по таблице политик, см. MergePolicy.h)
+DefectType classifyDefect(int64_t klass) {
+    return defectPolicy(klass).type;
 }
 
 cv::Mat mergeMasks(const cv::Mat& m1, const cv::Mat& m2, const cv::Rect2i& r1, const cv::Rect2i& r2)
@@ -66,6 +54,8 @@ cv::Mat mergeMasks(const cv::Mat& m1, const cv::Mat& m2, const cv::Rect2i& r1, c
     cv::Rect2i mergedRect = r1 | r2;
 
     cv::Mat mergedMask = cv::Mat::zeros(mergedRect.size(), CV_8UC1);
+    MERGE_STATS_COUNT(MaskMerges, -1, 1);
+    MERGE_STATS_COUNT(MaskBytes, -1, mergedRect.area());
 
     // Создание белой маски размером объединенного прямоугольника
     //cv::Mat mergedMask = cv::Mat::ones(mergedRect.size(), CV_8UC1) * 255;
@@ -74,285 +64,1087 @@ cv::Mat mergeMasks(const cv::Mat& m1, const cv::Mat& m2, const cv::Rect2i& r1, c
     cv::Rect2i r1_in_merged = cv::Rect2i(r1.x - mergedRect.x, r1.y - mergedRect.y, r1.width, r1.height);
     cv::Rect2i r2_in_merged = cv::Rect2i(r2.x - mergedRect.x, r2.y - mergedRect.y, r2.width, r2.height);
 
-    // Копирование масок m1 и m2 в объединенную маску в соответствующих позициях
-    m1.copyTo(mergedMask(r1_in_merged));
-    m2.copyTo(mergedMask(r2_in_merged));
+    // Наложение масок m1 и m2 на объединенную маску в соответствующих позициях (по своей маске,
+    // чтобы нули второй не затирали пиксели первой)
+    m1.copyTo(mergedMask(r1_in_merged), m1);
+    m2.copyTo(mergedMask(r2_in_merged), m2);
 
     return mergedMask;
 }
 
+// Наложение маски дефекта (плотной, собранной из фрагментов или растеризованной из линий) на target так,
+// что левый верхний угол рамки дефекта попадает в точку origin. Накладываются только ненулевые пиксели
+void drawDefectMask(const DetectResult& defect, cv::Mat& target, cv::Point2i origin)
+{
+    if (!defect.mask.empty()) {
+        defect.mask.copyTo(target(cv::Rect2i(origin, defect.mask.size())), defect.mask);
+    }
+    for (const auto& fragment : defect.fragments) {
+        fragment.mask.copyTo(target(cv::Rect2i(origin + fragment.offset, fragment.mask.size())), fragment.mask);
+    }
+    if (defect.mask.empty()) {
+        // Линии ограничиваются рамкой дефекта, как если бы они были нарисованы в его маске
+        cv::Mat defectArea = target(cv::Rect2i(origin, defect.rect.size()));
+        drawPolylines(defect.lines, defectArea, -defect.rect.tl());
+    }
+}
 
-void horizontalDefect(const DetectResult& defect, std::vector<DetectResult>& horizontalMergedDefectsOneType)
+// Нужна ли сборка маски: есть несобранные фрагменты или только векторная геометрия
+bool maskPending(const DetectResult& defect)
 {
-    bool mergedHor = false;
-    for (auto& mergedDefect : horizontalMergedDefectsOneType)
-    {
-        // Проверяем, пересекаются ли дефекты по вертикали
-        if ((defect.rect.y < mergedDefect.rect.y + mergedDefect.rect.height) &&
-            (mergedDefect.rect.y < defect.rect.y + defect.rect.height))
-        {
-            // Объединяем дефекты
-            cv::Rect2i newRect = mergedDefect.rect | defect.rect;
-            cv::Mat newMask = mergeMasks(mergedDefect.mask, defect.mask, mergedDefect.rect, defect.rect);
-
-            mergedDefect.rect = newRect;
-            mergedDefect.mask = newMask;
-            mergedDefect.prob = std::max(mergedDefect.prob, defect.prob); // берем максимальную вероятность
-            mergedHor = true;
-            break;
+    return !defect.fragments.empty() || (defect.mask.empty() && !defect.lines.empty());
+}
+
+// Сборка плотной маски из фрагментов и линий при первом обращении. Фрагменты после сборки освобождаются,
+// линии остаются как векторное описание дефекта
+const cv::Mat& materializeMask(DetectResult& defect)
+{
+    if (maskPending(defect)) {
+        cv::Mat mask = cv::Mat::zeros(defect.rect.size(), CV_8UC1);
+        MERGE_STATS_COUNT(MaskBuilds, defect.klass, 1);
+        MERGE_STATS_COUNT(MaskBytes, defect.klass, defect.rect.area());
+        drawDefectMask(defect, mask, cv::Point2i(0, 0));
+        defect.mask = mask;
+        defect.fragments.clear();
+    }
+    return defect.mask;
+}
+
+// Рамка ненулевых пикселей маски, пустая, если маска пуста
+cv::Rect2i nonZeroBounds(const cv::Mat& mask)
+{
+    int left = mask.cols, right = -1, top = mask.rows, bottom = -1;
+    auto nonZero = [](uchar value) { return value != 0; };
+    for (int y = 0; y < mask.rows; ++y) {
+        // Строка просматривается с обоих краев: пиксели между первым и последним ненулевым не читаются
+        const uchar* row = mask.ptr<uchar>(y);
+        const uchar* first = std::find_if(row, row + mask.cols, nonZero);
+        if (first == row + mask.cols) {
+            continue;
         }
+        const uchar* last = std::find_if(std::make_reverse_iterator(row + mask.cols), std::make_reverse_iterator(first + 1),
+            nonZero).base() - 1;
+        left = std::min(left, static_cast<int>(first - row));
+        right = std::max(right, static_cast<int>(last - row));
+        top = std::min(top, y);
+        bottom = y;
     }
-    if (!mergedHor) {
-        horizontalMergedDefectsOneType.push_back(defect);
+    return (right < 0) ? cv::Rect2i() : cv::Rect2i(left, top, right - left + 1, bottom - top + 1);
+}
+
+// Упакованная маска дефекта (1 бит на пиксель). Фрагменты накладываются через OR без промежуточной плотной маски
+BitMask packMask(const DetectResult& defect)
+{
+    if (defect.fragments.empty()) {
+        if (defect.mask.empty() && !defect.lines.empty()) {
+            cv::Mat mask = cv::Mat::zeros(defect.rect.size(), CV_8UC1);
+            drawDefectMask(defect, mask, cv::Point2i(0, 0));
+            return BitMask::fromMat(mask);
+        }
+        return BitMask::fromMat(defect.mask);
+    }
+    BitMask bits(defect.rect.height, defect.rect.width);
+    if (!defect.mask.empty()) {
+        bits.orShifted(BitMask::fromMat(defect.mask), cv::Point2i(0, 0));
+    }
+    for (const auto& fragment : defect.fragments) {
+        bits.orShifted(BitMask::fromMat(fragment.mask), fragment.offset);
+    }
+    // Без плотной маски линии объединенного дефекта накладываются поверх фрагментов, как в drawDefectMask
+    if (defect.mask.empty() && !defect.lines.empty()) {
+        cv::Mat lines = cv::Mat::zeros(defect.rect.size(), CV_8UC1);
+        drawPolylines(defect.lines, lines, -defect.rect.tl());
+        bits.orShifted(BitMask::fromMat(lines), cv::Point2i(0, 0));
     }
+    return bits;
 }
 
+// То же в маску из пула: упаковка на месте, без промежуточных BitMask и плотных масок
+void packMask(const DetectResult& defect, MaskProfile& profile, MaskPool& pool)
+{
+    if (defect.fragments.empty() && defect.mask.empty() && !defect.lines.empty()) {
+        cv::Mat mask = pool.scratchMask(defect.rect.size());
+        drawDefectMask(defect, mask, cv::Point2i(0, 0));
+        profile.resetMask(mask.rows, mask.cols).orMat(mask, cv::Point2i(0, 0), pool.rowWords());
+    }
+    else if (defect.fragments.empty()) {
+        profile.resetMask(defect.mask.rows, defect.mask.cols).orMat(defect.mask, cv::Point2i(0, 0), pool.rowWords());
+    }
+    else {
+        BitMask& bits = profile.resetMask(defect.rect.height, defect.rect.width);
+        if (!defect.mask.empty()) {
+            bits.orMat(defect.mask, cv::Point2i(0, 0), pool.rowWords());
+        }
+        for (const auto& fragment : defect.fragments) {
+            bits.orMat(fragment.mask, fragment.offset, pool.rowWords());
+        }
+        if (defect.mask.empty() && !defect.lines.empty()) {
+            cv::Mat lines = pool.scratchMask(defect.rect.size());
+            drawPolylines(defect.lines, lines, -defect.rect.tl());
+            bits.orMat(lines, cv::Point2i(0, 0), pool.rowWords());
+        }
+    }
+    profile.rebuild();
+}
 
+// Куски горизонтального дефекта из одной строки батчей: пересекаются ли по вертикали
+bool horizontalNeighbours(const cv::Rect2i& a, const cv::Rect2i& b)
+{
+    return (a.y < b.y + b.height) && (b.y < a.y + a.height);
+}
 
-void verticalDefectHorizontally(const DetectResult& defect, std::vector<DetectResult>& verticalMergedDefectsOneType) {
-    bool merged = false;
+// Куски вертикального дефекта из одной строки батчей: зазор по горизонтали не больше extension
+bool verticalNeighboursHorizontally(const cv::Rect2i& a, const cv::Rect2i& b, int extension = rectExtension)
+{
+    return (b.x + b.width >= a.x - extension) && (a.x + a.width >= b.x - extension);
+}
 
-    for (auto& mergedDefect : verticalMergedDefectsOneType) {
-        // Расширяем рамку одного из дефектов для проверки окрестности
-        cv::Rect2i expandedRect = defect.rect;
+// Группы кусков из разных строк: пересекается ли рамка a, расширенная на extension, с рамкой b
+bool verticalNeighbours(const cv::Rect2i& a, const cv::Rect2i& b, int extension = rectExtension)
+{
+    cv::Rect2i expandedRect(a.x - extension, a.y - extension,
+        a.width + 2 * extension, a.height + 2 * extension);
+    return (expandedRect & b).area() > 0;
+}
 
-        expandedRect.x = defect.rect.x - 10;
+// Область маски, в которой ищутся реальные пиксели дефекта при проверке касания двух рамок.
+// Возвращает false, если рамки не соприкасаются или область не помещается в маску.
+// withinDefect - область задана в маске defect, иначе в маске mergedDefect
+bool intersectionMaskROI(const cv::Rect2i& defectRect, const cv::Size& defectMaskSize,
+    const cv::Rect2i& mergedRect, const cv::Size& mergedMaskSize, cv::Rect2i& roi, bool& withinDefect,
+    int extension = rectExtension)
+{
+    // Расширяем дефектный прямоугольник для учета возможных пересечений
+    cv::Rect2i expandedRect = defectRect;
+    expandedRect.x = (defectRect.x < extension) ? 0 : defectRect.x - extension;
+    expandedRect.y = (defectRect.y < extension) ? 0 : defectRect.y - extension;
+    expandedRect.width += 2 * extension;
+    expandedRect.height += 2 * extension;
 
-        // Проверяем, пересекаются ли расширенные дефекты
-        if (mergedDefect.rect.x + mergedDefect.rect.width >= expandedRect.x &&
-            mergedDefect.rect.x <= defect.rect.x + defect.rect.width){
+    // Вычисляем пересечение между расширенным дефектом и объединенным дефектом
+    cv::Rect2i intersectionRect = expandedRect & mergedRect;
 
-            // Объединяем дефекты
-            cv::Rect2i newRect = mergedDefect.rect | defect.rect;
-            cv::Mat newMask = mergeMasks(mergedDefect.mask, defect.mask, mergedDefect.rect, defect.rect);
+    // допуск extension включительно
+    // Проверка на пересечение или соприкосновение
+    if (intersectionRect.area() <= 0) {
+        return false;
+    }
 
-            mergedDefect.rect = newRect;
-            mergedDefect.mask = newMask;
-            mergedDefect.prob = std::max(mergedDefect.prob, defect.prob); // берем максимальную вероятность
-            merged = true;
-            break;
-        }
+    // Определяем ROI в пределах маски defect.mask
+    // х и у имеют значение 0, если дефекты пересекаются слева от defect.mask, иначе intersectionRect.* - defect.rect.*
+    int dx = std::max(0, intersectionRect.x - defectRect.x);
+    int dy = std::max(0, intersectionRect.y - defectRect.y);
+
+    // Ширина и высота рамки должны быть не меньше extension. Если и так не меньше, то берем минимальное
+    // из ширины/высоты пересечения и доступной ширины/высоты в маске defect
+    int dw = std::max(extension, std::min(intersectionRect.width, defectMaskSize.width - dx));
+    int dh = std::max(extension, std::min(intersectionRect.height, defectMaskSize.height - dy));
+    // Сложно, но работает только так...
+
+    // Если пересечение происходит в левой части defect, то все хорошо, но если справа, то смотрим 
+    // относительно правого дефекта. Правый - это mergedDefect
+    withinDefect = (dx + dw <= defectRect.width) && (dy + dh <= defectRect.height);
+    if (!withinDefect) {
+        dx = std::max(0, intersectionRect.x - mergedRect.x);
+        dy = std::max(0, intersectionRect.y - mergedRect.y);
+        dw = std::max(extension, std::min(intersectionRect.width, mergedMaskSize.width - dx));
+        dh = std::max(extension, std::min(intersectionRect.height, mergedMaskSize.height - dy));
     }
+    roi = cv::Rect2i(dx, dy, dw, dh);
+
+    // Проверяем, что ROI находится в пределах соответствующей маски
+    const cv::Size& maskSize = withinDefect ? defectMaskSize : mergedMaskSize;
+    return !(dx < 0 || dy < 0 || dx + dw > maskSize.width || dy + dh > maskSize.height);
+}
 
-    // Если дефект не был объединен ни с одним из существующих, добавляем его в список
-    if (!merged) {
-        verticalMergedDefectsOneType.emplace_back(defect);
+// Есть ли реальные пиксели дефекта в области касания рамок (intersectionMaskROI). Маски упакованные (BitMask
+// или MaskProfile): проверка останавливается на первом ненулевом слове области, а у MaskProfile область у края
+// маски проверяется по профилю края
+template <typename PackedMask>
+bool checkForRealDefectsInIntersection(const cv::Rect2i& defectRect, const PackedMask& defectBits,
+    const cv::Rect2i& mergedRect, const PackedMask& mergedBits, int extension = rectExtension)
+{
+    cv::Rect2i roi;
+    bool withinDefect = true;
+    if (!intersectionMaskROI(defectRect, defectBits.size(), mergedRect, mergedBits.size(), roi, withinDefect, extension)) {
+        return false;
     }
+    MERGE_STATS_COUNT(RegionChecks, -1, 1);
+    return (withinDefect ? defectBits : mergedBits).anyNonZero(roi);
 }
 
+// Дефект строки батчей для поиска внутренних дефектов
+struct RowDefect
+{
+    cv::Rect2i rect;
+    cv::Rect2i batchRect;   // рамка батча, в котором найден дефект
+    MergePolicy policy;
+};
 
-void verticalDefect(const DetectResult& defect, std::vector<DetectResult>& verticalMergedDefectsOneType)
+// Буферы поиска внутренних дефектов, переиспользуемые между строками
+struct InteriorSearchBuffers
 {
-    bool mergedVer = false;
-    for (auto& mergedDefect : verticalMergedDefectsOneType)
-    {
-        // Расширяем рамку одного из дефектов для проверки окрестности
-        cv::Rect2i expandedRect = defect.rect;
-        // Расширяем рамку, не вычитая -10, если x и y равны 0
-        expandedRect.x = (defect.rect.x < 10) ? 0 : defect.rect.x - 10;
-        expandedRect.y = (defect.rect.y < 10) ? 0 : defect.rect.y - 10;
-        expandedRect.width += 20;
-        expandedRect.height += 20;
-
-        // Вычисляем пересечение расширенной рамки с текущим дефектом
-        cv::Rect2i intersectionRect = expandedRect & mergedDefect.rect;
-
-        // Проверяем пересечение расширенных рамок
-        if (intersectionRect.area() > 0)
-        {
-            // Объединяем текущий дефект с уже найденным
-            cv::Rect2i newRect = mergedDefect.rect | defect.rect;
-            cv::Mat newMask = mergeMasks(mergedDefect.mask, defect.mask, mergedDefect.rect, defect.rect);
-
-            mergedDefect.rect = newRect;
-            mergedDefect.mask = newMask;
-            mergedDefect.prob = std::max(mergedDefect.prob, defect.prob); // берем максимальную вероятность
-            mergedVer = true;
-            break;
+    std::array<std::vector<Interval>, defectTypeCount> projections;
+    std::vector<Interval> active;
+};
+
+/**
+ * Поиск внутренних дефектов строки батчей, которые заведомо ни с чем не объединятся.
+ *  Дефект внутренний, если его рамка, расширенная на досягаемость типа (удвоенный допуск - с запасом на
+ *  несимметричное расширение рамки у края изображения в intersectionMaskROI), лежит внутри рамки его батча,
+ *  и ни один дефект того же типа в строке не подходит к нему ближе досягаемости по оси, по которой сравниваются
+ *  куски строки (для локальных - по обеим осям). Куски других строк лежат в своих батчах и к внутреннему
+ *  дефекту не дотягиваются, поэтому он выдается как есть, минуя компоненты.
+ *  Рамки кусков должны лежать внутри рамок своих батчей, батчи не перекрываются.
+ *
+ * @param interior - признак внутреннего дефекта для каждого элемента defects
+ * @param buffers - проекции и буфер заметающей прямой
+ * @param tolerances - допуски объединения кадра
+ */
+void interiorDefects(const std::vector<RowDefect>& defects, std::vector<char>& interior, InteriorSearchBuffers& buffers,
+    const MergeTolerances& tolerances)
+{
+    interior.assign(defects.size(), 0);
+    auto& projections = buffers.projections;
+    for (auto& typeProjections : projections) {
+        typeProjections.clear();
+    }
+    for (int i = 0; i < static_cast<int>(defects.size()); ++i) {
+        const RowDefect& defect = defects[i];
+        if (defect.policy.strategy == MergeStrategy::None) {
+            continue;
         }
+        int reach = 2 * tolerances.extension(defect.policy.type);
+        cv::Rect2i expandedRect(defect.rect.x - reach, defect.rect.y - reach,
+            defect.rect.width + 2 * reach, defect.rect.height + 2 * reach);
+        interior[i] = (expandedRect & defect.batchRect) == expandedRect;
+
+        // Вертикальные дефекты строки объединяются по близости по x, остальные сравниваются по y
+        const cv::Rect2i& rect = defect.rect;
+        projections[static_cast<int>(defect.policy.type)].push_back((defect.policy.strategy == MergeStrategy::Vertical)
+            ? Interval{ rect.x, rect.x + rect.width, i } : Interval{ rect.y, rect.y + rect.height, i });
     }
 
-    // Если вертикально не объединяется, то записываем в результат
-    if (!mergedVer) {
-        verticalMergedDefectsOneType.push_back(defect);
+    for (int t = 0; t < defectTypeCount; ++t) {
+        if (projections[t].size() < 2) {
+            continue;
+        }
+        int reach = 2 * tolerances.extension(static_cast<DefectType>(t));
+        forEachOverlappingPair(projections[t], reach, [&](int i, int j) {
+            const cv::Rect2i& a = defects[i].rect;
+            const cv::Rect2i& b = defects[j].rect;
+            bool near = (defects[i].policy.strategy != MergeStrategy::HangingString)
+                || (a.x <= b.x + b.width + reach && b.x <= a.x + a.width + reach);
+            if (near) {
+                interior[i] = 0;
+                interior[j] = 0;
+            }
+            }, buffers.active);
     }
 }
 
+std::vector<char> interiorDefects(const std::vector<RowDefect>& defects)
+{
+    std::vector<char> interior;
+    InteriorSearchBuffers buffers;
+    interiorDefects(defects, interior, buffers, mergeTolerances());
+    return interior;
+}
 
-const int rectExtension = 10;
+// Группа кусков, сравниваемая с другими группами при объединении строк батчей.
+// Для протяженных дефектов - куски, слитые в пределах одной строки, для локальных - отдельный кусок
+struct PieceGroup
+{
+    cv::Rect2i rect;    // объединенная рамка кусков группы
+    int piece;          // любой кусок группы (для локальных дефектов - единственный)
+};
 
-bool checkForRealDefectsInIntersection(const DetectResult& defect, const DetectResult& mergedDefect)
+/**
+ * Компоненты связности кусков дефектов одного типа.
+ *  Куски - вершины графа, ребра добавляются для каждой пары соседних кусков (а не только для первого совпадения),
+ *  поэтому кусок, соединяющий два уже найденных дефекта, сливает их в один.
+ *  Маска итогового дефекта собирается один раз на компоненту в collect().
+ */
+struct DefectComponents
 {
-    // Расширяем дефектный прямоугольник для учета возможных пересечений
-    cv::Rect2i expandedRect = defect.rect;
-    expandedRect.x = (defect.rect.x < rectExtension) ? 0 : defect.rect.x - rectExtension;
-    expandedRect.y = (defect.rect.y < rectExtension) ? 0 : defect.rect.y - rectExtension;
-    expandedRect.width += 2 * rectExtension;
-    expandedRect.height += 2 * rectExtension;
+    MergeStrategy strategy = MergeStrategy::None;
+    int extension = rectExtension;      // допуск объединения типа
 
-    // Вычисляем пересечение между расширенным дефектом и объединенным дефектом
-    cv::Rect2i intersectionRect = expandedRect & mergedDefect.rect;
+    std::vector<DetectResult> pieces;   // все куски в порядке поступления
+    std::vector<MaskProfile> profiles;  // упакованные маски кусков с профилями краев для проверки касания
+                                        // (только HangingString), строятся при первой проверке куска
+    DisjointSet sets;
+    std::vector<cv::Rect2i> rects;      // объединенная рамка компоненты, действительна для корней
+    std::vector<float> probs;           // максимальная вероятность компоненты, действительна для корней
+    std::vector<DefectFeatures> features;   // признаки компоненты (DefectFeatures.h), действительны для корней
 
-    // const int rectExtension = 10 включительно
-    // Проверка на пересечение или соприкосновение
-    if (intersectionRect.area() > 0)
-    {
-        // Определяем ROI в пределах маски defect.mask
-        // х и у имеют значение 0, если дефекты пересекаются слева от defect.mask, иначе intersectionRect.* - defect.rect.*
-        int dx = std::max(0, intersectionRect.x - defect.rect.x);
-        int dy = std::max(0, intersectionRect.y - defect.rect.y);
-
-        // Ширина и высота рамки должны быть не меньше rectExtension. Если и так не меньше, то берем минимальное
-        // из ширины/высоты пересечения и доступной ширины/высоты в маске defect
-        int dw = std::max(rectExtension, std::min(intersectionRect.width, defect.mask.cols - dx));
-        int dh = std::max(rectExtension, std::min(intersectionRect.height, defect.mask.rows - dy));
-        // Сложно, но работает только так...
-
-        // Если пересечение происходит в левой части defect, то все хорошо, но если справа, то смотрим 
-        // относительно правого дефекта. Правый - это mergedDefect
-        bool withinDefect = (dx + dw <= defect.rect.width) && (dy + dh <= defect.rect.height);
-        if (!withinDefect) {
-            dx = std::max(0, intersectionRect.x - mergedDefect.rect.x);
-            dy = std::max(0, intersectionRect.y - mergedDefect.rect.y);
-            dw = std::max(rectExtension, std::min(intersectionRect.width, mergedDefect.mask.cols - dx));
-            dh = std::max(rectExtension, std::min(intersectionRect.height, mergedDefect.mask.rows - dy));
-        }
-        cv::Rect2i defectMaskROI_rect(dx, dy, dw, dh);
-
-        // Проверяем, что ROI находится в пределах соответствующей маски
-        const cv::Mat& mask = withinDefect ? defect.mask : mergedDefect.mask;
-        if (dx < 0 || dy < 0 || dx + dw > mask.cols || dy + dh > mask.rows) {
-            return false;
+    std::vector<PieceGroup> groups;     // группы всех обработанных строк
+    IntervalIndex groupIndex;           // проекции групп на ось projection()
+    int rowBegin = 0;                   // индекс первого куска текущей строки
+
+    MaskPool* maskPool = nullptr;       // пул масок кусков (MergeArena), без пула маски выделяются заново
+
+    // Рабочие буферы mergeRow и collect: очищаются, но не освобождаются, чтобы повторные объединения
+    // не выделяли память
+    std::vector<Interval> rowIntervals;
+    std::vector<Interval> rowSpans;
+    std::vector<Interval> activeIntervals;
+    std::vector<char> emitted;
+    std::vector<int> componentOf;
+    std::vector<int> memberEnds;
+    std::vector<int> members;
+    std::vector<char> overlapping;
+    BitMask overlapBits;
+    std::vector<uint64_t> overlapRowWords;
+
+    // Внутренний дефект (см. interiorDefects): в объединении не участвует, хранится только ради порядка выдачи
+    struct InteriorDefect
+    {
+        int position;           // число кусков pieces, добавленных раньше него
+        DetectResult defect;
+    };
+    std::vector<InteriorDefect> interior;
+
+    int add(DetectResult&& defect)
+    {
+        MERGE_STATS_COUNT(Pieces, defect.klass, 1);
+        int index = sets.add();
+        rects.push_back(defect.rect);
+        probs.push_back(defect.prob);
+        // Признаки куска запоминаются в нем самом: componentFeatures пересчитывает пересекающиеся куски
+        // без повторного прохода по их маскам. Признаки, заполненные детектором, не пересчитываются
+        features.push_back(defectFeatures(defect));
+        profiles.emplace_back();
+        pieces.emplace_back(std::move(defect));
+        return index;
+    }
+
+    // Внутренний дефект выдается в collect() на том месте, которое он занял бы как одиночная компонента
+    void addInterior(DetectResult&& defect)
+    {
+        MERGE_STATS_COUNT(InteriorDefects, defect.klass, 1);
+        interior.push_back({ static_cast<int>(pieces.size()), std::move(defect) });
+    }
+
+    // Резервирование памяти под count кусков, чтобы add() не выделял память на каждый кусок
+    void reserve(size_t count)
+    {
+        pieces.reserve(count);
+        profiles.reserve(count);
+        sets.reserve(count);
+        rects.reserve(count);
+        probs.reserve(count);
+        features.reserve(count);
+        groups.reserve(count);
+        groupIndex.reserve(count);
+    }
+
+    // Тип дефектов компонент: способ объединения и допуск из снимка допусков кадра (см. MergePolicy.h)
+    void configure(DefectType defectType, const MergeTolerances& tolerances)
+    {
+        strategy = mergeStrategy(defectType);
+        extension = tolerances.extension(defectType);
+    }
+
+    // Проекция рамки на ось, по которой ищутся соседи: для вертикальных дефектов - x, для остальных - y
+    template <MergeStrategy S>
+    static Interval projectionAs(const cv::Rect2i& rect, int id)
+    {
+        if constexpr (S == MergeStrategy::Vertical) {
+            return { rect.x, rect.x + rect.width, id };
+        }
+        else {
+            return { rect.y, rect.y + rect.height, id };
         }
+    }
 
-        cv::Mat defectMaskROI = mask(defectMaskROI_rect);
-        return cv::countNonZero(defectMaskROI) > 0;
+    Interval projection(const cv::Rect2i& rect, int id) const
+    {
+        return (strategy == MergeStrategy::Vertical)
+            ? projectionAs<MergeStrategy::Vertical>(rect, id)
+            : projectionAs<MergeStrategy::Horizontal>(rect, id);
     }
 
-    return false;
-}
+    // Упакованная маска куска с профилями краев, строится при первом обращении. Векторный кусок растеризуется,
+    // только если его сравнивают с растровым
+    const MaskProfile& pieceProfile(int i)
+    {
+        const DetectResult& piece = pieces[i];
+        if (profiles[i].empty() && (!piece.mask.empty() || !piece.fragments.empty() || !piece.lines.empty())) {
+            if (maskPool != nullptr) {
+                profiles[i] = maskPool->acquire(piece.rect.height, piece.rect.width);
+                packMask(piece, profiles[i], *maskPool);
+            }
+            else {
+                profiles[i] = MaskProfile(packMask(piece));
+            }
+        }
+        return profiles[i];
+    }
 
+    // Касаются ли куски локального дефекта. Два векторных куска сравниваются по расстоянию между отрезками,
+    // без растеризации, остальные - по пикселям масок
+    bool piecesTouch(int i, int j)
+    {
+        const DetectResult& a = pieces[i];
+        const DetectResult& b = pieces[j];
+        if (!a.lines.empty() && a.mask.empty() && !b.lines.empty() && b.mask.empty()) {
+            MERGE_STATS_COUNT(PolylineChecks, a.klass, 1);
+            return verticalNeighbours(a.rect, b.rect, extension) && polylinesTouch(a.lines, b.lines, extension);
+        }
+        MERGE_STATS_COUNT(MaskChecks, a.klass, 1);
+        return checkForRealDefectsInIntersection(a.rect, pieceProfile(i), b.rect, pieceProfile(j), extension);
+    }
 
-// Функция для обработки дефектов с проверкой наличия дефектов в зоне пересечения
-void hangingStringDefect(const DetectResult& defect, std::vector<DetectResult>& hangingStringMergedDefects)
-{
-    bool merged = false;
-    for (auto& mergedDefect : hangingStringMergedDefects)
+    // Соседство кусков i и j одной строки батчей
+    template <MergeStrategy S>
+    bool rowNeighboursAs(int i, int j) const
     {
-        bool hasRealDefects = checkForRealDefectsInIntersection(defect, mergedDefect);
+        if constexpr (S == MergeStrategy::Horizontal) {
+            return horizontalNeighbours(pieces[i].rect, pieces[j].rect);
+        }
+        else {
+            return verticalNeighboursHorizontally(pieces[i].rect, pieces[j].rect, extension);
+        }
+    }
 
-        // Проверяем, пересекается ли расширенная рамка текущего дефекта с рамкой объединенного дефектаa
-        if (hasRealDefects)
-        {
-            cv::Rect2i newRect = mergedDefect.rect | defect.rect;
-            cv::Mat newMask = mergeMasks(mergedDefect.mask, defect.mask, mergedDefect.rect, defect.rect);
+    bool rowNeighbours(int i, int j) const
+    {
+        return (strategy == MergeStrategy::Horizontal)
+            ? rowNeighboursAs<MergeStrategy::Horizontal>(i, j)
+            : rowNeighboursAs<MergeStrategy::Vertical>(i, j);
+    }
 
-            mergedDefect.rect = newRect;
-            mergedDefect.mask = newMask;
-            mergedDefect.prob = std::max(mergedDefect.prob, defect.prob);
-            merged = true;
-            break;
+    // Наибольший зазор между проекциями соседних групп, если более поздняя группа начинается на строке top.
+    // Рамку локального дефекта у верхнего края изображения intersectionMaskROI расширяет несимметрично,
+    // и область проверки дотягивается вниз до 2 * extension
+    template <MergeStrategy S>
+    int groupReachAs(int top) const
+    {
+        if constexpr (S == MergeStrategy::HangingString) {
+            return extension + std::clamp(extension - top, 0, extension);
+        }
+        else {
+            return extension;
         }
     }
-    // Если дефект не был объединен ни с одним из существующих, добавляем его в список
-    if (!merged) {
-        hangingStringMergedDefects.emplace_back(defect);
+
+    // То же без сведений о положении группы: наибольшая досягаемость стратегии
+    int groupReach() const
+    {
+        return (strategy == MergeStrategy::HangingString) ? 2 * extension : extension;
     }
-}
 
-void mergeDefectsMy(std::vector<std::vector<BatchResult>> batchesDetects, std::vector<DetectResult>& resultDetects)
-{
-    // map для хранения промежуточных результатов вертикального объединения по каждому типу дефектов
-    std::unordered_map<DefectType, std::vector<DetectResult>> verticalMerged;
-    std::unordered_map<DefectType, std::vector<DetectResult>> otherMerged;
-    // по строкам
-    for (auto& batchesRow : batchesDetects) {
+    // Соседство групп при объединении строк: проекции на ось индекса не дальше groupReachAs (так кандидатов
+    // отбирает groupIndex), затем точная проверка. Для локальных дефектов later - группа более позднего куска
+    template <MergeStrategy S>
+    bool groupNeighboursAs(const PieceGroup& later, const PieceGroup& earlier)
+    {
+        Interval a = projectionAs<S>(later.rect, later.piece);
+        Interval b = projectionAs<S>(earlier.rect, earlier.piece);
+        int reach = groupReachAs<S>(later.rect.y);
+        if (a.lo > b.hi + reach || b.lo > a.hi + reach) {
+            return false;
+        }
+        if constexpr (S == MergeStrategy::HangingString) {
+            return piecesTouch(later.piece, earlier.piece);
+        }
+        else {
+            return verticalNeighbours(later.rect, earlier.rect, extension);
+        }
+    }
 
-        std::unordered_map<DefectType, std::vector<DetectResult>> verticalMergedHorizontally;
-        std::unordered_map<DefectType, std::vector<DetectResult>> horizontalMerged;
-
-        bool vertical = 0;
-        bool horizontal = 0;
-
-        // по батчам
-        for (auto& batch : batchesRow) {
-
-            // по дефектам
-            for (auto& defect : batch.detects) {
-                DefectType defectType = classifyDefect(defect.klass);
-                // Выбираем функцию обработки в зависимости от типа дефекта
-                switch (defectType) {
-                case DefectType::Seam:
-                case DefectType::ThreadSpan:
-                case DefectType::DoubleThreadX:
-                case DefectType::LightStrip:
-                case DefectType::ThreadThickeningX:
-                case DefectType::DifferentThreadX:
-                case DefectType::IncompleteDoubleThread:
-                case DefectType::SparseThread:
-                    horizontalDefect(defect, horizontalMerged[defectType]);
-                    horizontal = 1;
-                    break;
-                case DefectType::Thickening:
-                case DefectType::HangingString:
-                case DefectType::StuffedFluff:
-                case DefectType::Contamination:
-                case DefectType::Knot:
-                case DefectType::Spot:
-                    hangingStringDefect(defect, otherMerged[defectType]);
-                    break;
-                case DefectType::Dissection:
-                case DefectType::Blisna:
-                case DefectType::DoubleThreadY:
-                case DefectType::ThreadThickeningY:
-                case DefectType::Fold:
-                case DefectType::Crease:
-                case DefectType::WaterLeak:
-                case DefectType::ViolationOfWeaving:
-                    verticalDefectHorizontally(defect, verticalMergedHorizontally[defectType]);
-                    vertical = 1;
-                    break;
-                default:
-                    resultDetects.push_back(defect);
-                    break;
+    bool groupNeighbours(const PieceGroup& later, const PieceGroup& earlier)
+    {
+        switch (strategy) {
+        case MergeStrategy::Horizontal:
+            return groupNeighboursAs<MergeStrategy::Horizontal>(later, earlier);
+        case MergeStrategy::Vertical:
+            return groupNeighboursAs<MergeStrategy::Vertical>(later, earlier);
+        default:
+            return groupNeighboursAs<MergeStrategy::HangingString>(later, earlier);
+        }
+    }
+
+    void unite(int a, int b)
+    {
+        int ra = sets.find(a);
+        int rb = sets.find(b);
+        int root = sets.unite(ra, rb);
+        if (root < 0) {
+            return;
+        }
+        MERGE_STATS_COUNT(Unions, pieces[a].klass, 1);
+        rects[root] = rects[ra] | rects[rb];
+        probs[root] = std::max(probs[ra], probs[rb]); // берем максимальную вероятность
+        features[root] = mergeFeatures(features[ra], features[rb]);
+    }
+
+    // Объединение кусков, добавленных с начала текущей строки, между собой и с группами предыдущих строк.
+    // Стратегия выбирается один раз на строку, проверки соседства внутри циклов подставляются для нее
+    void mergeRow()
+    {
+        switch (strategy) {
+        case MergeStrategy::Horizontal:
+            mergeRowAs<MergeStrategy::Horizontal>();
+            break;
+        case MergeStrategy::Vertical:
+            mergeRowAs<MergeStrategy::Vertical>();
+            break;
+        case MergeStrategy::HangingString:
+            mergeRowAs<MergeStrategy::HangingString>();
+            break;
+        default:
+            rowBegin = static_cast<int>(pieces.size());
+            break;
+        }
+    }
+
+    template <MergeStrategy S>
+    void mergeRowAs()
+    {
+        int rowEnd = static_cast<int>(pieces.size());
+        int firstNewGroup = static_cast<int>(groups.size());
+        if (rowBegin == rowEnd) {
+            return;
+        }
+        [[maybe_unused]] int64_t klass = pieces[rowBegin].klass;
+
+        if constexpr (S == MergeStrategy::HangingString) {
+            for (int i = rowBegin; i < rowEnd; ++i) {
+                groups.push_back({ pieces[i].rect, i });
+            }
+        }
+        else {
+            // Объединение в пределах строки: заметающая прямая по оси, вдоль которой сравниваются куски,
+            // точная проверка только для пар-кандидатов
+            MERGE_STATS_SPAN("rowMerge", "class", klass);
+            rowIntervals.clear();
+            for (int i = rowBegin; i < rowEnd; ++i) {
+                rowIntervals.push_back(projectionAs<S>(pieces[i].rect, i));
+            }
+            int tolerance = (S == MergeStrategy::Horizontal) ? 0 : extension;
+            forEachOverlappingPair(rowIntervals, tolerance, [&](int i, int j) {
+                MERGE_STATS_COUNT(RowCandidates, klass, 1);
+                if (rowNeighboursAs<S>(i, j)) {
+                    unite(i, j);
+                }
+                }, activeIntervals);
+            // Каждая компонента строки становится группой. Пока строка не связана с предыдущими,
+            // рамка корня охватывает только куски этой строки
+            for (int i = rowBegin; i < rowEnd; ++i) {
+                if (sets.find(i) == i) {
+                    groups.push_back({ rects[i], i });
                 }
             }
         }
 
-        // Вертикальное объединение результатов этой строки для горизонтальных дефектов
-        for (auto& [defectType, defects] : horizontalMerged) {
-            if (horizontal) {
-                for (const auto& defect : defects) {
-                    verticalDefect(defect, verticalMerged[defectType]);
+        // Объединение групп строки с группами предыдущих строк (кандидаты из индекса групп)
+        // и между собой (заметающая прямая), затем группы строки добавляются в индекс одним слиянием
+        MERGE_STATS_SPAN("verticalPass", "class", klass);
+        rowSpans.clear();
+        int rowReach = extension;
+        for (int g = firstNewGroup; g < static_cast<int>(groups.size()); ++g) {
+            Interval span = projectionAs<S>(groups[g].rect, g);
+            int reach = groupReachAs<S>(groups[g].rect.y);
+            rowReach = std::max(rowReach, reach);
+            [[maybe_unused]] int candidates = 0;
+            groupIndex.query(span.lo, span.hi, reach, [&](int h) {
+                ++candidates;
+                if (groupNeighboursAs<S>(groups[g], groups[h])) {
+                    unite(groups[g].piece, groups[h].piece);
+                }
+                });
+            MERGE_STATS_COUNT(GroupCandidates, klass, candidates);
+            MERGE_STATS_SAMPLE(GroupCandidates, klass, candidates);
+            rowSpans.push_back(span);
+        }
+        forEachOverlappingPair(rowSpans, rowReach, [&](int g, int h) {
+            MERGE_STATS_COUNT(GroupCandidates, klass, 1);
+            // Для локальных дефектов первой передается группа более позднего куска
+            int later = std::max(g, h);
+            int earlier = std::min(g, h);
+            if (groupNeighboursAs<S>(groups[later], groups[earlier])) {
+                unite(groups[later].piece, groups[earlier].piece);
+            }
+            }, activeIntervals);
+        groupIndex.insert(rowSpans);
+
+        rowBegin = rowEnd;
+    }
+
+    // Перемещение итоговых дефектов в resultDetects, по одному на компоненту, в порядке первого куска
+    void collect(std::vector<DetectResult>& resultDetects)
+    {
+        collectIf(resultDetects, [](int) { return true; });
+        clear();
+    }
+
+    // Перемещение в resultDetects компонент, которые уже не могут вырасти. Следующие куски начнутся не выше bottom,
+    // а соседями считаются только рамки ближе extension. Оставшиеся куски и группы уплотняются
+    void collectClosed(int bottom, std::vector<DetectResult>& resultDetects)
+    {
+        collectIf(resultDetects, [&](int root) {
+            return rects[root].y + rects[root].height + extension <= bottom;
+            });
+        compact(bottom);
+    }
+
+    // Сборка и перемещение компонент, корни которых удовлетворяют isClosed. Признак выданного куска - в emitted.
+    // Куски компонент раскладываются в общий массив members: компонента c занимает [memberEnds[c - 1], memberEnds[c])
+    template <typename IsClosed>
+    void collectIf(std::vector<DetectResult>& resultDetects, IsClosed&& isClosed)
+    {
+        int count = static_cast<int>(pieces.size());
+        emitted.assign(count, 0);
+        componentOf.assign(count, -1);
+        memberEnds.clear();
+        for (int i = 0; i < count; ++i) {
+            int root = sets.find(i);
+            if (componentOf[root] == -1) {
+                componentOf[root] = isClosed(root) ? static_cast<int>(memberEnds.size()) : -2;
+                if (componentOf[root] >= 0) {
+                    memberEnds.push_back(0);
                 }
             }
+            if (componentOf[root] >= 0) {
+                ++memberEnds[componentOf[root]];
+                emitted[i] = 1;
+            }
+        }
+        // Размеры компонент - в начала, затем раскладка кусков по возрастанию индекса сдвигает начала в концы
+        int total = 0;
+        for (int& end : memberEnds) {
+            int size = end;
+            end = total;
+            total += size;
         }
+        members.resize(total);
+        for (int i = 0; i < count; ++i) {
+            if (emitted[i]) {
+                members[memberEnds[componentOf[sets.find(i)]]++] = i;
+            }
+        }
+
+        // Внутренние дефекты выдаются перед компонентами, первый кусок которых добавлен позже них.
+        // Все они к этому моменту закрыты: до низа их батча остается не меньше допуска
+        size_t nextInterior = 0;
+        auto emitInterior = [&](int position) {
+            for (; nextInterior < interior.size() && interior[nextInterior].position <= position; ++nextInterior) {
+                resultDetects.emplace_back(std::move(interior[nextInterior].defect));
+            }
+        };
+
+        for (size_t c = 0; c < memberEnds.size(); ++c) {
+            std::span<const int> component(members.data() + (c ? memberEnds[c - 1] : 0), members.data() + memberEnds[c]);
+            emitInterior(component.front());
+            int root = sets.find(component.front());
+            MERGE_STATS_SAMPLE(ComponentPieces, pieces[root].klass, component.size());
+            if (component.size() == 1) {
+                resultDetects.emplace_back(std::move(pieces[root]));
+                continue;
+            }
+
+            DetectResult mergedDefect;
+            mergedDefect.rect = rects[root];
+            mergedDefect.prob = probs[root];
+            mergedDefect.klass = pieces[component.front()].klass;
+            mergedDefect.features = componentFeatures(component, root);
 
-        // Вертикальное объединение результатов этой строки для толстых вертикальных дефектов
-        for (auto& [defectType, defects] : verticalMergedHorizontally) {
-            if (vertical) {
-                for (const auto& defect : defects) {
-                    verticalDefect(defect, verticalMerged[defectType]);
+            // Маска не собирается: запоминаются ссылки на маски кусков и их смещения,
+            // плотная маска строится один раз в materializeMask, если она понадобится
+            mergedDefect.fragments.reserve(component.size());
+            for (int i : component) {
+                DetectResult& piece = pieces[i];
+                cv::Point2i offset = piece.rect.tl() - mergedDefect.rect.tl();
+                if (!piece.mask.empty()) {
+                    mergedDefect.fragments.push_back({ std::move(piece.mask), offset });
                 }
+                for (auto& fragment : piece.fragments) {
+                    mergedDefect.fragments.push_back({ std::move(fragment.mask), offset + fragment.offset });
+                }
+            }
+            // Векторные куски с совпадающими концами и одинаковой толщиной сшиваются в общие ломаные
+            for (int i : component) {
+                auto& lines = pieces[i].lines;
+                std::move(lines.begin(), lines.end(), std::back_inserter(mergedDefect.lines));
+            }
+            joinPolylines(mergedDefect.lines);
+            MERGE_STATS_COUNT(MergedDefects, mergedDefect.klass, 1);
+            resultDetects.emplace_back(std::move(mergedDefect));
+        }
+        emitInterior(INT_MAX);
+        interior.clear();
+    }
+
+    // Признаки компоненты. Сумма features[root] точна, если куски не пересекаются. Пересекаться могут только куски
+    // одного батча: пиксели пересекающихся растровых кусков внутри объединения попарных пересечений их рамок
+    // вычитаются из суммы и заменяются признаками их наложения (OR) в упакованной маске, остальные пиксели
+    // посчитаны по разу. Вероятности пересекающихся кусков усредняются по их площадям.
+    // Признаки векторных кусков - оценка по отрезкам (polylineFeatures), они всегда складываются без растеризации
+    DefectFeatures componentFeatures(std::span<const int> component, int root)
+    {
+        rowIntervals.clear();
+        for (int k = 0; k < static_cast<int>(component.size()); ++k) {
+            const DetectResult& piece = pieces[component[k]];
+            if (!piece.mask.empty() || !piece.fragments.empty()) {
+                rowIntervals.push_back({ piece.rect.x, piece.rect.x + piece.rect.width, k });
+            }
+        }
+        overlapping.assign(component.size(), 0);
+        cv::Rect2i overlapRect;
+        // Допуск -1: отрезки [x, x + width) только касающихся рамок парой не считаются
+        forEachOverlappingPair(rowIntervals, -1, [&](int a, int b) {
+            cv::Rect2i both = pieces[component[a]].rect & pieces[component[b]].rect;
+            if (both.area() > 0) {
+                overlapping[a] = overlapping[b] = 1;
+                overlapRect = overlapRect.empty() ? both : (overlapRect | both);
+            }
+            }, activeIntervals);
+        if (overlapRect.empty()) {
+            return features[root];
+        }
+
+        overlapBits.reset(overlapRect.height, overlapRect.width);
+        DefectFeatures covered;
+        covered.area = 0;
+        int64_t overlapArea = 0;
+        double overlapMass = 0.0;
+        auto addPart = [&](const cv::Mat& mask, cv::Point2i origin) {
+            cv::Rect2i part = cv::Rect2i(origin, mask.size()) & overlapRect;
+            if (part.empty()) {
+                return;
+            }
+            cv::Mat partMask = mask(cv::Rect2i(part.tl() - origin, part.size()));
+            covered = mergeFeatures(covered, rasterFeatures(partMask, part.tl()));
+            overlapBits.orMat(partMask, part.tl() - overlapRect.tl(), overlapRowWords);
+            };
+        for (int k = 0; k < static_cast<int>(component.size()); ++k) {
+            if (!overlapping[k]) {
+                continue;
+            }
+            const DetectResult& piece = pieces[component[k]];
+            overlapArea += piece.features.area;
+            overlapMass += piece.features.probMass;
+            if (!piece.mask.empty()) {
+                addPart(piece.mask, piece.rect.tl());
+            }
+            for (const auto& fragment : piece.fragments) {
+                addPart(fragment.mask, piece.rect.tl() + fragment.offset);
+            }
+        }
+        DefectFeatures overlapFeatures = rasterFeatures(overlapBits, overlapRect.tl());
+        overlapFeatures.length = 0.0;
+        DefectFeatures result = mergeFeatures(subtractFeatures(features[root], covered), overlapFeatures);
+        int64_t mergedArea = overlapArea - covered.area + overlapFeatures.area;
+        result.probMass += (overlapArea > 0) ? overlapMass * mergedArea / overlapArea - overlapMass : 0.0;
+        return result;
+    }
+
+    // Удаление выданных кусков и групп, которые уже ни с чем не пересекутся (ниже bottom не дотягиваются).
+    // Компоненты переносятся целиком, поэтому корни и их рамки остаются действительными
+    void compact(int bottom)
+    {
+        int count = static_cast<int>(pieces.size());
+        std::vector<int> newIndex(count, -1);
+        int live = 0;
+        for (int i = 0; i < count; ++i) {
+            if (!emitted[i]) {
+                newIndex[i] = live++;
+            }
+        }
+
+        DisjointSet liveSets;
+        std::vector<DetectResult> livePieces;
+        std::vector<MaskProfile> liveProfiles;
+        std::vector<cv::Rect2i> liveRects;
+        std::vector<float> liveProbs;
+        std::vector<DefectFeatures> liveFeatures;
+        livePieces.reserve(live);
+        for (int i = 0; i < count; ++i) {
+            if (emitted[i]) {
+                releaseProfile(i);
+                continue;
+            }
+            int root = sets.find(i);
+            liveSets.add();
+            liveSets.parent.back() = newIndex[root];
+            liveSets.size.back() = sets.size[i];
+            livePieces.emplace_back(std::move(pieces[i]));
+            liveProfiles.emplace_back(std::move(profiles[i]));
+            liveRects.push_back(rects[i]);
+            liveProbs.push_back(probs[i]);
+            liveFeatures.push_back(features[i]);
+        }
+        sets = std::move(liveSets);
+        pieces = std::move(livePieces);
+        profiles = std::move(liveProfiles);
+        rects = std::move(liveRects);
+        probs = std::move(liveProbs);
+        features = std::move(liveFeatures);
+
+        std::vector<PieceGroup> liveGroups;
+        std::vector<Interval> liveSpans;
+        for (const auto& group : groups) {
+            if (emitted[group.piece] || group.rect.y + group.rect.height + extension <= bottom) {
+                continue;
+            }
+            int id = static_cast<int>(liveGroups.size());
+            liveGroups.push_back({ group.rect, newIndex[group.piece] });
+            liveSpans.push_back(projection(group.rect, id));
+        }
+        groups = std::move(liveGroups);
+        groupIndex.clear();
+        groupIndex.insert(liveSpans);
+        rowBegin = live;
+    }
+
+    // Возврат упакованной маски куска в пул
+    void releaseProfile(int i)
+    {
+        if (maskPool != nullptr && !profiles[i].empty()) {
+            maskPool->release(std::move(profiles[i]));
+        }
+    }
+
+    // Сброс компонент. Память векторов сохраняется, маски кусков возвращаются в пул
+    void clear()
+    {
+        for (int i = 0; i < static_cast<int>(profiles.size()); ++i) {
+            releaseProfile(i);
+        }
+        pieces.clear();
+        profiles.clear();
+        sets.clear();
+        rects.clear();
+        probs.clear();
+        features.clear();
+        groups.clear();
+        groupIndex.clear();
+        interior.clear();
+        rowBegin = 0;
+    }
+};
+
+/**
+ * Память объединения, переиспользуемая между кадрами (или строками построчного объединения):
+ *  компоненты всех типов с рабочими буферами, буферы классификации строки и пул упакованных масок кусков.
+ *  Векторы только очищаются, поэтому после первых кадров объединение с той же ареной не выделяет память
+ *  под промежуточные данные. Выделяются только выходные данные - списки фрагментов и линий объединенных дефектов.
+ *  Арена не потокобезопасна: одна арена - на один поток объединения.
+ *  Допуски арены - снимок, который объединители обновляют в начале кадра (setTolerances), а не при каждом
+ *  обращении: внутри кадра допуски не меняются, даже если их перезагрузили.
+ */
+struct MergeArena
+{
+    std::array<DefectComponents, defectTypeCount> components;  // индекс - значение DefectType
+    std::vector<RowDefect> rowDefects;
+    std::vector<char> interior;
+    InteriorSearchBuffers interiorBuffers;
+    MaskPool maskPool;
+    MergeTolerances tolerances;
+
+    MergeArena()
+    {
+        for (int t = 0; t < defectTypeCount; ++t) {
+            components[t].maskPool = &maskPool;
+        }
+        setTolerances(mergeTolerances());
+    }
+
+    // Компоненты ссылаются на пул арены
+    MergeArena(const MergeArena&) = delete;
+    MergeArena& operator=(const MergeArena&) = delete;
+
+    // Допуски следующего кадра. Вызывается между кадрами, когда в компонентах нет кусков
+    void setTolerances(const MergeTolerances& frameTolerances)
+    {
+        tolerances = frameTolerances;
+        for (int t = 0; t < defectTypeCount; ++t) {
+            components[t].configure(static_cast<DefectType>(t), tolerances);
+        }
+    }
+
+    DefectComponents& typeComponents(DefectType defectType)
+    {
+        return components[static_cast<int>(defectType)];
+    }
+
+    // Поиск внутренних дефектов строки, описанной в rowDefects (результат - в interior)
+    void findInterior()
+    {
+        interiorDefects(rowDefects, interior, interiorBuffers, tolerances);
+    }
+
+    // Объединение кусков строки между собой и с предыдущими строками
+    void mergeRow()
+    {
+        for (auto& typeComponents : components) {
+            typeComponents.mergeRow();
+        }
+    }
+
+    // Перемещение всех итоговых дефектов в resultDetects в порядке типов, компоненты очищаются
+    void collect(std::vector<DetectResult>& resultDetects)
+    {
+        MERGE_STATS_SPAN("outputMove");
+        for (auto& typeComponents : components) {
+            typeComponents.collect(resultDetects);
+        }
+    }
+};
+
+// Распределение дефектов строки батчей по компонентам их типов и объединение строки с предыдущими.
+// Необъединяемые дефекты сразу перемещаются в resultDetects
+void mergeBatchesRow(MergeArena& arena, std::vector<BatchResult>& batchesRow, std::vector<DetectResult>& resultDetects)
+{
+    // Классификация дефектов строки и поиск внутренних, которые в объединение не попадут
+    {
+        MERGE_STATS_SPAN("classify", "rowY", batchesRow.empty() ? -1 : batchesRow.front().batchRect.y);
+        arena.rowDefects.clear();
+        for (const auto& batch : batchesRow) {
+            for (const auto& defect : batch.detects) {
+                arena.rowDefects.push_back({ defect.rect, batch.batchRect, defectPolicy(defect.klass) });
+            }
+        }
+        arena.findInterior();
+    }
+
+    // по батчам
+    int index = 0;
+    for (auto& batch : batchesRow) {
+        // по дефектам
+        for (auto& defect : batch.detects) {
+            MergePolicy policy = arena.rowDefects[index].policy;
+            bool isInterior = arena.interior[index++];
+            if (policy.strategy == MergeStrategy::None) {
+                MERGE_STATS_COUNT(UnmergedDefects, defect.klass, 1);
+                resultDetects.push_back(std::move(defect));
+                continue;
+            }
+
+            auto& typeComponents = arena.typeComponents(policy.type);
+            if (isInterior) {
+                typeComponents.addInterior(std::move(defect));
+            }
+            else {
+                typeComponents.add(std::move(defect));
             }
         }
     }
 
-    // Перемещаем окончательные объединенные дефекты в resultDetects
-    for (auto& [defectType, defects] : verticalMerged) {
-        for (auto& defect : defects) {
-            resultDetects.emplace_back(std::move(defect));
+    arena.mergeRow();
+}
+
+// Объединение сетки с допусками, уже заданными арене (MergeArena::setTolerances). Дефекты сетки перемещаются
+void mergeBatchGrid(std::vector<std::vector<BatchResult>>& batchesDetects, std::vector<DetectResult>& resultDetects,
+    MergeArena& arena)
+{
+    // по строкам
+    for (auto& batchesRow : batchesDetects) {
+        mergeBatchesRow(arena, batchesRow, resultDetects);
+    }
+
+    // Перемещаем окончательные объединенные дефекты в resultDetects (по типам, порядок не зависит от хеширования)
+    arena.collect(resultDetects);
+}
+
+// Объединение с ареной, переиспользуемой между кадрами (см. MergeArena). Кадр объединяется с текущими допусками
+void mergeDefectsMy(std::vector<std::vector<BatchResult>> batchesDetects, std::vector<DetectResult>& resultDetects,
+    MergeArena& arena)
+{
+    arena.setTolerances(mergeTolerances());
+    mergeBatchGrid(batchesDetects, resultDetects, arena);
+}
+
+void mergeDefectsMy(std::vector<std::vector<BatchResult>> batchesDetects, std::vector<DetectResult>& resultDetects)
+{
+    MergeArena arena;
+    mergeDefectsMy(std::move(batchesDetects), resultDetects, arena);
+}
+
+
+
+/**
+ * Объединение кусков дефектов кадра, заданного массивами (см. DetectFrameView).
+ *  Входные данные не копируются: для каждого дефекта создается только DetectResult с заголовком его маски,
+ *  память под куски каждого типа резервируется по числу дефектов (с ареной - только при росте кадров).
+ *  Результат совпадает с mergeDefectsMy для той же сетки батчей, включая порядок.
+ */
+void mergeDefectsMy(const DetectFrameView& frame, std::vector<DetectResult>& resultDetects, MergeArena& arena)
+{
+    arena.setTolerances(mergeTolerances());
+
+    // Первый проход: число кусков каждого типа. Индекс массива - значение DefectType,
+    // поэтому порядок типов тот же, что у mergeDefectsMy
+    std::array<int, defectTypeCount> typeSizes{};
+    for (int64_t klass : frame.klasses) {
+        ++typeSizes[static_cast<int>(defectPolicy(klass).type)];
+    }
+    for (int t = 0; t < defectTypeCount; ++t) {
+        if (arena.components[t].strategy != MergeStrategy::None && typeSizes[t] > 0) {
+            arena.components[t].reserve(typeSizes[t]);
         }
     }
+    resultDetects.reserve(resultDetects.size() + frame.rects.size());
 
-    // Перемещаем окончательные объединенные дефекты в resultDetects
-    for (auto& [defectType, defects] : otherMerged) {
-        for (auto& defect : defects) {
-            resultDetects.emplace_back(std::move(defect));
+    // по строкам
+    for (int row = 0; row < frame.rows; ++row) {
+        int rowFirst = frame.tileOffsets[row * frame.cols];
+        {
+            MERGE_STATS_SPAN("classify", "row", row);
+            arena.rowDefects.clear();
+            for (int tile = row * frame.cols; tile < (row + 1) * frame.cols; ++tile) {
+                cv::Rect2i batchRect = frame.batchRects.empty() ? cv::Rect2i() : frame.batchRects[tile];
+                for (int i = frame.tileOffsets[tile]; i < frame.tileOffsets[tile + 1]; ++i) {
+                    arena.rowDefects.push_back({ frame.rects[i], batchRect, defectPolicy(frame.klasses[i]) });
+                }
+            }
+            // Без рамок батчей внутренние дефекты не ищутся: все куски идут в объединение
+            if (frame.batchRects.empty()) {
+                arena.interior.assign(arena.rowDefects.size(), 0);
+            }
+            else {
+                arena.findInterior();
+            }
+        }
+
+        // по батчам строки
+        for (int tile = row * frame.cols; tile < (row + 1) * frame.cols; ++tile) {
+            for (int i = frame.tileOffsets[tile]; i < frame.tileOffsets[tile + 1]; ++i) {
+                DetectResult defect;
+                defect.rect = frame.rects[i];
+                defect.prob = frame.probs[i];
+                defect.klass = frame.klasses[i];
+                if (!frame.masks.empty()) {
+                    defect.mask = frame.masks[i];
+                }
+
+                DefectComponents& typeComponents = arena.typeComponents(arena.rowDefects[i - rowFirst].policy.type);
+                if (typeComponents.strategy == MergeStrategy::None) {
+                    MERGE_STATS_COUNT(UnmergedDefects, defect.klass, 1);
+                    resultDetects.push_back(std::move(defect));
+                }
+                else if (arena.interior[i - rowFirst]) {
+                    typeComponents.addInterior(std::move(defect));
+                }
+                else {
+                    typeComponents.add(std::move(defect));
+                }
+            }
         }
+
+        arena.mergeRow();
     }
+
+    arena.collect(resultDetects);
 }
 
+void mergeDefectsMy(const DetectFrameView& frame, std::vector<DetectResult>& resultDetects)
+{
+    MergeArena arena;
+    mergeDefectsMy(frame, resultDetects, arena);
+}
 
 
 // оставлено для просмотра созданных для тестирования дефектов по отдельности
@@ -0,0 +1,66 @@
+#pragma once
+#include <vector>
+#include <numeric>
+#include <utility>
+
+/**
+ * Система непересекающихся множеств (union-find) с объединением по размеру и сжатием путей.
+ *  Элементы - индексы кусков дефектов, множества - компоненты связности (итоговые дефекты).
+ *  Амортизированная стоимость find/unite - O(alpha(n)), т.е. практически константа.
+ */
+struct DisjointSet
+{
+    std::vector<int> parent;    // родитель элемента, у корня parent[x] == x
+    std::vector<int> size;      // размер множества, действителен только для корней
+
+    // Добавление нового одноэлементного множества, возвращает его индекс
+    int add()
+    {
+        int index = static_cast<int>(parent.size());
+        parent.push_back(index);
+        size.push_back(1);
+        return index;
+    }
+
+    // Поиск корня множества со сжатием пути (половинное сжатие, без рекурсии)
+    int find(int x)
+    {
+        while (parent[x] != x) {
+            parent[x] = parent[parent[x]];
+            x = parent[x];
+        }
+        return x;
+    }
+
+    // Объединение множеств. Возвращает новый корень или -1, если элементы уже в одном множестве
+    int unite(int a, int b)
+    {
+        a = find(a);
+        b = find(b);
+        if (a == b) {
+            return -1;
+        }
+        // Меньшее множество подвешиваем к большему, при равенстве корнем остается меньший индекс,
+        // чтобы корень не зависел от порядка вызовов
+        if (size[a] < size[b] || (size[a] == size[b] && b < a)) {
+            std::swap(a, b);
+        }
+        parent[b] = a;
+        size[a] += size[b];
+        return a;
+    }
+
+    int count() const { return static_cast<int>(parent.size()); }
+
+    void reserve(size_t count)
+    {
+        parent.reserve(count);
+        size.reserve(count);
+    }
+
+    void clear()
+    {
+        parent.clear();
+        size.clear();
+    }
+};
@@ -0,0 +1,166 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "DetectMerger.h"
+#include "TileGrid.h"
+
+/**
+ * Точное объединение кусков по пикселям на стыках батчей (разметка компонент связности по частям).
+ *  Детектор уже разметил дефекты внутри каждого батча, поэтому куски одного дефекта соединяются только через
+ *  границы батчей. Для каждого шва сетки берутся отрезки (серии) единичных пикселей масок в крайнем столбце
+ *  или строке каждого батча, куски с обеих сторон шва объединяются, если их серии соприкасаются
+ *  с учетом диагонали (8-связность). Так же соединяются куски из батчей, сходящихся в углу.
+ *
+ *  В отличие от mergeDefectsMy, допуски и рамки не используются: параллельные полосы на расстоянии
+ *  в несколько пикселей не сливаются, а реально касающиеся куски сливаются всегда.
+ *  Стоимость линейна по длине швов: у каждого куска читаются только его крайние строки и столбцы на шве.
+ *
+ *  Требуется регулярная сетка (см. regularTileGrid), иначе выполняется mergeDefectsMy.
+ *  Порядок результата тот же, что у mergeDefectsMy: необъединяемые дефекты, затем компоненты по типам.
+ */
+
+// Серия единичных пикселей на шве: [lo, hi] вдоль шва, кусок и сторона шва
+struct SeamRun
+{
+    int piece;
+    int side;       // 0 - слева (сверху) от шва, 1 - справа (снизу)
+};
+
+// Пиксели крайней строки (alongX) или крайнего столбца куска с индексом index в координатах рамки куска.
+// Маска, фрагменты и векторные линии накладываются только в пределах этой линии
+cv::Mat pieceEdgeLine(const DetectResult& piece, bool alongX, int index)
+{
+    int length = alongX ? piece.rect.width : piece.rect.height;
+    cv::Mat line = alongX ? cv::Mat::zeros(1, length, CV_8UC1) : cv::Mat::zeros(length, 1, CV_8UC1);
+
+    auto overlay = [&](const cv::Mat& mask, cv::Point2i offset) {
+        int local = index - (alongX ? offset.y : offset.x);
+        if (mask.empty() || local < 0 || local >= (alongX ? mask.rows : mask.cols)) {
+            return;
+        }
+        int start = alongX ? offset.x : offset.y;
+        int count = std::min(alongX ? mask.cols : mask.rows, length - start);
+        for (int k = std::max(0, -start); k < count; ++k) {
+            uchar value = alongX ? mask.at<uchar>(local, k) : mask.at<uchar>(k, local);
+            if (value) {
+                line.at<uchar>(alongX ? 0 : start + k, alongX ? start + k : 0) = 255;
+            }
+        }
+    };
+    overlay(piece.mask, cv::Point2i(0, 0));
+    for (const auto& fragment : piece.fragments) {
+        overlay(fragment.mask, fragment.offset);
+    }
+    if (piece.mask.empty() && !piece.lines.empty()) {
+        // Линии растеризуются в полосу толщиной в один пиксель, остальное отсекается cv::line
+        cv::Point2i shift = -piece.rect.tl() - (alongX ? cv::Point2i(0, index) : cv::Point2i(index, 0));
+        drawPolylines(piece.lines, line, shift);
+    }
+    return line;
+}
+
+// Добавление серий линии line (начало линии - координата origin вдоль шва) в список шва
+void appendSeamRuns(const cv::Mat& line, int origin, int piece, int side,
+    std::vector<Interval>& intervals, std::vector<SeamRun>& runs)
+{
+    const uchar* pixels = line.ptr<uchar>(0);
+    int length = static_cast<int>(line.total());
+    for (int k = 0; k < length; ) {
+        if (!pixels[k]) {
+            ++k;
+            continue;
+        }
+        int start = k;
+        while (k < length && pixels[k]) {
+            ++k;
+        }
+        intervals.push_back({ origin + start, origin + k - 1, static_cast<int>(runs.size()) });
+        runs.push_back({ piece, side });
+    }
+}
+
+/**
+ * Точное объединение кусков дефектов по пикселям на стыках батчей.
+ *
+ * @param batchesDetects - строки батчей регулярной сетки, как для mergeDefectsMy
+ * @param resultDetects - выходной список дефектов
+ */
+void mergeDefectsExact(std::vector<std::vector<BatchResult>> batchesDetects, std::vector<DetectResult>& resultDetects)
+{
+    TileGrid grid;
+    if (!regularTileGrid(batchesDetects, grid)) {
+        mergeDefectsMy(std::move(batchesDetects), resultDetects);
+        return;
+    }
+    int rows = grid.rows();
+    int cols = grid.cols();
+
+    MergeTolerances tolerances = mergeTolerances();
+    std::map<DefectType, DefectComponents> components;
+    std::map<DefectType, std::vector<int>> pieceTiles;  // батч каждого куска, row * cols + col
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            for (auto& defect : batchesDetects[row][col].detects) {
+                MergePolicy policy = defectPolicy(defect.klass);
+                if (policy.strategy == MergeStrategy::None) {
+                    resultDetects.push_back(std::move(defect));
+                    continue;
+                }
+                auto& typeComponents = components[policy.type];
+                typeComponents.configure(policy.type, tolerances);
+                typeComponents.add(std::move(defect));
+                pieceTiles[policy.type].push_back(row * cols + col);
+            }
+        }
+    }
+
+    for (auto& [defectType, typeComponents] : components) {
+        const std::vector<int>& tiles = pieceTiles[defectType];
+
+        // Серии каждого внутреннего шва: вертикальные швы x = grid.x[c], горизонтальные y = grid.y[r].
+        // Шов проходит через всю сетку, поэтому серии соседних по диагонали батчей тоже сравниваются
+        std::vector<std::vector<Interval>> columnSeams(cols + 1), rowSeams(rows + 1);
+        std::vector<std::vector<SeamRun>> columnRuns(cols + 1), rowRuns(rows + 1);
+        for (int i = 0; i < static_cast<int>(typeComponents.pieces.size()); ++i) {
+            const DetectResult& piece = typeComponents.pieces[i];
+            const cv::Rect2i& rect = piece.rect;
+            int row = tiles[i] / cols;
+            int col = tiles[i] % cols;
+            if (rect.width <= 0 || rect.height <= 0) {
+                continue;
+            }
+            if (col > 0 && rect.x == grid.x[col]) {
+                appendSeamRuns(pieceEdgeLine(piece, false, 0), rect.y, i, 1, columnSeams[col], columnRuns[col]);
+            }
+            if (col + 1 < cols && rect.x + rect.width == grid.x[col + 1]) {
+                appendSeamRuns(pieceEdgeLine(piece, false, rect.width - 1), rect.y, i, 0,
+                    columnSeams[col + 1], columnRuns[col + 1]);
+            }
+            if (row > 0 && rect.y == grid.y[row]) {
+                appendSeamRuns(pieceEdgeLine(piece, true, 0), rect.x, i, 1, rowSeams[row], rowRuns[row]);
+            }
+            if (row + 1 < rows && rect.y + rect.height == grid.y[row + 1]) {
+                appendSeamRuns(pieceEdgeLine(piece, true, rect.height - 1), rect.x, i, 0,
+                    rowSeams[row + 1], rowRuns[row + 1]);
+            }
+        }
+
+        // Серии с разных сторон шва, отстоящие не больше чем на пиксель (касание по диагонали), соединяют куски
+        auto stitch = [&](std::vector<Interval>& intervals, const std::vector<SeamRun>& runs) {
+            forEachOverlappingPair(intervals, 1, [&](int a, int b) {
+                if (runs[a].side != runs[b].side) {
+                    typeComponents.unite(runs[a].piece, runs[b].piece);
+                }
+                });
+        };
+        for (int c = 1; c < cols; ++c) {
+            stitch(columnSeams[c], columnRuns[c]);
+        }
+        for (int r = 1; r < rows; ++r) {
+            stitch(rowSeams[r], rowRuns[r]);
+        }
+
+        typeComponents.collect(resultDetects);
+    }
+}
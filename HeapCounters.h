@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+/**
+ * Учет кучи для замеров: замена глобальных operator new/delete со счетчиками выделений и пика живых байт.
+ *  Заменяет operator new всей программы, поэтому включается только в файл с main замеряющей программы.
+ *  Учитываются только контейнеры C++: пиксели масок cv::Mat выделяет распределитель OpenCV, они видны только в RSS.
+ */
+
+// Счетчики кучи. Размер блока хранится перед блоком, чтобы operator delete мог вычесть его из живых байт
+struct HeapCounters
+{
+    std::atomic<long long> allocations{ 0 };
+    std::atomic<long long> allocatedBytes{ 0 };
+    std::atomic<long long> liveBytes{ 0 };
+    std::atomic<long long> peakLiveBytes{ 0 };
+
+    // Начало замера: счетчики обнуляются, пик отсчитывается от текущего объема
+    void reset()
+    {
+        allocations = 0;
+        allocatedBytes = 0;
+        peakLiveBytes = liveBytes.load();
+    }
+};
+
+HeapCounters heapCounters;
+const size_t heapBlockHeader = alignof(std::max_align_t);
+
+void* operator new(size_t size)
+{
+    void* block = std::malloc(size + heapBlockHeader);
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    *static_cast<size_t*>(block) = size;
+    ++heapCounters.allocations;
+    heapCounters.allocatedBytes += size;
+    long long live = heapCounters.liveBytes += size;
+    long long peak = heapCounters.peakLiveBytes.load();
+    while (live > peak && !heapCounters.peakLiveBytes.compare_exchange_weak(peak, live)) {
+    }
+    return static_cast<char*>(block) + heapBlockHeader;
+}
+
+// Освобождение блока, выделенного operator new выше. GCC принимает free для блока из замененного operator new
+// за ошибку, поэтому предупреждение отключено
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void releaseCounted(void* pointer)
+{
+    if (pointer == nullptr) {
+        return;
+    }
+    void* block = static_cast<char*>(pointer) - heapBlockHeader;
+    heapCounters.liveBytes -= *static_cast<size_t*>(block);
+    std::free(block);
+}
+
+void operator delete(void* pointer) noexcept
+{
+    releaseCounted(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept
+{
+    releaseCounted(pointer);
+}
+
+// Пиковый объем памяти процесса в байтах
+long long peakRssBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return static_cast<long long>(counters.PeakWorkingSetSize);
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * 1024LL;
+#endif
+#endif
+}
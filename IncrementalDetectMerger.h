@@ -0,0 +1,401 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <map>
+#include <compare>
+#include <utility>
+#include <algorithm>
+#include <iterator>
+#include <iostream>
+#include "DetectMerger.h"
+
+/**
+ * Объединение кадра с повторным объединением при замене одного батча (повторный прогон детектора на батче).
+ *  Объединитель хранит сетку батчей кадра и для каждого итогового дефекта - куски, из которых он собран.
+ *  replaceTile снимает куски заменяемого батча, заново объединяет только затронутые дефекты (те, в которые
+ *  входили его куски) вместе с новыми кусками батча и возвращает разницу: добавленные, удаленные и измененные
+ *  дефекты. Остальные дефекты кадра не пересчитываются.
+ *
+ *  Куски одного типа объединяются по отношению соседства, не зависящему от остальных кусков (DefectComponents),
+ *  поэтому объединение замкнутого множества кусков - объединения целых компонент - совпадает с полным.
+ *  Новые куски могут дотянуться до незатронутых дефектов: дефект, рамка которого ближе удвоенного допуска к новой
+ *  компоненте (для горизонтальных и вертикальных - также в общей строке батчей по оси сравнения строки),
+ *  добавляется к затронутым, и объединение повторяется, пока множество не замкнется. Такие дефекты ищутся
+ *  в индексе проекций рамок (IntervalIndex), поэтому проверяются только дефекты рядом с новыми компонентами.
+ *
+ *  Допуски объединения берутся при полном объединении кадра (mergeFrame) и действуют до следующего.
+ *  Каждый дефект получает номер, который сохраняется, пока дефект существует. Новая компонента наследует
+ *  наименьший номер затронутого дефекта, с которым у нее есть общий кусок. Результат совпадает с mergeDefectsMy
+ *  для текущей сетки с точностью до порядка: дефекты выдаются по возрастанию номеров.
+ */
+
+// Кусок кадра: дефект index батча [row][col]
+struct PieceRef
+{
+    int row = 0;
+    int col = 0;
+    int index = 0;
+
+    auto operator<=>(const PieceRef&) const = default;
+};
+
+// Разница результата после замены батча
+struct MergeDiff
+{
+    std::vector<std::pair<int64_t, DetectResult>> added;    // номер и новый дефект
+    std::vector<std::pair<int64_t, DetectResult>> changed;  // номер и дефект, собранный заново
+    std::vector<int64_t> removed;                           // номера исчезнувших дефектов
+
+    void clear()
+    {
+        added.clear();
+        changed.clear();
+        removed.clear();
+    }
+};
+
+class IncrementalDetectMerger
+{
+public:
+    /**
+     * Полное объединение кадра. Сетка сохраняется для последующих замен батчей.
+     *
+     * @param batchesDetects - строки батчей, как для mergeDefectsMy
+     * @param resultDetects - сюда дописываются итоговые дефекты в порядке номеров
+     */
+    void mergeFrame(std::vector<std::vector<BatchResult>> batchesDetects, std::vector<DetectResult>& resultDetects)
+    {
+        // Допуски кадра: замены батчей объединяются с ними же, иначе незатронутые дефекты разошлись бы с новыми
+        arena.setTolerances(mergeTolerances());
+        tracked.clear();
+        nextId = 0;
+        tiles.assign(batchesDetects.size(), {});
+        owner.assign(batchesDetects.size(), {});
+        refs.clear();
+        for (int r = 0; r < static_cast<int>(batchesDetects.size()); ++r) {
+            tiles[r].resize(batchesDetects[r].size());
+            owner[r].resize(batchesDetects[r].size());
+            for (int c = 0; c < static_cast<int>(batchesDetects[r].size()); ++c) {
+                setTile(r, c, std::move(batchesDetects[r][c]));
+                for (int k = 0; k < static_cast<int>(tiles[r][c].size()); ++k) {
+                    refs.push_back({ r, c, k });
+                }
+            }
+        }
+
+        std::vector<TrackedDefect> merged;
+        mergePieces(merged);
+        for (auto& defect : merged) {
+            assignOwner(defect.sources, nextId);
+            tracked.emplace(nextId++, std::move(defect));
+        }
+        rebuildRectIndex();
+        defects(resultDetects);
+    }
+
+    /**
+     * Замена батча [row][col] и повторное объединение затронутых им дефектов.
+     *
+     * @param batch - новые дефекты батча, координаты относительно всего кадра
+     * @param diff - разница результата: добавленные, удаленные и измененные дефекты
+     * @return false, если батча с такими индексами нет
+     */
+    bool replaceTile(int row, int col, BatchResult batch, MergeDiff& diff)
+    {
+        diff.clear();
+        if (row < 0 || row >= static_cast<int>(tiles.size()) || col < 0 || col >= static_cast<int>(tiles[row].size())) {
+            std::cerr << "нет батча [" << row << "][" << col << "]\n";
+            return false;
+        }
+
+        // Затронутые дефекты - те, в которые входят куски заменяемого батча. Их куски вне батча
+        // объединяются заново вместе с новыми кусками
+        std::vector<int64_t> affected = owner[row][col];
+        std::sort(affected.begin(), affected.end());
+        affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+        setTile(row, col, std::move(batch));
+
+        refs.clear();
+        for (int64_t id : affected) {
+            addSources(tracked.at(id).sources, row, col);
+        }
+        for (int k = 0; k < static_cast<int>(tiles[row][col].size()); ++k) {
+            refs.push_back({ row, col, k });
+        }
+
+        // Объединение повторяется, пока новые компоненты дотягиваются до незатронутых дефектов
+        std::vector<TrackedDefect> merged;
+        for (;;) {
+            mergePieces(merged);
+            std::vector<int64_t> reached = reachedDefects(merged, affected);
+            if (reached.empty()) {
+                break;
+            }
+            for (int64_t id : reached) {
+                addSources(tracked.at(id).sources, row, col);
+            }
+            affected.insert(affected.end(), reached.begin(), reached.end());
+            std::sort(affected.begin(), affected.end());
+        }
+
+        // Номера: компонента наследует наименьший еще не занятый номер затронутого дефекта, с которым у нее общий кусок.
+        // Затронутые дефекты без наследника удаляются
+        std::vector<int64_t> inherited;
+        for (auto& defect : merged) {
+            int64_t id = -1;
+            for (const auto& ref : defect.sources) {
+                int64_t previous = owner[ref.row][ref.col][ref.index];
+                if (previous >= 0 && (id < 0 || previous < id)
+                    && std::find(inherited.begin(), inherited.end(), previous) == inherited.end()) {
+                    id = previous;
+                }
+            }
+
+            if (id < 0) {
+                id = nextId++;
+                diff.added.emplace_back(id, defect.defect);
+                tracked.emplace(id, std::move(defect));
+                continue;
+            }
+            inherited.push_back(id);
+            TrackedDefect& previous = tracked.at(id);
+            // Дефект, собранный из тех же кусков и без кусков заменяемого батча, не изменился
+            // (номера кусков нового батча могут совпасть с номерами старых)
+            bool fromTile = std::any_of(defect.sources.begin(), defect.sources.end(),
+                [&](const PieceRef& ref) { return ref.row == row && ref.col == col; });
+            if (fromTile || previous.sources != defect.sources) {
+                diff.changed.emplace_back(id, defect.defect);
+                previous = std::move(defect);
+            }
+        }
+        for (int64_t id : affected) {
+            if (std::find(inherited.begin(), inherited.end(), id) == inherited.end()) {
+                diff.removed.push_back(id);
+                tracked.erase(id);
+            }
+        }
+        for (const auto& [id, defect] : diff.added) {
+            assignOwner(tracked.at(id).sources, id);
+            indexRect(id, defect);
+        }
+        for (int64_t id : inherited) {
+            assignOwner(tracked.at(id).sources, id);
+        }
+        for (const auto& [id, defect] : diff.changed) {
+            indexRect(id, defect);
+        }
+        // Записи удаленных и измененных дефектов остаются в индексе до перестройки
+        if (indexedIds.size() > 2 * tracked.size() + 64) {
+            rebuildRectIndex();
+        }
+        return true;
+    }
+
+    // Текущий результат кадра в порядке номеров
+    void defects(std::vector<DetectResult>& resultDetects) const
+    {
+        resultDetects.reserve(resultDetects.size() + tracked.size());
+        for (const auto& [id, defect] : tracked) {
+            resultDetects.push_back(defect.defect);
+        }
+    }
+
+    size_t defectCount() const
+    {
+        return tracked.size();
+    }
+
+private:
+    // Итоговый дефект и его куски в порядке объединения (по строкам, батчам и номерам в батче)
+    struct TrackedDefect
+    {
+        DetectResult defect;
+        std::vector<PieceRef> sources;
+    };
+
+    // Куски батча [row][col] переносятся в массив для доступа по номеру, номера их дефектов сбрасываются.
+    // Признаки объединяемых кусков считаются здесь один раз: копии кусков в повторных объединениях их не пересчитывают
+    void setTile(int row, int col, BatchResult&& batch)
+    {
+        tiles[row][col].assign(std::make_move_iterator(batch.detects.begin()), std::make_move_iterator(batch.detects.end()));
+        for (auto& piece : tiles[row][col]) {
+            if (defectPolicy(piece.klass).strategy != MergeStrategy::None) {
+                defectFeatures(piece);
+            }
+        }
+        owner[row][col].assign(tiles[row][col].size(), -1);
+    }
+
+    // Добавление в refs кусков дефекта, кроме кусков заменяемого батча
+    void addSources(const std::vector<PieceRef>& sources, int row, int col)
+    {
+        for (const auto& ref : sources) {
+            if (ref.row != row || ref.col != col) {
+                refs.push_back(ref);
+            }
+        }
+    }
+
+    void assignOwner(const std::vector<PieceRef>& sources, int64_t id)
+    {
+        for (const auto& ref : sources) {
+            owner[ref.row][ref.col][ref.index] = id;
+        }
+    }
+
+    // Объединение кусков refs тем же конвейером, что mergeDefectsMy: куски подаются по строкам в порядке сетки,
+    // поэтому несимметричные проверки соседства получают куски в том же порядке, что и при полном объединении.
+    // Внутренние дефекты не выделяются: такой кусок все равно остается одиночной компонентой
+    void mergePieces(std::vector<TrackedDefect>& merged)
+    {
+        std::sort(refs.begin(), refs.end());
+        refs.erase(std::unique(refs.begin(), refs.end()), refs.end());
+        merged.clear();
+        for (size_t begin = 0; begin < refs.size();) {
+            size_t end = begin;
+            for (; end < refs.size() && refs[end].row == refs[begin].row; ++end) {
+                const PieceRef& ref = refs[end];
+                DetectResult piece = tiles[ref.row][ref.col][ref.index];
+                MergePolicy policy = defectPolicy(piece.klass);
+                if (policy.strategy == MergeStrategy::None) {
+                    merged.push_back({ std::move(piece), { ref } });
+                    continue;
+                }
+                arena.typeComponents(policy.type).add(std::move(piece));
+                typeRefs[static_cast<int>(policy.type)].push_back(ref);
+            }
+            arena.mergeRow();
+            begin = end;
+        }
+
+        // collect выдает компоненты в порядке их первого куска - в том же порядке раскладываются куски компонент
+        for (int t = 0; t < defectTypeCount; ++t) {
+            DefectComponents& components = arena.components[t];
+            int count = static_cast<int>(components.pieces.size());
+            if (count == 0) {
+                continue;
+            }
+            componentOf.assign(count, -1);
+            std::vector<std::vector<PieceRef>> sources;
+            for (int i = 0; i < count; ++i) {
+                int root = components.sets.find(i);
+                if (componentOf[root] < 0) {
+                    componentOf[root] = static_cast<int>(sources.size());
+                    sources.emplace_back();
+                }
+                sources[componentOf[root]].push_back(typeRefs[t][i]);
+            }
+            collected.clear();
+            components.collect(collected);
+            for (size_t c = 0; c < collected.size(); ++c) {
+                merged.push_back({ std::move(collected[c]), std::move(sources[c]) });
+            }
+            typeRefs[t].clear();
+        }
+    }
+
+    // Проекция рамки дефекта на ось индекса: для вертикальных дефектов - x, для остальных - y.
+    // Соседство по рамке (удвоенный допуск) и соседство в общей строке батчей требуют близости по этой оси
+    static Interval rectProjection(const cv::Rect2i& rect, MergeStrategy strategy, int id)
+    {
+        return (strategy == MergeStrategy::Vertical)
+            ? Interval{ rect.x, rect.x + rect.width, id } : Interval{ rect.y, rect.y + rect.height, id };
+    }
+
+    // Добавление рамки дефекта id в индекс его типа. Необъединяемые дефекты ни до чего не дотягиваются
+    void indexRect(int64_t id, const DetectResult& defect)
+    {
+        MergePolicy policy = defectPolicy(defect.klass);
+        if (policy.strategy == MergeStrategy::None) {
+            return;
+        }
+        rectIndex[static_cast<int>(policy.type)].insert(
+            rectProjection(defect.rect, policy.strategy, static_cast<int>(indexedIds.size())));
+        indexedIds.push_back(id);
+    }
+
+    // Индекс рамок заново по текущим дефектам: отрезки каждого типа добавляются одним слиянием
+    void rebuildRectIndex()
+    {
+        std::array<std::vector<Interval>, defectTypeCount> spans;
+        indexedIds.clear();
+        for (const auto& [id, defect] : tracked) {
+            MergePolicy policy = defectPolicy(defect.defect.klass);
+            if (policy.strategy != MergeStrategy::None) {
+                spans[static_cast<int>(policy.type)].push_back(
+                    rectProjection(defect.defect.rect, policy.strategy, static_cast<int>(indexedIds.size())));
+                indexedIds.push_back(id);
+            }
+        }
+        for (int t = 0; t < defectTypeCount; ++t) {
+            rectIndex[t].clear();
+            rectIndex[t].insert(spans[t]);
+        }
+    }
+
+    // Незатронутые дефекты, до которых может дотянуться какая-нибудь из новых компонент (см. описание класса).
+    // Кандидаты берутся из индекса рамок типа компоненты, а не перебором всех дефектов кадра
+    std::vector<int64_t> reachedDefects(const std::vector<TrackedDefect>& merged, const std::vector<int64_t>& affected) const
+    {
+        std::vector<int64_t> reached;
+        for (const auto& component : merged) {
+            MergePolicy policy = defectPolicy(component.defect.klass);
+            if (policy.strategy == MergeStrategy::None) {
+                continue;
+            }
+            int extension = arena.tolerances.extension(policy.type);
+            const cv::Rect2i& rect = component.defect.rect;
+            auto [firstRow, lastRow] = rowRange(component.sources);
+            Interval span = rectProjection(rect, policy.strategy, 0);
+            rectIndex[static_cast<int>(policy.type)].query(span.lo, span.hi, 2 * extension, [&](int entry) {
+                int64_t id = indexedIds[entry];
+                auto found = tracked.find(id);
+                // Запись удаленного дефекта или устаревшая запись измененного (его текущая рамка тоже в индексе)
+                if (found == tracked.end()) {
+                    return;
+                }
+                const TrackedDefect& other = found->second;
+                if (std::binary_search(affected.begin(), affected.end(), id)
+                    || std::find(reached.begin(), reached.end(), id) != reached.end()) {
+                    return;
+                }
+                bool near = verticalNeighbours(rect, other.defect.rect, 2 * extension);
+                if (!near && policy.strategy != MergeStrategy::HangingString) {
+                    near = (policy.strategy == MergeStrategy::Horizontal)
+                        ? horizontalNeighbours(rect, other.defect.rect)
+                        : verticalNeighboursHorizontally(rect, other.defect.rect, extension);
+                    if (near) {
+                        auto [otherFirst, otherLast] = rowRange(other.sources);
+                        near = firstRow <= otherLast && otherFirst <= lastRow;
+                    }
+                }
+                if (near) {
+                    reached.push_back(id);
+                }
+                });
+        }
+        return reached;
+    }
+
+    // Первая и последняя строки батчей кусков дефекта
+    static std::pair<int, int> rowRange(const std::vector<PieceRef>& sources)
+    {
+        auto [lowest, highest] = std::minmax_element(sources.begin(), sources.end(),
+            [](const PieceRef& a, const PieceRef& b) { return a.row < b.row; });
+        return { lowest->row, highest->row };
+    }
+
+    std::vector<std::vector<std::vector<DetectResult>>> tiles;    // куски сетки по батчам
+    std::map<int64_t, TrackedDefect> tracked;           // итоговые дефекты по номерам
+    std::vector<std::vector<std::vector<int64_t>>> owner;   // номер дефекта каждого куска сетки
+    int64_t nextId = 0;
+    std::array<IntervalIndex, defectTypeCount> rectIndex;  // проекции рамок дефектов по типам (rectProjection)
+    std::vector<int64_t> indexedIds;                    // номер дефекта каждой записи rectIndex
+
+    MergeArena arena;
+    // Буферы mergePieces
+    std::vector<PieceRef> refs;
+    std::array<std::vector<PieceRef>, defectTypeCount> typeRefs;
+    std::vector<int> componentOf;
+    std::vector<DetectResult> collected;
+};
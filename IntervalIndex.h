@@ -0,0 +1,170 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <iterator>
+#include <bit>
+
+// Отрезок [lo, hi] на одной из осей изображения с идентификатором владельца (куска или группы)
+struct Interval
+{
+    int lo;
+    int hi;
+    int id;
+};
+
+/**
+ * Поиск всех пар отрезков, находящихся друг от друга не дальше tolerance, заметающей прямой.
+ *  Отрезки сортируются по началу, активными остаются только те, чей конец (с допуском) еще не пройден.
+ *  Сложность O(n log n + k), где k - число найденных пар. Порядок отрезков в intervals меняется.
+ *
+ * @param onPair - вызывается для каждой пары (id текущего, id ранее начавшегося)
+ * @param active - буфер активных отрезков, переиспользуемый между вызовами
+ */
+template <typename OnPair>
+void forEachOverlappingPair(std::vector<Interval>& intervals, int tolerance, OnPair&& onPair, std::vector<Interval>& active)
+{
+    std::sort(intervals.begin(), intervals.end(), [](const Interval& a, const Interval& b) {
+        return (a.lo != b.lo) ? a.lo < b.lo : a.id < b.id;
+        });
+
+    active.clear();
+    for (const auto& current : intervals) {
+        // Убираем отрезки, которые закончились левее текущего с учетом допуска
+        active.erase(std::remove_if(active.begin(), active.end(), [&](const Interval& a) {
+            return a.hi + tolerance < current.lo;
+            }), active.end());
+
+        // Все оставшиеся начались не позже текущего и закончились не раньше его начала
+        for (const auto& a : active) {
+            onPair(current.id, a.id);
+        }
+        active.push_back(current);
+    }
+}
+
+template <typename OnPair>
+void forEachOverlappingPair(std::vector<Interval>& intervals, int tolerance, OnPair&& onPair)
+{
+    std::vector<Interval> active;
+    forEachOverlappingPair(intervals, tolerance, std::forward<OnPair>(onPair), active);
+}
+
+/**
+ * Индекс отрезков одного типа дефектов для поиска кандидатов на объединение.
+ *  Отрезки раскладываются по корзинам длины: в корзине k лежат отрезки длиной от 2^(k-1) до 2^k - 1 (в нулевой -
+ *  отрезки нулевой длины), каждая корзина упорядочена по началу и помнит наибольшую длину своих отрезков.
+ *  Запрос в каждой корзине просматривает только отрезки, начинающиеся в окне [lo - maxLength - tolerance, hi + tolerance],
+ *  а длины в корзине отличаются не более чем вдвое, поэтому лишних отрезков в окне не больше, чем подходящих.
+ *  Один длинный отрезок не расширяет окно для коротких: запрос стоит O(B log n + k), B - число непустых корзин.
+ *  Отрезки строки добавляются одним слиянием на корзину, без выделения памяти на каждый отрезок.
+ *  Порядок выдачи кандидатов: по корзинам, внутри корзины - по началу отрезка.
+ */
+class IntervalIndex
+{
+public:
+    void insert(const Interval& interval)
+    {
+        Bucket& bucket = bucketFor(interval.hi - interval.lo);
+        auto it = std::upper_bound(bucket.entries.begin(), bucket.entries.end(), interval.lo, [](int lo, const Interval& entry) {
+            return lo < entry.lo;
+            });
+        bucket.entries.insert(it, interval);
+        bucket.maxLength = std::max(bucket.maxLength, interval.hi - interval.lo);
+        ++entryCount;
+    }
+
+    // Добавление нескольких отрезков: сортировка добавленных по корзинам и началам и слияние с отрезками каждой корзины.
+    // Добавленные идут в порядке id при равных началах и после имеющихся отрезков с тем же началом.
+    // Слияние - через второй буфер, который обменивается с отрезками корзины, поэтому память не выделяется повторно
+    void insert(const std::vector<Interval>& intervals)
+    {
+        added.assign(intervals.begin(), intervals.end());
+        std::sort(added.begin(), added.end(), [](const Interval& a, const Interval& b) {
+            int bucketA = bucketIndex(a.hi - a.lo);
+            int bucketB = bucketIndex(b.hi - b.lo);
+            if (bucketA != bucketB) {
+                return bucketA < bucketB;
+            }
+            return (a.lo != b.lo) ? a.lo < b.lo : a.id < b.id;
+            });
+        for (auto first = added.begin(); first != added.end();) {
+            int index = bucketIndex(first->hi - first->lo);
+            auto last = std::find_if(first, added.end(), [&](const Interval& interval) {
+                return bucketIndex(interval.hi - interval.lo) != index;
+                });
+            Bucket& bucket = bucketFor(first->hi - first->lo);
+            merged.clear();
+            std::merge(bucket.entries.begin(), bucket.entries.end(), first, last, std::back_inserter(merged),
+                [](const Interval& a, const Interval& b) { return a.lo < b.lo; });
+            bucket.entries.swap(merged);
+            for (auto it = first; it != last; ++it) {
+                bucket.maxLength = std::max(bucket.maxLength, it->hi - it->lo);
+            }
+            first = last;
+        }
+        entryCount += intervals.size();
+    }
+
+    // Вызов onCandidate(id) для всех отрезков, отстоящих от [lo, hi] не дальше tolerance
+    template <typename OnCandidate>
+    void query(int lo, int hi, int tolerance, OnCandidate&& onCandidate) const
+    {
+        for (const auto& bucket : buckets) {
+            if (bucket.entries.empty()) {
+                continue;
+            }
+            auto it = std::lower_bound(bucket.entries.begin(), bucket.entries.end(), lo - tolerance - bucket.maxLength,
+                [](const Interval& entry, int value) { return entry.lo < value; });
+            for (; it != bucket.entries.end() && it->lo <= hi + tolerance; ++it) {
+                if (it->hi + tolerance >= lo) {
+                    onCandidate(it->id);
+                }
+            }
+        }
+    }
+
+    size_t size() const { return entryCount; }
+
+    void reserve(size_t count)
+    {
+        added.reserve(count);
+        merged.reserve(count);
+    }
+
+    void clear()
+    {
+        for (auto& bucket : buckets) {
+            bucket.entries.clear();
+            bucket.maxLength = 0;
+        }
+        entryCount = 0;
+    }
+
+private:
+    struct Bucket
+    {
+        std::vector<Interval> entries;  // упорядочены по началу отрезка
+        int maxLength = 0;
+    };
+
+    // Номер корзины отрезка длины length: число значащих бит длины
+    static int bucketIndex(int length)
+    {
+        return (length > 0) ? static_cast<int>(std::bit_width(static_cast<unsigned>(length))) : 0;
+    }
+
+    Bucket& bucketFor(int length)
+    {
+        size_t index = bucketIndex(length);
+        if (buckets.size() <= index) {
+            buckets.resize(index + 1);
+        }
+        return buckets[index];
+    }
+
+    std::vector<Bucket> buckets;
+    std::vector<Interval> added;    // буфер сортировки insert
+    std::vector<Interval> merged;   // буфер слияния insert
+    size_t entryCount = 0;
+};
@@ -0,0 +1,401 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <climits>
+#include <iostream>
+#include <iterator>
+#include "DetectMerger.h"
+#include "OverlapTiles.h"
+#include "ThreadPool.h"
+
+/**
+ * Объединение дефектов нескольких камер, стоящих рядом поперек полотна.
+ *  Каждая камера (полоса) выдает свою сетку батчей в своих координатах, соседние камеры видят общую полосу
+ *  полотна шириной в перекрытие. Положение камеры на рулоне задает калибровка (LaneCalibration). Строки батчей
+ *  камер идут синхронно: строка r всех полос - одна строка батчей рулона.
+ *  - сетки переводятся в координаты рулона, перекрытия батчей внутри полосы снимаются resolveTileOverlaps;
+ *  - граница полос (шов) проходит по середине общей зоны соседних камер. Дубликаты необъединяемых дефектов
+ *    в общей зоне сливаются по IoU масок, куски объединяемых обрезаются по своей стороне шва - так же, как
+ *    на швах батчей с перекрытием (OverlapTiles.h);
+ *  - куски, которые могут объединиться с кусками другой полосы, забираются из полос в общую сетку швов
+ *    (selectSeamPieces): по строкам батчей, в том же порядке, что в сетке рулона;
+ *  - полосы и сетка швов объединяются независимо и параллельно, с одним снимком допусков (mergeBatchGrid).
+ *  Компонента кусков целиком лежит либо в одной полосе, либо в сетке швов, и строки в обоих случаях разбиваются
+ *  на группы так же, как в сетке рулона, поэтому результат совпадает с mergeDefectsMy для сетки рулона из
+ *  примыкающих батчей (без учета порядка). Работа сетки швов пропорциональна числу кусков у швов, поэтому
+ *  пропускная способность растет с числом камер.
+ *
+ *  Порядок результата: дефекты полос (по полосам слева направо, в порядке mergeDefectsMy), затем дефекты сетки швов.
+ */
+
+// Положение камеры на рулоне
+struct LaneCalibration
+{
+    cv::Point2i offset;     // начало координат камеры в координатах рулона
+    int overlap = 0;        // ширина зоны, общей с предыдущей (левой) камерой, пиксели. У первой камеры не используется
+};
+
+// Сетка батчей одной камеры в ее координатах: строки батчей, как для mergeDefectsMy
+using LaneGrid = std::vector<std::vector<BatchResult>>;
+
+// Перенос дефекта на offset: рамка, ломаные и центр масс заполненных признаков. Маски и фрагменты
+// задаются относительно рамки и не меняются
+void shiftDefect(DetectResult& defect, cv::Point2i offset)
+{
+    defect.rect = cv::Rect2i(defect.rect.tl() + offset, defect.rect.size());
+    for (auto& line : defect.lines) {
+        for (auto& point : line.points) {
+            point += offset;
+        }
+    }
+    if (defect.features.area >= 0) {
+        defect.features.centroid += cv::Point2d(offset);
+    }
+}
+
+// Границы полос на рулоне: cuts[0] - левый край первой полосы, cuts[k] - шов между полосами k - 1 и k
+// (середина их общей зоны), cuts[laneCount] - правый край последней. Сетки уже в координатах рулона
+bool laneCuts(const std::vector<LaneGrid>& lanes, const std::vector<LaneCalibration>& calibration, std::vector<int>& cuts)
+{
+    std::vector<cv::Range> spans;
+    for (const auto& lane : lanes) {
+        cv::Range span(INT_MAX, INT_MIN);
+        for (const auto& batchesRow : lane) {
+            for (const auto& batch : batchesRow) {
+                span.start = std::min(span.start, batch.batchRect.x);
+                span.end = std::max(span.end, batch.batchRect.x + batch.batchRect.width);
+            }
+        }
+        if (span.start >= span.end) {
+            std::cerr << "полосы камер: у камеры " << spans.size() << " нет батчей\n";
+            return false;
+        }
+        spans.push_back(span);
+    }
+
+    cuts.assign(1, spans.front().start);
+    for (size_t k = 1; k < spans.size(); ++k) {
+        int cut = spans[k].start + calibration[k].overlap / 2;
+        if (calibration[k].overlap < 0 || spans[k].start < spans[k - 1].start || cut > spans[k - 1].end
+            || cut <= cuts.back() || cut >= spans[k].end) {
+            std::cerr << "полосы камер: камера " << k << " не примыкает к предыдущей, идет не по порядку"
+                " или перекрытие шире полосы\n";
+            return false;
+        }
+        cuts.push_back(cut);
+    }
+    cuts.push_back(spans.back().end);
+    return true;
+}
+
+// Дефекты батчей полосы в порядке списков и признаки их удаления из полосы (индекс - row * cols + col):
+// до обрезки по швам - дубликаты в общей зоне, после - куски, переносимые в сетку швов
+struct LaneTiles
+{
+    std::vector<std::vector<DetectResult*>> defects;
+    std::vector<std::vector<char>> dropped;
+};
+
+// Заполнение LaneTiles по текущим спискам дефектов полосы, признаки сбрасываются
+void laneTiles(LaneGrid& lane, LaneTiles& tiles)
+{
+    tiles.defects.clear();
+    tiles.dropped.clear();
+    for (auto& batchesRow : lane) {
+        for (auto& batch : batchesRow) {
+            auto& defects = tiles.defects.emplace_back();
+            for (auto& defect : batch.detects) {
+                defects.push_back(&defect);
+            }
+            tiles.dropped.emplace_back(defects.size(), 0);
+        }
+    }
+}
+
+// Кусок объединяемого дефекта при выборе кусков сетки швов: рамка и место в LaneTiles
+struct SeamPiece
+{
+    cv::Rect2i rect;
+    int lane;
+    int tile;
+    int index;
+};
+
+/**
+ * Выбор кусков сетки швов (признаки - в tiles[lane].dropped, списки дефектов уже обрезаны по швам).
+ *  Куски каждого типа в каждой строке батчей всех полос разбиваются на группы по правилам
+ *  DefectComponents::mergeRowAs (компоненты кусков, соседних по rowNeighbours; у локальных дефектов - отдельные
+ *  куски), только по рамкам. Сосед группы из другой строки или той же строки ищется по рамке группы не дальше
+ *  досягаемости типа (удвоенного допуска) по обеим осям, а куски полосы не выходят за ее швы. Поэтому группа может
+ *  объединиться с куском другой полосы, только если она сама захватывает несколько полос, подходит к шву ближе
+ *  досягаемости или связана с такой группой цепочкой рамок не дальше досягаемости. Такие группы уходят в сетку
+ *  швов целиком, остальные компоненты лежат в одной полосе.
+ */
+void selectSeamPieces(std::vector<LaneGrid>& lanes, const std::vector<int>& cuts, const MergeTolerances& tolerances,
+    std::vector<LaneTiles>& tiles)
+{
+    int laneCount = static_cast<int>(lanes.size());
+    for (int lane = 0; lane < laneCount; ++lane) {
+        laneTiles(lanes[lane], tiles[lane]);
+    }
+
+    // Куски по типам в порядке сетки рулона и концы строк батчей
+    std::array<std::vector<SeamPiece>, defectTypeCount> typePieces;
+    std::array<std::vector<int>, defectTypeCount> rowEnds;
+    for (size_t r = 0; r < lanes.front().size(); ++r) {
+        for (int lane = 0; lane < laneCount; ++lane) {
+            int cols = static_cast<int>(lanes[lane][r].size());
+            for (int c = 0; c < cols; ++c) {
+                int tile = static_cast<int>(r) * cols + c;
+                const auto& defects = tiles[lane].defects[tile];
+                for (int i = 0; i < static_cast<int>(defects.size()); ++i) {
+                    MergePolicy policy = defectPolicy(defects[i]->klass);
+                    if (policy.strategy != MergeStrategy::None) {
+                        typePieces[static_cast<int>(policy.type)].push_back({ defects[i]->rect, lane, tile, i });
+                    }
+                }
+            }
+        }
+        for (int t = 0; t < defectTypeCount; ++t) {
+            rowEnds[t].push_back(static_cast<int>(typePieces[t].size()));
+        }
+    }
+
+    std::vector<Interval> intervals, active;
+    for (int t = 0; t < defectTypeCount; ++t) {
+        const std::vector<SeamPiece>& pieces = typePieces[t];
+        if (pieces.empty()) {
+            continue;
+        }
+        MergeStrategy strategy = mergeStrategy(static_cast<DefectType>(t));
+        int extension = tolerances.extension(static_cast<DefectType>(t));
+        int reach = 2 * extension;
+
+        // Группы строк: горизонтальные куски строки соседствуют при пересечении по y, вертикальные - по близости по x
+        DisjointSet rowSets;
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            rowSets.add();
+        }
+        if (strategy != MergeStrategy::HangingString) {
+            bool horizontal = strategy == MergeStrategy::Horizontal;
+            int begin = 0;
+            for (int end : rowEnds[t]) {
+                intervals.clear();
+                for (int i = begin; i < end; ++i) {
+                    const cv::Rect2i& rect = pieces[i].rect;
+                    intervals.push_back(horizontal ? Interval{ rect.y, rect.y + rect.height, i }
+                        : Interval{ rect.x, rect.x + rect.width, i });
+                }
+                forEachOverlappingPair(intervals, horizontal ? 0 : extension, [&](int i, int j) {
+                    if (horizontal ? horizontalNeighbours(pieces[i].rect, pieces[j].rect)
+                        : verticalNeighboursHorizontally(pieces[i].rect, pieces[j].rect, extension)) {
+                        rowSets.unite(i, j);
+                    }
+                    }, active);
+                begin = end;
+            }
+        }
+
+        // Рамки групп и их полосы (-1 - группа захватывает несколько полос)
+        std::vector<int> groupOf(pieces.size(), -1);
+        std::vector<cv::Rect2i> groupRects;
+        std::vector<int> groupLanes;
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            int root = rowSets.find(static_cast<int>(i));
+            if (groupOf[root] < 0) {
+                groupOf[root] = static_cast<int>(groupRects.size());
+                groupRects.push_back(pieces[i].rect);
+                groupLanes.push_back(pieces[i].lane);
+            }
+            int group = groupOf[i] = groupOf[root];
+            groupRects[group] = groupRects[group] | pieces[i].rect;
+            if (groupLanes[group] != pieces[i].lane) {
+                groupLanes[group] = -1;
+            }
+        }
+
+        // Цепочки групп, рамки которых не дальше досягаемости по обеим осям
+        int groupCount = static_cast<int>(groupRects.size());
+        DisjointSet chains;
+        intervals.clear();
+        for (int g = 0; g < groupCount; ++g) {
+            chains.add();
+            intervals.push_back({ groupRects[g].y, groupRects[g].y + groupRects[g].height, g });
+        }
+        forEachOverlappingPair(intervals, reach, [&](int g, int h) {
+            const cv::Rect2i& a = groupRects[g];
+            const cv::Rect2i& b = groupRects[h];
+            if (a.x <= b.x + b.width + reach && b.x <= a.x + a.width + reach) {
+                chains.unite(g, h);
+            }
+            }, active);
+
+        std::vector<char> seamChain(groupCount, 0);
+        for (int g = 0; g < groupCount; ++g) {
+            int lane = groupLanes[g];
+            const cv::Rect2i& rect = groupRects[g];
+            if (lane < 0 || (lane > 0 && rect.x <= cuts[lane] + reach)
+                || (lane + 1 < laneCount && rect.x + rect.width >= cuts[lane + 1] - reach)) {
+                seamChain[chains.find(g)] = 1;
+            }
+        }
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            if (seamChain[chains.find(groupOf[i])]) {
+                tiles[pieces[i].lane].dropped[pieces[i].tile][pieces[i].index] = 1;
+            }
+        }
+    }
+}
+
+// Перенос выбранных кусков в сетку швов: строка r - один батч без рамки (внутренних дефектов в нем нет)
+// с кусками строки r всех полос в порядке сетки рулона. Из полос куски удаляются
+void moveSeamPieces(std::vector<LaneGrid>& lanes, std::vector<LaneTiles>& tiles, LaneGrid& seamGrid)
+{
+    seamGrid.assign(lanes.front().size(), std::vector<BatchResult>(1));
+    for (size_t r = 0; r < seamGrid.size(); ++r) {
+        BatchResult& seamBatch = seamGrid[r].front();
+        for (size_t lane = 0; lane < lanes.size(); ++lane) {
+            int cols = static_cast<int>(lanes[lane][r].size());
+            for (int c = 0; c < cols; ++c) {
+                int tile = static_cast<int>(r) * cols + c;
+                const std::vector<char>& moved = tiles[lane].dropped[tile];
+                auto& detects = lanes[lane][r][c].detects;
+                size_t i = 0;
+                for (auto it = detects.begin(); it != detects.end(); ++i) {
+                    auto next = std::next(it);
+                    if (moved[i]) {
+                        seamBatch.detects.splice(seamBatch.detects.end(), detects, it);
+                    }
+                    it = next;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Объединение дефектов нескольких камер (см. описание выше).
+ *
+ * @param lanes - сетки батчей камер слева направо, в координатах камер
+ * @param calibration - положение каждой камеры на рулоне
+ * @param resultDetects - итоговые дефекты в координатах рулона
+ * @param pool - пул потоков, на котором объединяются полосы
+ * @param minMaskIoU - порог IoU масок в общей зоне для дубликатов необъединяемых дефектов
+ * @return false, если калибровка не подходит к сеткам или сетка камеры не регулярна. resultDetects тогда не меняется
+ */
+bool mergeDefectsLanes(std::vector<LaneGrid> lanes, const std::vector<LaneCalibration>& calibration,
+    std::vector<DetectResult>& resultDetects, ThreadPool& pool, double minMaskIoU = overlapDuplicateIoU)
+{
+    if (lanes.size() != calibration.size()) {
+        std::cerr << "полосы камер: калибровка задана для " << calibration.size() << " камер из " << lanes.size() << "\n";
+        return false;
+    }
+    if (lanes.empty()) {
+        return true;
+    }
+    int laneCount = static_cast<int>(lanes.size());
+    for (const auto& lane : lanes) {
+        if (lane.size() != lanes.front().size()) {
+            std::cerr << "полосы камер: у камер разное число строк батчей\n";
+            return false;
+        }
+    }
+
+    // Координаты рулона и примыкающие сетки внутри полос
+    std::vector<char> resolved(laneCount, 0);
+    pool.parallelFor(laneCount, [&](int lane) {
+        MERGE_STATS_SPAN("laneResolve", "lane", lane);
+        cv::Point2i offset = calibration[lane].offset;
+        for (auto& batchesRow : lanes[lane]) {
+            for (auto& batch : batchesRow) {
+                batch.batchRect = cv::Rect2i(batch.batchRect.tl() + offset, batch.batchRect.size());
+                for (auto& defect : batch.detects) {
+                    shiftDefect(defect, offset);
+                }
+            }
+        }
+        resolved[lane] = resolveTileOverlaps(lanes[lane], minMaskIoU);
+        });
+    std::vector<int> cuts;
+    if (std::count(resolved.begin(), resolved.end(), 0) > 0 || !laneCuts(lanes, calibration, cuts)) {
+        return false;
+    }
+
+    std::vector<LaneTiles> tiles(laneCount);
+    for (int lane = 0; lane < laneCount; ++lane) {
+        laneTiles(lanes[lane], tiles[lane]);
+    }
+
+    // Дубликаты необъединяемых дефектов в общих зонах соседних камер. Строки батчей обеих полос упорядочены по y,
+    // поэтому пары строк, перекрывающихся по y, перебираются одним проходом
+    DuplicateSearchBuffers buffers;
+    for (int lane = 1; lane < laneCount; ++lane) {
+        MERGE_STATS_SPAN("laneDuplicates", "lane", lane);
+        const LaneGrid& left = lanes[lane - 1];
+        const LaneGrid& right = lanes[lane];
+        size_t first = 0;
+        for (size_t r = 0; r < left.size(); ++r) {
+            const cv::Rect2i& leftRow = left[r].front().batchRect;
+            while (first < right.size()
+                && right[first].front().batchRect.y + right[first].front().batchRect.height <= leftRow.y) {
+                ++first;
+            }
+            for (size_t s = first; s < right.size() && right[s].front().batchRect.y < leftRow.y + leftRow.height; ++s) {
+                for (size_t a = 0; a < left[r].size(); ++a) {
+                    for (size_t b = 0; b < right[s].size(); ++b) {
+                        cv::Rect2i strip = left[r][a].batchRect & right[s][b].batchRect;
+                        if (strip.area() <= 0) {
+                            continue;
+                        }
+                        size_t tileA = r * left[r].size() + a;
+                        size_t tileB = s * right[s].size() + b;
+                        fuseStripDuplicates(tiles[lane - 1].defects[tileA], tiles[lane - 1].dropped[tileA],
+                            tiles[lane].defects[tileB], tiles[lane].dropped[tileB], strip, minMaskIoU, buffers);
+                    }
+                }
+            }
+        }
+    }
+
+    // Обрезка по швам
+    std::vector<char> clipped(laneCount, 1);
+    pool.parallelFor(laneCount, [&](int lane) {
+        MERGE_STATS_SPAN("laneClip", "lane", lane);
+        size_t tile = 0;
+        for (auto& batchesRow : lanes[lane]) {
+            for (auto& batch : batchesRow) {
+                cv::Rect2i core = batch.batchRect & cv::Rect2i(cuts[lane], batch.batchRect.y,
+                    cuts[lane + 1] - cuts[lane], batch.batchRect.height);
+                clipped[lane] = clipped[lane] && core.area() > 0;
+                clipBatchToCore(batch, core, tiles[lane].dropped[tile++]);
+            }
+        }
+        });
+    if (std::count(clipped.begin(), clipped.end(), 0) > 0) {
+        std::cerr << "полосы камер: перекрытие камер шире столбца батчей\n";
+        return false;
+    }
+
+    // Куски у швов переносятся из полос в сетку швов, все - с одним снимком допусков
+    MergeTolerances tolerances = mergeTolerances();
+    LaneGrid seamGrid;
+    {
+        MERGE_STATS_SPAN("laneSeams");
+        selectSeamPieces(lanes, cuts, tolerances, tiles);
+        moveSeamPieces(lanes, tiles, seamGrid);
+    }
+
+    // Объединение полос и сетки швов (последняя задача)
+    std::vector<std::vector<DetectResult>> laneDetects(laneCount + 1);
+    pool.parallelFor(laneCount + 1, [&](int lane) {
+        MERGE_STATS_SPAN("laneMerge", "lane", lane);
+        MergeArena arena;
+        arena.setTolerances(tolerances);
+        mergeBatchGrid((lane < laneCount) ? lanes[lane] : seamGrid, laneDetects[lane], arena);
+        });
+    for (auto& detects : laneDetects) {
+        std::move(detects.begin(), detects.end(), std::back_inserter(resultDetects));
+    }
+    return true;
+}
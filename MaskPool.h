@@ -0,0 +1,66 @@
+#pragma once
+#include <array>
+#include <vector>
+#include <bit>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include "MaskProfile.h"
+
+/**
+ * Пул упакованных масок кусков для повторных объединений одним объектом (см. MergeArena в DetectMerger.h).
+ *  Маски с профилями (MaskProfile) раскладываются по классам размера - степеням двойки, не меньшим числа строк
+ *  и столбцов, и выдаются повторно маскам того же класса. Новая маска сразу резервирует память под наибольший
+ *  размер своего класса, поэтому повторная упаковка в нее не выделяет память: после первых кадров упаковка масок
+ *  кусков обходится без выделений ценой запаса памяти (до 4 раз на маску).
+ *  Там же хранятся буферы, нужные при упаковке: плотная маска для растеризации линий и упакованная строка.
+ *  Пул не потокобезопасен: один пул - на одну последовательность объединений.
+ */
+class MaskPool
+{
+public:
+    // Маска для размера rows x cols: из пула или новая с памятью под класс размера
+    MaskProfile acquire(int rows, int cols)
+    {
+        int rowClass = sizeClass(rows);
+        int colClass = sizeClass(cols);
+        std::vector<MaskProfile>& profiles = free[rowClass * classCount + colClass];
+        if (!profiles.empty()) {
+            MaskProfile profile = std::move(profiles.back());
+            profiles.pop_back();
+            return profile;
+        }
+        MaskProfile profile;
+        profile.reserve(1 << rowClass, 1 << colClass);
+        return profile;
+    }
+
+    // Возврат маски размера rows x cols в пул, память маски, профилей и пирамиды сохраняется
+    void release(MaskProfile&& profile)
+    {
+        cv::Size size = profile.size();
+        free[sizeClass(size.height) * classCount + sizeClass(size.width)].push_back(std::move(profile));
+    }
+
+    // Обнуленная плотная маска size в буфере пула. Действительна до следующего вызова
+    cv::Mat scratchMask(cv::Size size)
+    {
+        scratchPixels.assign(static_cast<size_t>(size.width) * size.height, 0);
+        return cv::Mat(size.height, size.width, CV_8UC1, scratchPixels.data());
+    }
+
+    // Буфер упакованной строки для BitMask::orMat
+    std::vector<uint64_t>& rowWords() { return scratchRow; }
+
+private:
+    static constexpr int classCount = 24;   // стороны масок до 2^23 пикселей
+
+    // Наименьшая степень двойки, не меньшая length
+    static int sizeClass(int length)
+    {
+        return std::min(classCount - 1, (length <= 1) ? 0 : static_cast<int>(std::bit_width(static_cast<unsigned>(length - 1))));
+    }
+
+    std::array<std::vector<MaskProfile>, classCount * classCount> free;
+    std::vector<uchar> scratchPixels;
+    std::vector<uint64_t> scratchRow;
+};
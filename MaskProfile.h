@@ -0,0 +1,283 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <bit>
+#include "BitMask.h"
+
+/**
+ * Упакованная маска куска с профилями краев и пирамидой занятости для быстрой проверки касания.
+ *  Профиль края - для каждого столбца (строки) расстояние от края маски до первого единичного пикселя.
+ *  Область проверки касания почти всегда примыкает к краю маски (полоса шириной в допуск у стыка батчей),
+ *  и тогда вопрос "есть ли пиксели в области" решается просмотром профиля вдоль края, без сканирования пикселей.
+ *  Для внутренних областей используется пирамида занятости: клетка 64x8 пикселей (одно слово на 8 строк)
+ *  на нижнем уровне, каждый следующий уровень объединяет 2x2 клетки. Пустые клетки отсекаются целиком,
+ *  пиксели просматриваются только в клетках, частично попавших в область.
+ *
+ * Профили и пирамида строятся один раз на кусок (при упаковке маски) за O(rows * cols / 64).
+ *  Объект можно перестроить для другой маски (resetMask, rebuild) - память маски, профилей и пирамиды
+ *  переиспользуется, на этом построен пул MaskPool.
+ */
+class MaskProfile
+{
+public:
+    MaskProfile() = default;
+
+    explicit MaskProfile(BitMask mask) : bits(std::move(mask))
+    {
+        rebuild();
+    }
+
+    // Обнуленная маска нового размера для заполнения на месте, после заполнения вызывается rebuild()
+    BitMask& resetMask(int rows, int cols)
+    {
+        bits.reset(rows, cols);
+        return bits;
+    }
+
+    // Резервирование памяти под маски до rows x cols: перестроение для них не выделяет память
+    void reserve(int rows, int cols)
+    {
+        int stride = (cols + 63) / 64;
+        bits.reserve(static_cast<size_t>(rows) * stride);
+        top.reserve(cols);
+        bottom.reserve(cols);
+        left.reserve(rows);
+        right.reserve(rows);
+        scratch.reserve(stride);
+        int levelRows = (rows + cellHeight - 1) / cellHeight;
+        int levelCols = stride;
+        for (int level = 0; ; ++level) {
+            if (level == static_cast<int>(levels.size())) {
+                levels.emplace_back();
+            }
+            levels[level].occupied.reserve(static_cast<size_t>(levelRows) * levelCols);
+            if (levelRows <= 1 && levelCols <= 1) {
+                break;
+            }
+            levelRows = (levelRows + 1) / 2;
+            levelCols = (levelCols + 1) / 2;
+        }
+    }
+
+    // Построение профилей и пирамиды по текущей маске
+    void rebuild()
+    {
+        if (bits.empty()) {
+            levelCount = 0;
+            return;
+        }
+        buildEdgeProfiles();
+        buildPyramid();
+    }
+
+    const BitMask& mask() const { return bits; }
+    bool empty() const { return bits.empty(); }
+    cv::Size size() const { return bits.size(); }
+
+    // Есть ли хотя бы один единичный пиксель в области rect (должна лежать внутри маски)
+    bool anyNonZero(const cv::Rect2i& rect) const
+    {
+        if (rect.width <= 0 || rect.height <= 0) {
+            return false;
+        }
+
+        // Область у края: достаточно найти столбец (строку), где первый пиксель от края ближе глубины области.
+        // Из подходящих краев выбирается тот, вдоль которого область короче
+        int best = -1;
+        int bestLength = 0;
+        auto consider = [&](bool touches, int edge, int length) {
+            if (touches && (best < 0 || length < bestLength)) {
+                best = edge;
+                bestLength = length;
+            }
+        };
+        consider(rect.y == 0, Top, rect.width);
+        consider(rect.y + rect.height == bits.rows(), Bottom, rect.width);
+        consider(rect.x == 0, Left, rect.height);
+        consider(rect.x + rect.width == bits.cols(), Right, rect.height);
+        switch (best) {
+        case Top:
+            return nearerThan(top, rect.x, rect.width, rect.height);
+        case Bottom:
+            return nearerThan(bottom, rect.x, rect.width, rect.height);
+        case Left:
+            return nearerThan(left, rect.y, rect.height, rect.width);
+        case Right:
+            return nearerThan(right, rect.y, rect.height, rect.width);
+        default:
+            break;
+        }
+
+        // Внутренняя область: спуск по пирамиде от верхнего уровня
+        int level = levelCount - 1;
+        for (int cy = 0; cy < levels[level].rows; ++cy) {
+            for (int cx = 0; cx < levels[level].cols; ++cx) {
+                if (anyInCell(level, cx, cy, rect)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+private:
+    enum Edge { Top, Bottom, Left, Right };
+
+    static const int cellWidth = 64;    // ширина клетки нижнего уровня - одно слово строки
+    static const int cellHeight = 8;
+
+    // Уровень пирамиды: занятость клеток построчно
+    struct Level
+    {
+        int rows = 0;
+        int cols = 0;
+        std::vector<char> occupied;
+
+        bool at(int cx, int cy) const { return occupied[static_cast<size_t>(cy) * cols + cx] != 0; }
+    };
+
+    static bool nearerThan(const std::vector<int>& depths, int begin, int length, int depth)
+    {
+        return std::any_of(depths.begin() + begin, depths.begin() + begin + length, [&](int d) { return d < depth; });
+    }
+
+    void buildEdgeProfiles()
+    {
+        int rows = bits.rows();
+        int cols = bits.cols();
+        int stride = (cols + 63) / 64;
+
+        // Верх и низ: первый раз встреченные биты столбцов при проходе строк сверху (снизу)
+        auto columnDepths = [&](std::vector<int>& depths, bool fromTop) {
+            depths.assign(cols, rows);
+            std::vector<uint64_t>& seen = scratch;
+            seen.assign(stride, 0);
+            int remaining = cols;
+            for (int k = 0; k < rows && remaining > 0; ++k) {
+                const uint64_t* words = bits.row(fromTop ? k : rows - 1 - k);
+                for (int w = 0; w < stride; ++w) {
+                    uint64_t fresh = words[w] & ~seen[w];
+                    seen[w] |= words[w];
+                    while (fresh) {
+                        depths[w * 64 + std::countr_zero(fresh)] = k;
+                        fresh &= fresh - 1;
+                        --remaining;
+                    }
+                }
+            }
+        };
+        columnDepths(top, true);
+        columnDepths(bottom, false);
+
+        // Лево и право: первое и последнее ненулевое слово строки
+        left.assign(rows, cols);
+        right.assign(rows, cols);
+        for (int y = 0; y < rows; ++y) {
+            const uint64_t* words = bits.row(y);
+            for (int w = 0; w < stride; ++w) {
+                if (words[w]) {
+                    left[y] = w * 64 + std::countr_zero(words[w]);
+                    break;
+                }
+            }
+            for (int w = stride - 1; w >= 0; --w) {
+                if (words[w]) {
+                    right[y] = cols - 1 - (w * 64 + 63 - std::countl_zero(words[w]));
+                    break;
+                }
+            }
+        }
+    }
+
+    void buildPyramid()
+    {
+        int rows = bits.rows();
+        int stride = (bits.cols() + 63) / 64;
+
+        // Число уровней: от клеток 64x8 до одной клетки
+        levelCount = 1;
+        for (int levelRows = (rows + cellHeight - 1) / cellHeight, levelCols = stride; levelRows > 1 || levelCols > 1;
+            levelRows = (levelRows + 1) / 2, levelCols = (levelCols + 1) / 2) {
+            ++levelCount;
+        }
+        // Уровни переиспользуются вместе с памятью занятости, лишние уровни остаются в запасе
+        if (static_cast<int>(levels.size()) < levelCount) {
+            levels.resize(levelCount);
+        }
+
+        // Нижний уровень: OR слов по cellHeight строк векторным ядром
+        Level& base = levels[0];
+        base.cols = stride;
+        base.rows = (rows + cellHeight - 1) / cellHeight;
+        base.occupied.resize(static_cast<size_t>(base.rows) * base.cols);
+        std::vector<uint64_t>& accumulated = scratch;
+        accumulated.resize(stride);
+        for (int cy = 0; cy < base.rows; ++cy) {
+            std::fill(accumulated.begin(), accumulated.end(), 0);
+            for (int y = cy * cellHeight; y < std::min(rows, (cy + 1) * cellHeight); ++y) {
+                orWords(accumulated.data(), bits.row(y), stride);
+            }
+            for (int cx = 0; cx < stride; ++cx) {
+                base.occupied[static_cast<size_t>(cy) * base.cols + cx] = accumulated[cx] != 0;
+            }
+        }
+        for (int level = 1; level < levelCount; ++level) {
+            const Level& lower = levels[level - 1];
+            Level& upper = levels[level];
+            upper.rows = (lower.rows + 1) / 2;
+            upper.cols = (lower.cols + 1) / 2;
+            upper.occupied.assign(static_cast<size_t>(upper.rows) * upper.cols, 0);
+            for (int cy = 0; cy < lower.rows; ++cy) {
+                for (int cx = 0; cx < lower.cols; ++cx) {
+                    if (lower.at(cx, cy)) {
+                        upper.occupied[static_cast<size_t>(cy / 2) * upper.cols + cx / 2] = 1;
+                    }
+                }
+            }
+        }
+    }
+
+    // Пиксельная рамка клетки уровня level, обрезанная по маске
+    cv::Rect2i cellRect(int level, int cx, int cy) const
+    {
+        int width = cellWidth << level;
+        int height = cellHeight << level;
+        return cv::Rect2i(cx * width, cy * height, width, height) & cv::Rect2i(0, 0, bits.cols(), bits.rows());
+    }
+
+    bool anyInCell(int level, int cx, int cy, const cv::Rect2i& rect) const
+    {
+        if (cx >= levels[level].cols || cy >= levels[level].rows || !levels[level].at(cx, cy)) {
+            return false;
+        }
+        cv::Rect2i cell = cellRect(level, cx, cy);
+        cv::Rect2i overlap = cell & rect;
+        if (overlap.area() <= 0) {
+            return false;
+        }
+        // Занятая клетка целиком внутри области
+        if (overlap == cell) {
+            return true;
+        }
+        if (level == 0) {
+            return bits.anyNonZero(overlap);
+        }
+        for (int dy = 0; dy < 2; ++dy) {
+            for (int dx = 0; dx < 2; ++dx) {
+                if (anyInCell(level - 1, 2 * cx + dx, 2 * cy + dy, rect)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    BitMask bits;
+    std::vector<int> top;       // для каждого столбца: строк от верхнего края до первого пикселя (rows, если пусто)
+    std::vector<int> bottom;    // то же от нижнего края
+    std::vector<int> left;      // для каждой строки: столбцов от левого края до первого пикселя (cols, если пусто)
+    std::vector<int> right;     // то же от правого края
+    std::vector<Level> levels;  // пирамида занятости, levels[0] - клетки 64x8
+    int levelCount = 0;         // число действующих уровней levels
+    std::vector<uint64_t> scratch;  // слова строки при построении профилей и пирамиды
+};
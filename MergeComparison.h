@@ -0,0 +1,173 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <tuple>
+#include <cmath>
+#include <cstdint>
+#include <bit>
+#include "DataStructs.h"
+#include "BitMask.h"
+#include "DetectMerger.h"
+
+/**
+ * Сравнение результатов двух реализаций объединения без учета порядка дефектов.
+ *  Дефекты приводятся к каноническому виду (класс, рамка, точность и упакованная маска) и сортируются по классу
+ *  и рамке. Дефекты с одинаковыми классом и рамкой сопоставляются по порядку, а затем у каждой пары сверяются
+ *  точность и маска: попиксельно (minMaskIoU = 1) или по IoU не ниже порога. Маска собирается так же, как для
+ *  выдачи (materializeMask), поэтому одинаковые дефекты, собранные из разных представлений, совпадают.
+ *  Для сверки с сохраненным результатом канонический вид сворачивается в отпечаток (canonicalDigest).
+ */
+
+// Допуски сравнения
+struct ComparisonTolerances
+{
+    double minMaskIoU = 1.0;        // 1 - маски должны совпадать попиксельно
+    double probTolerance = 1e-6;    // допустимая разница точности
+};
+
+// Дефект в каноническом виде
+struct CanonicalDefect
+{
+    int64_t klass = 0;
+    cv::Rect2i rect;
+    float prob = 0.0f;
+    BitMask mask;
+    int64_t pixels = 0;
+
+    auto key() const
+    {
+        return std::make_tuple(klass, rect.y, rect.x, rect.height, rect.width);
+    }
+};
+
+// Итог сравнения: число расхождений каждого вида и описания первых из них
+struct ResultComparison
+{
+    int matched = 0;                // сопоставленных пар
+    int missing = 0;                // дефектов эталона без пары
+    int extra = 0;                  // лишних дефектов проверяемой реализации
+    int maskDiffs = 0;
+    int probDiffs = 0;
+    std::vector<std::string> details;
+
+    bool equal() const
+    {
+        return missing == 0 && extra == 0 && maskDiffs == 0 && probDiffs == 0;
+    }
+};
+
+// Канонический вид результата. Маски дефектов собираются (materializeMask), поэтому результат изменяется
+std::vector<CanonicalDefect> canonicalDefects(std::vector<DetectResult>& defects)
+{
+    std::vector<CanonicalDefect> canonical;
+    canonical.reserve(defects.size());
+    for (auto& defect : defects) {
+        CanonicalDefect& item = canonical.emplace_back();
+        item.klass = defect.klass;
+        item.rect = defect.rect;
+        item.prob = defect.prob;
+        item.mask = BitMask::fromMat(materializeMask(defect));
+        item.pixels = popcountWords(item.mask.row(0), item.mask.rows() * ((item.mask.cols() + 63) / 64));
+    }
+    // Среди дефектов с одинаковыми классом и рамкой порядок задают точность, площадь маски и сами маски,
+    // поэтому канонический вид не зависит от порядка выдачи
+    std::sort(canonical.begin(), canonical.end(), [](const CanonicalDefect& a, const CanonicalDefect& b) {
+        auto keyA = std::tie(a.klass, a.rect.y, a.rect.x, a.rect.height, a.rect.width, a.prob, a.pixels);
+        auto keyB = std::tie(b.klass, b.rect.y, b.rect.x, b.rect.height, b.rect.width, b.prob, b.pixels);
+        if (keyA != keyB) {
+            return keyA < keyB;
+        }
+        size_t words = a.mask.rows() * ((a.mask.cols() + 63) / 64);
+        return std::lexicographical_compare(a.mask.row(0), a.mask.row(0) + words, b.mask.row(0), b.mask.row(0) + words);
+        });
+    return canonical;
+}
+
+// Отпечаток канонического результата: FNV-1a по классам, рамкам, битам точностей и упакованным маскам дефектов.
+// Совпадает у результатов, равных попиксельно и без допуска по точности
+uint64_t canonicalDigest(const std::vector<CanonicalDefect>& defects)
+{
+    uint64_t digest = 14695981039346656037ull;
+    auto add = [&](uint64_t value) {
+        for (int byte = 0; byte < 8; ++byte, value >>= 8) {
+            digest = (digest ^ (value & 0xff)) * 1099511628211ull;
+        }
+    };
+    for (const auto& defect : defects) {
+        add(static_cast<uint64_t>(defect.klass));
+        add((static_cast<uint64_t>(static_cast<uint32_t>(defect.rect.x)) << 32) | static_cast<uint32_t>(defect.rect.y));
+        add((static_cast<uint64_t>(static_cast<uint32_t>(defect.rect.width)) << 32) | static_cast<uint32_t>(defect.rect.height));
+        add(std::bit_cast<uint32_t>(defect.prob));
+        const uint64_t* words = defect.mask.row(0);
+        for (size_t w = 0, count = defect.mask.rows() * ((defect.mask.cols() + 63) / 64); w < count; ++w) {
+            add(words[w]);
+        }
+    }
+    return digest;
+}
+
+// Описание дефекта для отчета: класс и рамка
+std::string describeDefect(const CanonicalDefect& defect)
+{
+    std::ostringstream text;
+    text << "класс " << defect.klass << " [" << defect.rect.x << "," << defect.rect.y << " "
+        << defect.rect.width << "x" << defect.rect.height << "]";
+    return text.str();
+}
+
+/**
+ * Сравнение результата tested с эталоном reference.
+ *
+ * @param reference - результат эталонной реализации
+ * @param tested - результат проверяемой реализации
+ * @param tolerances - допуски маски и точности
+ * @param maxDetails - сколько расхождений описывать в details, остальные только считаются
+ */
+ResultComparison compareResults(std::vector<DetectResult>& reference, std::vector<DetectResult>& tested,
+    const ComparisonTolerances& tolerances, size_t maxDetails = 10)
+{
+    ResultComparison comparison;
+    auto detail = [&](const std::string& text) {
+        if (comparison.details.size() < maxDetails) {
+            comparison.details.push_back(text);
+        }
+    };
+
+    std::vector<CanonicalDefect> expected = canonicalDefects(reference);
+    std::vector<CanonicalDefect> actual = canonicalDefects(tested);
+    size_t i = 0, j = 0;
+    while (i < expected.size() || j < actual.size()) {
+        if (j == actual.size() || (i < expected.size() && expected[i].key() < actual[j].key())) {
+            ++comparison.missing;
+            detail("нет дефекта " + describeDefect(expected[i++]));
+            continue;
+        }
+        if (i == expected.size() || actual[j].key() < expected[i].key()) {
+            ++comparison.extra;
+            detail("лишний дефект " + describeDefect(actual[j++]));
+            continue;
+        }
+
+        const CanonicalDefect& a = expected[i++];
+        const CanonicalDefect& b = actual[j++];
+        ++comparison.matched;
+        if (std::abs(a.prob - b.prob) > tolerances.probTolerance) {
+            ++comparison.probDiffs;
+            std::ostringstream text;
+            text << describeDefect(a) << ": точность " << b.prob << " вместо " << a.prob;
+            detail(text.str());
+        }
+        int64_t both = 0, either = 0;
+        popcountAndOrWords(a.mask.row(0), b.mask.row(0), a.mask.rows() * ((a.mask.cols() + 63) / 64), both, either);
+        double iou = (either == 0) ? 1.0 : static_cast<double>(both) / static_cast<double>(either);
+        if (both != either && iou < tolerances.minMaskIoU) {
+            ++comparison.maskDiffs;
+            std::ostringstream text;
+            text << describeDefect(a) << ": маска отличается в " << either - both << " пикселях, IoU " << iou;
+            detail(text.str());
+        }
+    }
+    return comparison;
+}
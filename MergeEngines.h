@@ -0,0 +1,77 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <utility>
+#include "DetectMerger.h"
+#include "StreamingDetectMerger.h"
+#include "ParallelDetectMerger.h"
+#include "ExactDetectMerger.h"
+#include "AsyncDetectMerger.h"
+
+/**
+ * Реализации объединения, доступные по имени пакетному запуску и замерам.
+ *  Новая реализация добавляется сюда и сразу становится доступна обеим программам.
+ */
+
+// Имена реализаций: none - перенос дефектов без объединения (mergeDefects), my - mergeDefectsMy,
+// stream - StreamingDetectMerger по строкам, parallel - mergeDefectsParallel, bytype - mergeDefectsByType,
+// exact - mergeDefectsExact, async - AsyncDetectMerger с подачей батчей потоками пула вразнобой
+const std::vector<std::string> mergeEngineNames = { "none", "my", "stream", "parallel", "bytype", "exact", "async" };
+
+bool isMergeEngine(const std::string& name)
+{
+    return std::find(mergeEngineNames.begin(), mergeEngineNames.end(), name) != mergeEngineNames.end();
+}
+
+// Объединение сетки батчей реализацией name. Пул используется только параллельными реализациями
+void runMergeEngine(const std::string& name, std::vector<std::vector<BatchResult>> batchesDetects,
+    std::vector<DetectResult>& resultDetects, ThreadPool& pool)
+{
+    if (name == "my") {
+        mergeDefectsMy(std::move(batchesDetects), resultDetects);
+    }
+    else if (name == "stream") {
+        StreamingDetectMerger streamingMerger;
+        for (auto& batchesRow : batchesDetects) {
+            streamingMerger.pushRow(std::move(batchesRow), resultDetects);
+        }
+        streamingMerger.finish(resultDetects);
+    }
+    else if (name == "parallel") {
+        mergeDefectsParallel(std::move(batchesDetects), resultDetects, pool);
+    }
+    else if (name == "bytype") {
+        mergeDefectsByType(std::move(batchesDetects), resultDetects, pool);
+    }
+    else if (name == "async") {
+        // Одна служба на процесс: ее поток и объединители переиспользуются от кадра к кадру
+        static AsyncDetectMerger asyncMerger;
+        static std::atomic<int64_t> nextFrameId{ 0 };
+        int64_t frameId = nextFrameId++;
+        std::vector<int> rowSizes;
+        std::vector<std::pair<int, int>> tiles;
+        for (size_t r = 0; r < batchesDetects.size(); ++r) {
+            rowSizes.push_back(static_cast<int>(batchesDetects[r].size()));
+            for (size_t c = 0; c < batchesDetects[r].size(); ++c) {
+                tiles.emplace_back(static_cast<int>(r), static_cast<int>(c));
+            }
+        }
+        auto merged = asyncMerger.beginFrame(frameId, std::move(rowSizes));
+        pool.parallelFor(static_cast<int>(tiles.size()), [&](int t) {
+            auto [row, col] = tiles[t];
+            asyncMerger.submit(frameId, row, col, std::move(batchesDetects[row][col]));
+            });
+        std::vector<DetectResult> frameDetects = merged.get();
+        resultDetects.insert(resultDetects.end(), std::make_move_iterator(frameDetects.begin()),
+            std::make_move_iterator(frameDetects.end()));
+    }
+    else if (name == "exact") {
+        mergeDefectsExact(std::move(batchesDetects), resultDetects);
+    }
+    else {
+        mergeDefects(std::move(batchesDetects), resultDetects);
+    }
+}
@@ -0,0 +1,250 @@
+#pragma once
+#include <array>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include "DataStructs.h"
+
+/**
+ * Политики объединения классов дефектов.
+ *  Номер класса сопоставляется типу дефекта и способу объединения таблицей, построенной при компиляции,
+ *  поэтому классификация дефекта - одно обращение к массиву, без поиска по строкам.
+ *  Допуск объединения (зазор между кусками в пикселях) задается по типам и может загружаться из файла настроек.
+ *  Объединение работает со снимком допусков (MergeTolerances), взятым в начале кадра, поэтому загрузка допусков
+ *  из другого потока не меняет допуски уже идущего объединения.
+ */
+
+// Допуск объединения по умолчанию
+const int rectExtension = 10;
+
+// Способ объединения кусков дефекта, зависит от формы дефектов класса
+enum class MergeStrategy {
+    Horizontal,     // Протяженные по горизонтали: куски строки сливаются при пересечении по вертикали
+    Vertical,       // Протяженные по вертикали: куски строки сливаются при близости по горизонтали
+    HangingString,  // Локальные и нитевидные: куски сливаются при реальном касании масок
+    None            // Не объединяются
+};
+
+constexpr int defectTypeCount = static_cast<int>(DefectType::Default) + 1;
+
+// Класс дефекта: номер, шифр по классификатору и тип
+struct DefectClassInfo
+{
+    int klass;
+    const char* code;
+    DefectType type;
+};
+
+constexpr std::array<DefectClassInfo, 24> defectClasses = { {
+    { 0, "C.2.3", DefectType::ThreadThickeningY },      // Утолщение нити по основе
+    { 1, "C.2.1", DefectType::Knot },                   // Узел
+    { 2, "T.1.4", DefectType::DoubleThreadX },          // Двойная нить по утку
+    { 3, "C.2.4", DefectType::ThreadThickeningX },      // Утолщение нити по утку
+    { 4, "B.4", DefectType::Spot },                     // Пятно
+    { 5, "O.1.1", DefectType::Fold },                   // Складка
+    { 6, "C.2.2", DefectType::Thickening },             // Слет (утолщенное место)
+    { 7, "T.1.2", DefectType::ThreadSpan },             // Пролет
+    { 8, "T.2.2.2", DefectType::StuffedFluff },         // Редкое место (Затканный пух)
+    { 9, "C.3.1", DefectType::DifferentThreadY },       // Отличающаяся нить по основе
+    { 10, "T.3.1", DefectType::SparseThread },          // Недосека (разреженное расположение)
+    { 11, "B.7", DefectType::Seam },                    // Шов
+    { 12, "B.3", DefectType::WaterLeak },               // Затек воды
+    { 13, "T.2.6", DefectType::IncompleteDoubleThread },// Недолет
+    { 14, "C.3.2", DefectType::DifferentThreadX },      // Отличающаяся нить по утку
+    { 15, "O.1.2", DefectType::Crease },                // Залом
+    { 16, "O.2.3", DefectType::HangingString },         // Висячая нить
+    { 17, "T.1.3", DefectType::DoubleThreadY },         // Двойная нить по основе
+    { 18, "T.1.1", DefectType::Blisna },                // Близна
+    { 19, "T.2.1", DefectType::ViolationOfWeaving },    // Нарушение ткацкого переплетения
+    { 20, "T.2.2.1", DefectType::Dissection },          // Рассечка
+    { 21, "C.1.2", DefectType::Contamination },         // Засоренность
+    { 22, "T.3.2", DefectType::LightStrip },            // Забоина (Светлая полоса)
+    { 23, "B.1", DefectType::Default },                 // Тип не выделен, не объединяется
+} };
+
+constexpr MergeStrategy mergeStrategy(DefectType defectType)
+{
+    switch (defectType) {
+    case DefectType::Seam:
+    case DefectType::ThreadSpan:
+    case DefectType::DoubleThreadX:
+    case DefectType::LightStrip:
+    case DefectType::ThreadThickeningX:
+    case DefectType::DifferentThreadX:
+    case DefectType::IncompleteDoubleThread:
+    case DefectType::SparseThread:
+        return MergeStrategy::Horizontal;
+    case DefectType::Thickening:
+    case DefectType::HangingString:
+    case DefectType::StuffedFluff:
+    case DefectType::Contamination:
+    case DefectType::Knot:
+    case DefectType::Spot:
+        return MergeStrategy::HangingString;
+    case DefectType::Dissection:
+    case DefectType::Blisna:
+    case DefectType::DoubleThreadY:
+    case DefectType::ThreadThickeningY:
+    case DefectType::Fold:
+    case DefectType::Crease:
+    case DefectType::WaterLeak:
+    case DefectType::ViolationOfWeaving:
+        return MergeStrategy::Vertical;
+    default:
+        return MergeStrategy::None;
+    }
+}
+
+// Политика класса: тип дефекта и способ объединения его кусков
+struct MergePolicy
+{
+    DefectType type = DefectType::Default;
+    MergeStrategy strategy = MergeStrategy::None;
+};
+
+constexpr int maxDefectClass = [] {
+    int maxKlass = 0;
+    for (const auto& info : defectClasses) {
+        maxKlass = (info.klass > maxKlass) ? info.klass : maxKlass;
+    }
+    return maxKlass;
+}();
+
+// Политики по номеру класса, строятся при компиляции
+constexpr std::array<MergePolicy, maxDefectClass + 1> defectPolicies = [] {
+    std::array<MergePolicy, maxDefectClass + 1> policies{};
+    for (const auto& info : defectClasses) {
+        policies[info.klass] = { info.type, mergeStrategy(info.type) };
+    }
+    return policies;
+}();
+
+// Политика класса klass, неизвестные классы не объединяются
+constexpr MergePolicy defectPolicy(int64_t klass)
+{
+    return (klass >= 0 && klass <= maxDefectClass) ? defectPolicies[static_cast<size_t>(klass)] : MergePolicy{};
+}
+
+static_assert(defectPolicy(11).strategy == MergeStrategy::Horizontal, "B.7 (шов) объединяется по горизонтали");
+static_assert(defectPolicy(16).strategy == MergeStrategy::HangingString, "O.2.3 (висячая нить) объединяется по касанию");
+static_assert(defectPolicy(18).strategy == MergeStrategy::Vertical, "T.1.1 (близна) объединяется по вертикали");
+
+// Допуски объединения по типам дефектов (индекс - значение DefectType)
+struct MergeTolerances
+{
+    std::array<int, defectTypeCount> extensions;
+
+    MergeTolerances()
+    {
+        extensions.fill(rectExtension);
+    }
+
+    int extension(DefectType defectType) const
+    {
+        return extensions[static_cast<int>(defectType)];
+    }
+};
+
+// Текущие допуски процесса, меняются loadMergeTolerances и setMergeTolerances под мьютексом
+std::mutex mergeTolerancesMutex;
+MergeTolerances currentMergeTolerances;
+
+// Снимок текущих допусков, вызывается из любого потока
+MergeTolerances mergeTolerances()
+{
+    std::lock_guard<std::mutex> lock(mergeTolerancesMutex);
+    return currentMergeTolerances;
+}
+
+// Замена текущих допусков. Объединения, уже взявшие снимок, продолжают со старыми допусками
+void setMergeTolerances(const MergeTolerances& tolerances)
+{
+    std::lock_guard<std::mutex> lock(mergeTolerancesMutex);
+    currentMergeTolerances = tolerances;
+}
+
+/**
+ * Загрузка допусков объединения из файла настроек.
+ *  Строка файла - "шифр = допуск", например "B.7 = 15"; шифр default задает допуск всех остальных классов.
+ *  Пустые строки и текст после # пропускаются. Допуски применяются, только если файл прочитан без ошибок.
+ *
+ * @param path - путь к файлу настроек
+ * @return false, если файл не открылся или содержит ошибки (они выводятся в std::cerr)
+ */
+bool loadMergeTolerances(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    auto trim = [](std::string text) {
+        size_t begin = text.find_first_not_of(" \t\r");
+        size_t end = text.find_last_not_of(" \t\r");
+        return (begin == std::string::npos) ? std::string() : text.substr(begin, end - begin + 1);
+    };
+
+    int defaultExtension = -1;
+    std::array<int, defectTypeCount> classExtensions;
+    classExtensions.fill(-1);
+    bool valid = true;
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) {
+            continue;
+        }
+
+        size_t separator = line.find('=');
+        int extension = -1;
+        std::string code = trim(line.substr(0, separator));
+        if (separator != std::string::npos) {
+            try {
+                size_t parsed = 0;
+                std::string value = trim(line.substr(separator + 1));
+                extension = std::stoi(value, &parsed);
+                extension = (parsed == value.size()) ? extension : -1;
+            }
+            catch (const std::exception&) {
+                extension = -1;
+            }
+        }
+        if (extension < 0) {
+            std::cerr << path << ":" << lineNumber << ": ожидается \"шифр = допуск\" с неотрицательным допуском\n";
+            valid = false;
+            continue;
+        }
+
+        if (code == "default") {
+            defaultExtension = extension;
+            continue;
+        }
+        const DefectClassInfo* info = nullptr;
+        for (const auto& defectClass : defectClasses) {
+            if (code == defectClass.code) {
+                info = &defectClass;
+            }
+        }
+        if (info == nullptr) {
+            std::cerr << path << ":" << lineNumber << ": неизвестный шифр класса " << code << "\n";
+            valid = false;
+            continue;
+        }
+        classExtensions[static_cast<int>(info->type)] = extension;
+    }
+
+    if (!valid) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mergeTolerancesMutex);
+    for (int t = 0; t < defectTypeCount; ++t) {
+        if (classExtensions[t] >= 0) {
+            currentMergeTolerances.extensions[t] = classExtensions[t];
+        }
+        else if (defaultExtension >= 0) {
+            currentMergeTolerances.extensions[t] = defaultExtension;
+        }
+    }
+    return true;
+}
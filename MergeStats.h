@@ -0,0 +1,242 @@
+#pragma once
+#include <array>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include "MergePolicy.h"
+
+/**
+ * Счетчики и временная шкала объединения.
+ *  Собираются только при сборке с DETECT_MERGER_STATS (опция CMake), иначе макросы MERGE_STATS_* раскрываются
+ *  в пустые выражения и не стоят ничего. Счетчики и гистограммы ведутся по классам дефектов, интервалы этапов
+ *  (MERGE_STATS_SPAN) записываются с потоком и временем и выгружаются в JSON формата Chrome trace
+ *  (chrome://tracing, Perfetto). Счетчики атомарны, интервалы добавляются под мьютексом, поэтому сбор работает
+ *  и в параллельных реализациях, но заметно замедляет объединение - для замеров скорости его нужно выключать.
+ */
+
+// Счетчики объединения
+enum class MergeCounter {
+    Pieces,             // кусков, добавленных в компоненты
+    InteriorDefects,    // внутренних дефектов, выданных без объединения (interiorDefects)
+    UnmergedDefects,    // дефектов необъединяемых классов
+    RowCandidates,      // пар-кандидатов заметающей прямой внутри строки батчей
+    GroupCandidates,    // пар-кандидатов групп между строками и внутри строки
+    MaskChecks,         // проверок касания по пикселям масок
+    PolylineChecks,     // проверок касания векторных кусков без растеризации
+    RegionChecks,       // просмотров области касания в упакованной маске (anyNonZero), после отбора по рамкам
+    Unions,             // слияний компонент
+    MaskMerges,         // вызовов mergeMasks (склейка дубликатов перекрывающихся батчей)
+    MaskBuilds,         // плотных масок, собранных materializeMask
+    MaskBytes,          // байт плотных масок, собранных mergeMasks и materializeMask
+    MergedDefects       // выданных дефектов из нескольких кусков
+};
+constexpr int mergeCounterCount = static_cast<int>(MergeCounter::MergedDefects) + 1;
+constexpr std::array<const char*, mergeCounterCount> mergeCounterNames = {
+    "pieces", "interior", "unmerged", "rowCandidates", "groupCandidates", "maskChecks",
+    "polylineChecks", "regionChecks", "unions", "maskMerges", "maskBuilds", "maskBytes", "mergedDefects" };
+
+// Гистограммы объединения (корзины по степеням двойки: 0, 1, 2-3, 4-7, ...)
+enum class MergeHistogram {
+    ComponentPieces,    // кусков в выданном дефекте
+    GroupCandidates     // кандидатов индекса групп на одну группу строки
+};
+constexpr int mergeHistogramCount = static_cast<int>(MergeHistogram::GroupCandidates) + 1;
+constexpr std::array<const char*, mergeHistogramCount> mergeHistogramNames = { "componentPieces", "groupCandidates" };
+constexpr int mergeHistogramBuckets = 24;
+
+// Интервал этапа на временной шкале
+struct MergeSpanEvent
+{
+    const char* name;
+    const char* argName;    // имя аргумента интервала (строка, класс), nullptr - без аргумента
+    int64_t arg;
+    int thread;             // порядковый номер потока
+    int64_t startNs;        // от начала сбора
+    int64_t durationNs;
+};
+
+class MergeStats
+{
+public:
+    // Классы из таблицы defectClasses, последний слот - события без класса и неизвестные классы
+    static constexpr int classSlots = static_cast<int>(defectClasses.size()) + 1;
+
+    static int classSlot(int64_t klass)
+    {
+        return (klass >= 0 && klass < classSlots - 1) ? static_cast<int>(klass) : classSlots - 1;
+    }
+
+    void count(MergeCounter counter, int64_t klass, int64_t value = 1)
+    {
+        counters[classSlot(klass)][static_cast<int>(counter)].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void sample(MergeHistogram histogram, int64_t klass, uint64_t value)
+    {
+        int bucket = 0;
+        for (; value != 0 && bucket + 1 < mergeHistogramBuckets; value >>= 1) {
+            ++bucket;
+        }
+        histograms[classSlot(klass)][static_cast<int>(histogram)][bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    int64_t counter(MergeCounter counter, int64_t klass) const
+    {
+        return counters[classSlot(klass)][static_cast<int>(counter)].load(std::memory_order_relaxed);
+    }
+
+    int64_t total(MergeCounter counter) const
+    {
+        int64_t sum = 0;
+        for (int slot = 0; slot < classSlots; ++slot) {
+            sum += counters[slot][static_cast<int>(counter)].load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    int64_t nowNs() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    void addSpan(const char* name, const char* argName, int64_t arg, int64_t startNs, int64_t endNs)
+    {
+        static std::atomic<int> threadCount{ 0 };
+        thread_local int thread = threadCount++;
+        std::lock_guard<std::mutex> lock(spansMutex);
+        spans.push_back({ name, argName, arg, thread, startNs, endNs - startNs });
+    }
+
+    // Обнуление счетчиков и шкалы, время шкалы отсчитывается заново
+    void reset()
+    {
+        for (auto& slot : counters) {
+            for (auto& value : slot) {
+                value = 0;
+            }
+        }
+        for (auto& slot : histograms) {
+            for (auto& histogram : slot) {
+                for (auto& bucket : histogram) {
+                    bucket = 0;
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(spansMutex);
+        spans.clear();
+        epoch = std::chrono::steady_clock::now();
+    }
+
+    // Таблица ненулевых счетчиков по классам и гистограммы (корзина: число значений)
+    void print(std::ostream& out) const
+    {
+        for (int slot = 0; slot < classSlots; ++slot) {
+            bool header = false;
+            for (int c = 0; c < mergeCounterCount; ++c) {
+                int64_t value = counters[slot][c].load(std::memory_order_relaxed);
+                if (value == 0) {
+                    continue;
+                }
+                if (!header) {
+                    out << ((slot < classSlots - 1) ? defectClasses[slot].code : "без класса") << "\n";
+                    header = true;
+                }
+                out << "  " << std::left << std::setw(16) << mergeCounterNames[c] << value << "\n";
+            }
+            for (int h = 0; h < mergeHistogramCount; ++h) {
+                std::string line;
+                for (int b = 0; b < mergeHistogramBuckets; ++b) {
+                    int64_t value = histograms[slot][h][b].load(std::memory_order_relaxed);
+                    if (value != 0) {
+                        line += " " + std::to_string(b == 0 ? 0 : (1LL << (b - 1))) + ":" + std::to_string(value);
+                    }
+                }
+                if (!line.empty()) {
+                    out << "  " << std::left << std::setw(16) << mergeHistogramNames[h] << line.substr(1) << "\n";
+                }
+            }
+        }
+    }
+
+    // Выгрузка интервалов в JSON формата Chrome trace (события "X", время в микросекундах)
+    bool writeChromeTrace(const std::string& path) const
+    {
+        std::ofstream out(path);
+        if (!out) {
+            std::cerr << path << ": не удалось создать файл временной шкалы\n";
+            return false;
+        }
+        out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+        std::lock_guard<std::mutex> lock(spansMutex);
+        for (size_t i = 0; i < spans.size(); ++i) {
+            const MergeSpanEvent& span = spans[i];
+            out << (i ? ",\n" : "\n") << "{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << span.thread
+                << ",\"ts\":" << span.startNs / 1000.0 << ",\"dur\":" << span.durationNs / 1000.0;
+            if (span.argName != nullptr) {
+                out << ",\"args\":{\"" << span.argName << "\":" << span.arg << "}";
+            }
+            out << "}";
+        }
+        out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+        return static_cast<bool>(out);
+    }
+
+private:
+    std::array<std::array<std::atomic<int64_t>, mergeCounterCount>, classSlots> counters{};
+    std::array<std::array<std::array<std::atomic<int64_t>, mergeHistogramBuckets>, mergeHistogramCount>, classSlots> histograms{};
+    mutable std::mutex spansMutex;
+    std::vector<MergeSpanEvent> spans;
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+};
+
+// Общий сбор процесса
+MergeStats& mergeStats()
+{
+    static MergeStats stats;
+    return stats;
+}
+
+// Интервал этапа от создания до конца области видимости. argName и arg попадают в args события
+class MergeSpan
+{
+public:
+    explicit MergeSpan(const char* name, const char* argName = nullptr, int64_t arg = 0)
+        : name(name), argName(argName), arg(arg), startNs(mergeStats().nowNs())
+    {
+    }
+
+    ~MergeSpan()
+    {
+        mergeStats().addSpan(name, argName, arg, startNs, mergeStats().nowNs());
+    }
+
+    MergeSpan(const MergeSpan&) = delete;
+    MergeSpan& operator=(const MergeSpan&) = delete;
+
+private:
+    const char* name;
+    const char* argName;
+    int64_t arg;
+    int64_t startNs;
+};
+
+#define MERGE_STATS_CONCAT_(a, b) a##b
+#define MERGE_STATS_CONCAT(a, b) MERGE_STATS_CONCAT_(a, b)
+
+#if defined(DETECT_MERGER_STATS)
+constexpr bool mergeStatsEnabled = true;
+#define MERGE_STATS_COUNT(counter, klass, value) mergeStats().count(MergeCounter::counter, (klass), (value))
+#define MERGE_STATS_SAMPLE(histogram, klass, value) mergeStats().sample(MergeHistogram::histogram, (klass), (value))
+#define MERGE_STATS_SPAN(...) MergeSpan MERGE_STATS_CONCAT(mergeSpan, __LINE__)(__VA_ARGS__)
+#else
+constexpr bool mergeStatsEnabled = false;
+#define MERGE_STATS_COUNT(counter, klass, value) ((void)0)
+#define MERGE_STATS_SAMPLE(histogram, klass, value) ((void)0)
+#define MERGE_STATS_SPAN(...) ((void)0)
+#endif
@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <utility>
+
+/**
+ * Очередь без блокировок для многих писателей и одного читателя (MPSC, очередь Вьюкова).
+ *  Писатель добавляет узел одной атомарной заменой головы и не ждет ни других писателей, ни читателя.
+ *  Читатель забирает узлы с хвоста в порядке добавления. Пока писатель находится между заменой головы
+ *  и связыванием узла, читатель видит очередь пустой - добавленный элемент будет прочитан следующим pop.
+ *
+ *  push вызывается из любых потоков, pop - только из одного.
+ */
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue() : head(new Node()), tail(head.load()) {}
+
+    ~MpscQueue()
+    {
+        T value;
+        while (pop(value)) {
+        }
+        delete tail;
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T value)
+    {
+        Node* node = new Node();
+        node->value = std::move(value);
+        Node* previous = head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    // Извлечение самого старого связанного элемента, false - очередь пуста
+    bool pop(T& value)
+    {
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr) {
+            return false;
+        }
+        // Прочитанный узел становится новой заглушкой хвоста
+        value = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        std::atomic<Node*> next{ nullptr };
+        T value{};
+    };
+
+    std::atomic<Node*> head;    // последний добавленный узел, меняется писателями
+    Node* tail;                 // заглушка перед самым старым элементом, принадлежит читателю
+};
@@ -0,0 +1,333 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
+#include <iostream>
+#include "DetectMerger.h"
+#include "TileGrid.h"
+
+/**
+ * Сетка батчей с перекрытием. Детектор запускают на батчах, заходящих на соседей (обычно на 32-64 пикселя),
+ *  чтобы дефекты у края батча распознавались с окружением. Тогда дефект в полосе перекрытия находится дважды,
+ *  а объединение ожидает примыкающие батчи. resolveTileOverlaps приводит такую сетку к примыкающей:
+ *  - каждому батчу остается ядро - рамка, обрезанная по серединам полос перекрытия с соседями. В своей половине
+ *    полосы батч дальше от края, чем сосед, поэтому его распознавание там считается верным;
+ *  - куски объединяемых дефектов обрезаются по ядру своего батча (маска - ROI без копирования), рамки сжимаются
+ *    по оставшимся пикселям, куски без пикселей в ядре отбрасываются. Половины дефекта из соседних батчей примыкают
+ *    по середине полосы и сшиваются обычным объединением, пиксели полосы не попадают в результат дважды.
+ *    Векторные куски (только линии) обрезаются по геометрии, без растеризации;
+ *  - необъединяемые дефекты (MergeStrategy::None) при обрезке выдавались бы по половинам, поэтому их дубликаты
+ *    ищутся по IoU масок в полосе перекрытия (popcountAndOrWords в BitMask.h). Совпавшая пара сливается в один
+ *    дефект с объединенными рамкой и маской и большей точностью, он остается целиком, даже если выходит за ядро.
+ *    Дефект без пары остается как есть.
+ *  Рамки батчей заменяются ядрами, после чего сетка подходит любой реализации объединения.
+ *  Для примыкающей сетки ядра совпадают с батчами, и сетка не меняется.
+ */
+
+// Порог IoU масок в полосе перекрытия, начиная с которого дефекты соседних батчей считаются одним
+constexpr double overlapDuplicateIoU = 0.5;
+
+// Ядра батчей сетки с перекрытием. Строки одинаковой длины, у батчей столбца одинаковые x и ширина,
+// у батчей строки - y и высота, соседи перекрываются или примыкают, и перекрытие меньше ширины (высоты) батча
+bool overlapTileCores(const std::vector<std::vector<BatchResult>>& batchesDetects, TileGrid& cores)
+{
+    if (batchesDetects.empty() || batchesDetects.front().empty()) {
+        return true;
+    }
+    const auto& firstRow = batchesDetects.front();
+    int cols = static_cast<int>(firstRow.size());
+    for (const auto& batchesRow : batchesDetects) {
+        if (static_cast<int>(batchesRow.size()) != cols) {
+            std::cerr << "перекрытие батчей: строки сетки разной длины\n";
+            return false;
+        }
+        for (int c = 0; c < cols; ++c) {
+            const cv::Rect2i& tile = batchesRow[c].batchRect;
+            if (tile.x != firstRow[c].batchRect.x || tile.width != firstRow[c].batchRect.width
+                || tile.y != batchesRow.front().batchRect.y || tile.height != batchesRow.front().batchRect.height) {
+                std::cerr << "перекрытие батчей: батчи не образуют сетку\n";
+                return false;
+            }
+        }
+    }
+
+    // Граница ядер - середина перекрытия соседей (конец одного и начало другого)
+    auto split = [](std::vector<int>& bounds, int count, auto&& start, auto&& end) {
+        bounds.assign(1, start(0));
+        for (int k = 1; k < count; ++k) {
+            bounds.push_back((end(k - 1) + start(k)) / 2);
+        }
+        bounds.push_back(end(count - 1));
+        for (int k = 0; k < count; ++k) {
+            if (bounds[k + 1] <= bounds[k] || (k > 0 && start(k) > end(k - 1))) {
+                return false;
+            }
+        }
+        return true;
+    };
+    bool valid = split(cores.x, cols,
+        [&](int c) { return firstRow[c].batchRect.x; },
+        [&](int c) { return firstRow[c].batchRect.x + firstRow[c].batchRect.width; });
+    valid = valid && split(cores.y, static_cast<int>(batchesDetects.size()),
+        [&](int r) { return batchesDetects[r].front().batchRect.y; },
+        [&](int r) { return batchesDetects[r].front().batchRect.y + batchesDetects[r].front().batchRect.height; });
+    if (!valid) {
+        std::cerr << "перекрытие батчей: между батчами зазор или перекрытие не меньше батча\n";
+    }
+    return valid;
+}
+
+// Пиксели дефекта в полосе strip, упакованные в маску размера полосы. Дефект без маски и линий считается заполненным
+void packStripMask(DetectResult& defect, const cv::Rect2i& strip, BitMask& bits, std::vector<uint64_t>& rowWords)
+{
+    bits.reset(strip.height, strip.width);
+    cv::Rect2i part = defect.rect & strip;
+    if (part.area() <= 0) {
+        return;
+    }
+    const cv::Mat& mask = materializeMask(defect);
+    if (mask.empty()) {
+        cv::Mat filled(part.size(), CV_8UC1, cv::Scalar(255));
+        bits.orMat(filled, part.tl() - strip.tl(), rowWords);
+    }
+    else {
+        bits.orMat(mask(cv::Rect2i(part.tl() - defect.rect.tl(), part.size())), part.tl() - strip.tl(), rowWords);
+    }
+}
+
+// Слияние дубликата в оставляемый дефект: рамки и маски объединяются, чтобы не потерять пиксели дубликата
+// за полосой перекрытия. Дефект без маски и линий считается заполненным
+void fuseDuplicate(DetectResult& kept, DetectResult& duplicate)
+{
+    auto denseMask = [](DetectResult& defect) {
+        const cv::Mat& mask = materializeMask(defect);
+        return mask.empty() ? cv::Mat(defect.rect.size(), CV_8UC1, cv::Scalar(255)) : mask;
+    };
+    kept.mask = mergeMasks(denseMask(kept), denseMask(duplicate), kept.rect, duplicate.rect);
+    kept.rect |= duplicate.rect;
+    std::move(duplicate.lines.begin(), duplicate.lines.end(), std::back_inserter(kept.lines));
+    // Копии пересекаются, поэтому признаки не складываются, а пересчитываются объединением по слитой маске
+    kept.features = DefectFeatures();
+}
+
+// Обрезка векторного куска по рамке clip без растеризации: сегменты ломаных обрезаются с запасом на толщину линии,
+// рамка куска сжимается до охвата оставшихся сегментов с их толщиной. false - в рамке ничего не осталось
+bool clipPolylines(DetectResult& defect, const cv::Rect2i& clip)
+{
+    std::vector<DefectPolyline> clipped;
+    cv::Rect2i bounds;
+    for (const auto& line : defect.lines) {
+        int margin = line.thickness / 2 + 1;
+        cv::Rect2i clipRect(clip.x - margin, clip.y - margin, clip.width + 2 * margin, clip.height + 2 * margin);
+        for (size_t k = 0; k < line.points.size(); ++k) {
+            cv::Point2i a = line.points[k];
+            cv::Point2i b = line.points[std::min(k + 1, line.points.size() - 1)];
+            if ((k + 1 == line.points.size() && k > 0) || !cv::clipLine(clipRect, a, b)) {
+                continue;
+            }
+            // Сегмент, продолжающий предыдущий, дописывается в ту же ломаную
+            if (!clipped.empty() && clipped.back().thickness == line.thickness && clipped.back().points.back() == a) {
+                clipped.back().points.push_back(b);
+            }
+            else {
+                clipped.push_back({ { a, b }, line.thickness });
+            }
+            cv::Rect2i segment(std::min(a.x, b.x) - margin + 1, std::min(a.y, b.y) - margin + 1,
+                std::abs(a.x - b.x) + 2 * margin - 1, std::abs(a.y - b.y) + 2 * margin - 1);
+            segment &= clip;
+            bounds = (bounds.area() > 0) ? (bounds | segment) : segment;
+        }
+    }
+    defect.lines = std::move(clipped);
+    defect.rect = bounds;
+    return bounds.area() > 0;
+}
+
+// Буферы поиска дубликатов, переиспользуемые между полосами перекрытия
+struct DuplicateSearchBuffers
+{
+    std::vector<int> candidatesA;
+    std::vector<int> candidatesB;
+    std::vector<BitMask> stripMasks;
+    std::vector<uint64_t> rowWords;
+};
+
+/**
+ * Поиск и слияние дубликатов необъединяемых дефектов двух перекрывающихся батчей A и B.
+ *  Кандидаты - необъединяемые дефекты, заходящие в полосу перекрытия strip. Для каждого кандидата A берется
+ *  кандидат B того же класса с наибольшим IoU масок в полосе, не меньшим minMaskIoU. Пара сливается в дефект
+ *  с большей точностью (при равенстве - в дефект A), второй дефект помечается в dropped своего батча.
+ *
+ * @param defectsA, defectsB - дефекты батчей, droppedA, droppedB - признаки удаления для них
+ */
+void fuseStripDuplicates(const std::vector<DetectResult*>& defectsA, std::vector<char>& droppedA,
+    const std::vector<DetectResult*>& defectsB, std::vector<char>& droppedB, const cv::Rect2i& strip,
+    double minMaskIoU, DuplicateSearchBuffers& buffers)
+{
+    auto collectCandidates = [&](const std::vector<DetectResult*>& defects, const std::vector<char>& dropped,
+        std::vector<int>& candidates) {
+        candidates.clear();
+        for (int i = 0; i < static_cast<int>(defects.size()); ++i) {
+            const DetectResult& defect = *defects[i];
+            if (!dropped[i] && defectPolicy(defect.klass).strategy == MergeStrategy::None
+                && (defect.rect & strip).area() > 0) {
+                candidates.push_back(i);
+            }
+        }
+    };
+    std::vector<int>& candidatesA = buffers.candidatesA;
+    std::vector<int>& candidatesB = buffers.candidatesB;
+    collectCandidates(defectsA, droppedA, candidatesA);
+    collectCandidates(defectsB, droppedB, candidatesB);
+    if (candidatesA.empty() || candidatesB.empty()) {
+        return;
+    }
+
+    // Маски полосы: сначала кандидаты B, затем A
+    std::vector<BitMask>& stripMasks = buffers.stripMasks;
+    size_t countB = candidatesB.size();
+    if (stripMasks.size() < countB + candidatesA.size()) {
+        stripMasks.resize(countB + candidatesA.size());
+    }
+    for (size_t k = 0; k < countB; ++k) {
+        packStripMask(*defectsB[candidatesB[k]], strip, stripMasks[k], buffers.rowWords);
+    }
+    for (size_t n = 0; n < candidatesA.size(); ++n) {
+        DetectResult& a = *defectsA[candidatesA[n]];
+        packStripMask(a, strip, stripMasks[countB + n], buffers.rowWords);
+        int best = -1;
+        double bestIoU = minMaskIoU;
+        for (size_t k = 0; k < countB; ++k) {
+            const DetectResult& b = *defectsB[candidatesB[k]];
+            if (droppedB[candidatesB[k]] || b.klass != a.klass) {
+                continue;
+            }
+            double iou = maskIoU(stripMasks[countB + n], stripMasks[k]);
+            if (iou >= bestIoU) {
+                best = static_cast<int>(k);
+                bestIoU = iou;
+            }
+        }
+        if (best < 0) {
+            continue;
+        }
+        DetectResult& b = *defectsB[candidatesB[best]];
+        if (b.prob > a.prob) {
+            fuseDuplicate(b, a);
+            droppedA[candidatesA[n]] = 1;
+        }
+        else {
+            fuseDuplicate(a, b);
+            droppedB[candidatesB[best]] = 1;
+        }
+    }
+}
+
+// Обрезка куска объединяемого дефекта по ядру его батча. false - в ядре не осталось ни одного пикселя куска
+bool clipPieceToCore(DetectResult& defect, const cv::Rect2i& core)
+{
+    cv::Rect2i kept = defect.rect & core;
+    if (kept == defect.rect) {
+        return true;
+    }
+    if (kept.area() <= 0) {
+        return false;
+    }
+    defect.features = DefectFeatures();
+    if (defect.mask.empty() && defect.fragments.empty() && !defect.lines.empty()) {
+        return clipPolylines(defect, kept);
+    }
+    // Кусок описывается обрезанной маской, линии за ядром больше не нужны.
+    // Рамка сжимается по пикселям, как ее выдал бы детектор на ядре
+    materializeMask(defect);
+    defect.lines.clear();
+    if (!defect.mask.empty()) {
+        cv::Mat mask = defect.mask(cv::Rect2i(kept.tl() - defect.rect.tl(), kept.size()));
+        cv::Rect2i bounds = nonZeroBounds(mask);
+        if (bounds.area() <= 0) {
+            return false;
+        }
+        defect.mask = mask(bounds);
+        kept = cv::Rect2i(kept.tl() + bounds.tl(), bounds.size());
+    }
+    defect.rect = kept;
+    return true;
+}
+
+// Удаление помеченных в dropped дубликатов, обрезка кусков объединяемых дефектов по ядру, замена рамки батча ядром.
+// Необъединяемые дефекты остаются целиком
+void clipBatchToCore(BatchResult& batch, const cv::Rect2i& core, const std::vector<char>& dropped)
+{
+    int i = 0;
+    for (auto it = batch.detects.begin(); it != batch.detects.end(); ++i) {
+        DetectResult& defect = *it;
+        bool keep = !dropped[i];
+        if (keep && defectPolicy(defect.klass).strategy != MergeStrategy::None) {
+            keep = clipPieceToCore(defect, core);
+        }
+        it = keep ? std::next(it) : batch.detects.erase(it);
+    }
+    batch.batchRect = core;
+}
+
+/**
+ * Приведение сетки батчей с перекрытием к примыкающей сетке (см. описание выше).
+ *
+ * @param batchesDetects - сетка батчей, меняется на месте
+ * @param minMaskIoU - порог IoU масок в полосе перекрытия для дубликатов необъединяемых дефектов
+ * @return false, если батчи не образуют сетку с перекрытием, сетка тогда не меняется
+ */
+bool resolveTileOverlaps(std::vector<std::vector<BatchResult>>& batchesDetects, double minMaskIoU = overlapDuplicateIoU)
+{
+    TileGrid cores;
+    if (!overlapTileCores(batchesDetects, cores)) {
+        return false;
+    }
+    int rows = cores.rows();
+    int cols = cores.cols();
+    if (rows <= 0 || cols <= 0) {
+        return true;
+    }
+
+    // Дефекты батчей в порядке списков и признаки удаления
+    std::vector<std::vector<DetectResult*>> tileDefects(static_cast<size_t>(rows) * cols);
+    std::vector<std::vector<char>> dropped(tileDefects.size());
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            for (auto& defect : batchesDetects[r][c].detects) {
+                tileDefects[r * cols + c].push_back(&defect);
+            }
+            dropped[r * cols + c].assign(tileDefects[r * cols + c].size(), 0);
+        }
+    }
+
+    // Дубликаты необъединяемых дефектов в полосах перекрытия соседей по стороне и по углу
+    const int neighbours[4][2] = { { 0, 1 }, { 1, -1 }, { 1, 0 }, { 1, 1 } };
+    DuplicateSearchBuffers buffers;
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            for (const auto& [dr, dc] : neighbours) {
+                if (r + dr >= rows || c + dc < 0 || c + dc >= cols) {
+                    continue;
+                }
+                int tileA = r * cols + c;
+                int tileB = (r + dr) * cols + c + dc;
+                cv::Rect2i strip = batchesDetects[r][c].batchRect & batchesDetects[r + dr][c + dc].batchRect;
+                if (strip.area() > 0) {
+                    fuseStripDuplicates(tileDefects[tileA], dropped[tileA], tileDefects[tileB], dropped[tileB], strip,
+                        minMaskIoU, buffers);
+                }
+            }
+        }
+    }
+
+    // Удаление дубликатов, обрезка кусков объединяемых дефектов по ядрам, замена рамок батчей ядрами
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            cv::Rect2i core(cores.x[c], cores.y[r], cores.x[c + 1] - cores.x[c], cores.y[r + 1] - cores.y[r]);
+            clipBatchToCore(batchesDetects[r][c], core, dropped[r * cols + c]);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,350 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <bit>
+#include <array>
+#include <cstring>
+#include <iostream>
+#include "DetectMerger.h"
+#include "ThreadPool.h"
+
+/**
+ * Обзорное изображение дефектов в уменьшенном масштабе без полотна исходного размера.
+ *  Маски дефектов один раз упаковываются по 1 биту на пиксель (packMask), после чего любая область (окно просмотра)
+ *  рисуется в любом целом масштабе 1/factor прямо в выходное изображение. Пиксель результата - доля закрашенных
+ *  пикселей его клетки factor x factor (усреднение по площади, как cv::resize с INTER_AREA на полном полотне),
+ *  перекрывающиеся дефекты учитываются один раз.
+ *
+ *  Выходные строки рисуются полосами, полосы независимы и при наличии пула рисуются параллельно. Для строки
+ *  исходного изображения маски попавших в нее дефектов накладываются (OR) в упакованную строку окна, затем
+ *  единичные биты считаются по клеткам. Стоимость кадра пропорциональна площади дефектов в окне / 64 и числу
+ *  исходных строк, а не площади окна: пустые строки и участки строк не просматриваются. Отдельная пирамида
+ *  масок не нужна - подсчет бит по клеткам одинаково дешев при любом масштабе.
+ *
+ *  Дефекты распределены по корзинам исходных строк, поэтому окно на длинном рулоне просматривает только
+ *  дефекты своих строк. Объект неизменяем после построения, render можно вызывать из нескольких потоков.
+ */
+class OverviewRenderer
+{
+public:
+    explicit OverviewRenderer(const std::vector<DetectResult>& defects)
+    {
+        build(defects, nullptr);
+    }
+
+    // Упаковка масок на пуле
+    OverviewRenderer(const std::vector<DetectResult>& defects, ThreadPool& pool)
+    {
+        build(defects, &pool);
+    }
+
+    // Рамка всех дефектов, пустая без дефектов
+    cv::Rect2i bounds() const { return extent; }
+
+    /**
+     * Обзор области в масштабе 1/factor.
+     *
+     * @param viewport - область исходного изображения, может выходить за рамки дефектов
+     * @param factor - уменьшение, 1 - исходный масштаб
+     * @return CV_8UC1 размером ceil(viewport / factor), 0..255 - доля закрашенных пикселей клетки.
+     *  Клетки у правого и нижнего края окна могут быть неполными, доля считается по их площади.
+     *  Пустая матрица при неверных аргументах
+     */
+    cv::Mat render(const cv::Rect2i& viewport, int factor) const
+    {
+        return renderBands(viewport, factor, nullptr);
+    }
+
+    // То же с параллельной отрисовкой полос на пуле
+    cv::Mat render(const cv::Rect2i& viewport, int factor, ThreadPool& pool) const
+    {
+        return renderBands(viewport, factor, &pool);
+    }
+
+private:
+    struct Entry
+    {
+        cv::Rect2i rect;    // рамка упакованной маски в координатах изображения
+        BitMask bits;
+    };
+
+    static const int bucketHeight = 256;    // исходных строк в корзине индекса
+    static const int bandRows = 16;         // выходных строк в полосе - единица параллельной отрисовки
+
+    void build(const std::vector<DetectResult>& defects, ThreadPool* pool)
+    {
+        // Дефекты упорядочиваются по верхнему краю: порядок номеров совпадает с порядком строк
+        std::vector<int> order(defects.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return defects[a].rect.y < defects[b].rect.y; });
+
+        entries.resize(defects.size());
+        auto pack = [&](int i) {
+            const DetectResult& defect = defects[order[i]];
+            entries[i].bits = packMask(defect);
+            entries[i].rect = cv::Rect2i(defect.rect.tl(), entries[i].bits.size());
+        };
+        if (pool) {
+            pool->parallelFor(static_cast<int>(entries.size()), pack);
+        }
+        else {
+            for (int i = 0; i < static_cast<int>(entries.size()); ++i) {
+                pack(i);
+            }
+        }
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [](const Entry& entry) { return entry.bits.empty(); }),
+            entries.end());
+        if (entries.empty()) {
+            return;
+        }
+
+        extent = entries.front().rect;
+        for (const auto& entry : entries) {
+            extent |= entry.rect;
+        }
+        // Дефект записывается в каждую корзину, которую пересекают его строки
+        buckets.resize((extent.height + bucketHeight - 1) / bucketHeight);
+        for (int i = 0; i < static_cast<int>(entries.size()); ++i) {
+            const cv::Rect2i& rect = entries[i].rect;
+            for (int b = bucket(rect.y); b <= bucket(rect.y + rect.height - 1); ++b) {
+                buckets[b].push_back(i);
+            }
+        }
+    }
+
+    int bucket(int y) const { return (y - extent.y) / bucketHeight; }
+
+    cv::Mat renderBands(const cv::Rect2i& viewport, int factor, ThreadPool* pool) const
+    {
+        if (factor < 1 || viewport.width <= 0 || viewport.height <= 0) {
+            std::cerr << "обзор: неверная область или масштаб 1/" << factor << "\n";
+            return cv::Mat();
+        }
+        cv::Mat overview = cv::Mat::zeros((viewport.height + factor - 1) / factor, (viewport.width + factor - 1) / factor,
+            CV_8UC1);
+        int bands = (overview.rows + bandRows - 1) / bandRows;
+        auto band = [&](int b) {
+            renderBand(viewport, factor, b * bandRows, std::min(overview.rows, (b + 1) * bandRows), overview);
+        };
+        if (pool) {
+            pool->parallelFor(bands, band);
+        }
+        else {
+            for (int b = 0; b < bands; ++b) {
+                band(b);
+            }
+        }
+        return overview;
+    }
+
+    // Дефекты, пересекающие исходные строки [top, bottom) и столбцы [left, right), по возрастанию верхнего края
+    void collect(int top, int bottom, int left, int right, std::vector<int>& found) const
+    {
+        found.clear();
+        top = std::max(top, extent.y);
+        bottom = std::min(bottom, extent.y + extent.height);
+        if (top >= bottom || left >= right) {
+            return;
+        }
+        int first = bucket(top);
+        for (int b = first; b <= bucket(bottom - 1); ++b) {
+            for (int i : buckets[b]) {
+                const cv::Rect2i& rect = entries[i].rect;
+                // Дефект из нескольких корзин берется из первой его корзины, попавшей в запрос
+                if (b != std::max(first, bucket(rect.y))) {
+                    continue;
+                }
+                if (rect.y < bottom && rect.y + rect.height > top && rect.x < right && rect.x + rect.width > left) {
+                    found.push_back(i);
+                }
+            }
+        }
+        std::sort(found.begin(), found.end());
+    }
+
+    // Наложение строки y маски дефекта в упакованную строку окна, начинающуюся со столбца left.
+    // Возвращает диапазон затронутых слов [first, last), пустой, если дефект не попал в окно
+    static std::pair<int, int> orEntryRow(const Entry& entry, int y, int left, uint64_t* row, int stride,
+        std::vector<uint64_t>& scratch)
+    {
+        const uint64_t* src = entry.bits.row(y - entry.rect.y);
+        int srcStride = (entry.rect.width + 63) / 64;
+        int offset = entry.rect.x - left;
+        if (offset >= 0) {
+            int wordOffset = offset / 64;
+            int shift = offset % 64;
+            int available = stride - wordOffset;
+            int count = std::min(srcStride, available);
+            if (count <= 0) {
+                return { 0, 0 };
+            }
+            if (shift == 0) {
+                orWords(row + wordOffset, src, count);
+                return { wordOffset, wordOffset + count };
+            }
+            orWordsShiftedLeft(row + wordOffset, src, count, shift);
+            // Старшие биты последнего слова переходят в следующее слово строки окна
+            if (available > count) {
+                row[wordOffset + count] |= src[count - 1] >> (64 - shift);
+                return { wordOffset, wordOffset + count + 1 };
+            }
+            return { wordOffset, wordOffset + count };
+        }
+
+        // Дефект начинается левее окна: его строка сдвигается влево на -offset пикселей
+        int skipWords = -offset / 64;
+        int shift = -offset % 64;
+        int count = std::min(srcStride - skipWords, stride);
+        if (count <= 0) {
+            return { 0, 0 };
+        }
+        if (shift == 0) {
+            orWords(row, src + skipWords, count);
+        }
+        else {
+            scratch.resize(count);
+            copyWordsShiftedRight(scratch.data(), src + skipWords, count, srcStride - skipWords, shift);
+            orWords(row, scratch.data(), count);
+        }
+        return { 0, count };
+    }
+
+    // Добавление единичных бит слова w строки окна к счетчикам клеток шириной factor.
+    // Пустые участки слова пропускаются переходом к клетке следующего единичного бита
+    static void countWord(uint64_t word, int w, int factor, std::vector<int>& counts)
+    {
+        int wordStart = w * 64;
+        while (word) {
+            int ox = (wordStart + std::countr_zero(word)) / factor;
+            int cellEnd = (ox + 1) * factor - wordStart;
+            if (cellEnd >= 64) {
+                counts[ox] += std::popcount(word);
+                return;
+            }
+            uint64_t cell = (uint64_t(1) << cellEnd) - 1;
+            counts[ox] += std::popcount(word & cell);
+            word &= ~cell;
+        }
+    }
+
+    // Распаковка слова строки в пиксели 0 / 255 исходного масштаба, count - пикселей слова внутри окна.
+    // Полное слово раскладывается по байтам через таблицу: 8 пикселей одной записью
+    static void unpackWord(uint64_t word, uchar* out, int count)
+    {
+        static const std::array<uint64_t, 256> bytePixels = [] {
+            std::array<uint64_t, 256> table{};
+            for (int bits = 0; bits < 256; ++bits) {
+                for (int i = 0; i < 8; ++i) {
+                    if (bits & (1 << i)) {
+                        table[bits] |= uint64_t(0xff) << (8 * i);
+                    }
+                }
+            }
+            return table;
+        }();
+        if (count < 64) {
+            while (word) {
+                out[std::countr_zero(word)] = 255;
+                word &= word - 1;
+            }
+            return;
+        }
+        for (int b = 0; b < 8; ++b) {
+            uint8_t bits = static_cast<uint8_t>(word >> (8 * b));
+            if (bits) {
+                std::memcpy(out + 8 * b, &bytePixels[bits], 8);
+            }
+        }
+    }
+
+    // Выходные строки [outTop, outBottom) обзора
+    void renderBand(const cv::Rect2i& viewport, int factor, int outTop, int outBottom, cv::Mat& overview) const
+    {
+        int viewBottom = viewport.y + viewport.height;
+        int top = viewport.y + outTop * factor;
+        int bottom = std::min(viewBottom, viewport.y + outBottom * factor);
+        std::vector<int> candidates;
+        collect(top, bottom, viewport.x, viewport.x + viewport.width, candidates);
+        if (candidates.empty()) {
+            return;
+        }
+
+        int stride = (viewport.width + 63) / 64;
+        std::vector<uint64_t> row(stride, 0);
+        uint64_t tailMask = (viewport.width % 64) ? (uint64_t(1) << (viewport.width % 64)) - 1 : ~uint64_t(0);
+        std::vector<uint64_t> scratch;
+        std::vector<int> counts(overview.cols, 0);     // единичных пикселей по клеткам строки обзора
+        std::vector<int> active;
+        size_t next = 0;    // первый кандидат, еще не попавший в active
+
+        for (int oy = outTop; oy < outBottom; ++oy) {
+            int cellTop = viewport.y + oy * factor;
+            int cellBottom = std::min(viewBottom, cellTop + factor);
+            uchar* out = overview.ptr<uchar>(oy);
+            int cellBegin = overview.cols;  // затронутые клетки строки обзора
+            int cellEnd = 0;
+            for (int y = cellTop; y < cellBottom; ++y) {
+                // Заметание по строкам: кандидаты входят в active по верхнему краю и выходят после нижнего
+                while (next < candidates.size() && entries[candidates[next]].rect.y <= y) {
+                    active.push_back(candidates[next++]);
+                }
+                active.erase(std::remove_if(active.begin(), active.end(), [&](int i) {
+                    return entries[i].rect.y + entries[i].rect.height <= y;
+                    }), active.end());
+                if (active.empty()) {
+                    continue;
+                }
+
+                int firstWord = stride;
+                int lastWord = 0;
+                for (int i : active) {
+                    auto [first, last] = orEntryRow(entries[i], y, viewport.x, row.data(), stride, scratch);
+                    if (first < last) {
+                        firstWord = std::min(firstWord, first);
+                        lastWord = std::max(lastWord, last);
+                    }
+                }
+                if (firstWord >= lastWord) {
+                    continue;
+                }
+                // Подсчет по клеткам только в затронутых ненулевых словах, затем строка обнуляется для следующей.
+                // Биты за правым краем окна (от дефектов, выходящих за окно) отбрасываются
+                if (lastWord == stride) {
+                    row[stride - 1] &= tailMask;
+                }
+                for (int w = firstWord; w < lastWord; ++w) {
+                    if (!row[w]) {
+                        continue;
+                    }
+                    // В исходном масштабе клетка - один пиксель, счетчики не нужны
+                    if (factor == 1) {
+                        unpackWord(row[w], out + w * 64, std::min(64, viewport.width - w * 64));
+                    }
+                    else {
+                        countWord(row[w], w, factor, counts);
+                    }
+                    row[w] = 0;
+                }
+                cellBegin = std::min(cellBegin, firstWord * 64 / factor);
+                cellEnd = std::max(cellEnd, std::min(overview.cols, (lastWord * 64 + factor - 1) / factor));
+            }
+            if (factor == 1) {
+                continue;
+            }
+
+            int cellHeight = cellBottom - cellTop;
+            for (int ox = cellBegin; ox < cellEnd; ++ox) {
+                if (counts[ox]) {
+                    int64_t area = static_cast<int64_t>(cellHeight) * (std::min(viewport.width, (ox + 1) * factor) - ox * factor);
+                    out[ox] = static_cast<uchar>((counts[ox] * int64_t(255) + area / 2) / area);
+                    counts[ox] = 0;
+                }
+            }
+        }
+    }
+
+    std::vector<Entry> entries;                 // упакованные маски по возрастанию верхнего края
+    cv::Rect2i extent;                          // рамка всех дефектов
+    std::vector<std::vector<int>> buckets;      // номера дефектов по корзинам строк от extent.y
+};
@@ -0,0 +1,488 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include "DetectMerger.h"
+#include "TileGrid.h"
+#include "ThreadPool.h"
+
+/**
+ * Параллельное объединение дефектов сверткой сетки батчей по дереву блоков (quadtree).
+ *  Сначала каждый батч обрабатывается отдельно, затем блоки 2x2 сшиваются в блок следующего уровня,
+ *  пока не останется один блок на всю сетку. Блоки одного уровня не пересекаются по кускам
+ *  и обрабатываются параллельно, поэтому глубина работы - логарифм от размера сетки.
+ *
+ *  Соседние куски и группы всегда находятся ближе двух допусков объединения друг к другу, поэтому на шве блоков
+ *  сравниваются только элементы у границ дочерних блоков. Исключение - горизонтальные дефекты внутри строки:
+ *  они соседствуют при любом зазоре по x, поэтому через шов сравниваются компоненты строки целиком.
+ *  Группы для объединения строк строятся, когда блок впервые занимает всю ширину сетки.
+ *
+ *  Результат совпадает с mergeDefectsMy, включая порядок дефектов. Требуется регулярная сетка:
+ *  строки одинаковой длины, батчи примыкают друг к другу, рамки объединяемых дефектов лежат внутри своих батчей.
+ *  Иначе выполняется последовательное объединение.
+ */
+
+// Блок сетки: строки [row0, row1) и столбцы [col0, col1)
+struct TileBlock
+{
+    int row0 = 0, row1 = 0, col0 = 0, col1 = 0;
+    cv::Rect2i area;                            // пиксельная рамка блока
+    std::vector<int> frontier;                  // куски у границы блока (локальные и вертикальные дефекты)
+    std::vector<std::vector<int>> rowRoots;     // корни компонент каждой строки блока (горизонтальные дефекты)
+    std::vector<PieceGroup> groups;             // группы у верхней и нижней границы (блок во всю ширину сетки)
+};
+
+// Куски одного типа дефектов, разложенные по батчам сетки
+struct TileComponents
+{
+    DefectComponents components;
+    std::vector<std::vector<int>> tilePieces;   // индексы кусков по батчам, row * cols + col
+    std::vector<int> pieceRows;                 // строка сетки каждого куска
+    std::vector<TileBlock> blocks;              // блоки текущего уровня
+};
+
+// Лежит ли рамка ближе seamReach к границе блока
+bool nearBlockBorder(const cv::Rect2i& rect, const cv::Rect2i& area, int seamReach)
+{
+    return rect.x <= area.x + seamReach || rect.x + rect.width >= area.x + area.width - seamReach
+        || rect.y <= area.y + seamReach || rect.y + rect.height >= area.y + area.height - seamReach;
+}
+
+// Лежит ли рамка ближе seamReach к верхней или нижней границе блока
+bool nearBlockRowBorder(const cv::Rect2i& rect, const cv::Rect2i& area, int seamReach)
+{
+    return rect.y <= area.y + seamReach || rect.y + rect.height >= area.y + area.height - seamReach;
+}
+
+/**
+ * Объединение блоков одного уровня для одного типа дефектов.
+ *  Все функции меняют только куски своего блока, поэтому блоки уровня обрабатываются параллельно.
+ */
+class QuadtreeMerger
+{
+public:
+    QuadtreeMerger(TileComponents& typeTiles, const TileGrid& grid) : tiles(typeTiles), grid(grid) {}
+
+    // Блок из одного батча: все пары кусков батча
+    void mergeTile(TileBlock& block)
+    {
+        DefectComponents& dc = tiles.components;
+        const std::vector<int>& piecesOfTile = tiles.tilePieces[block.row0 * grid.cols() + block.col0];
+
+        std::vector<Interval> intervals;
+        intervals.reserve(piecesOfTile.size());
+        for (int i : piecesOfTile) {
+            intervals.push_back(dc.projection(dc.pieces[i].rect, i));
+        }
+        if (dc.strategy == MergeStrategy::HangingString) {
+            forEachOverlappingPair(intervals, dc.groupReach(), [&](int i, int j) {
+                uniteTouching(i, j);
+                });
+        }
+        else {
+            int tolerance = (dc.strategy == MergeStrategy::Horizontal) ? 0 : dc.extension;
+            forEachOverlappingPair(intervals, tolerance, [&](int i, int j) {
+                if (dc.rowNeighbours(i, j)) {
+                    dc.unite(i, j);
+                }
+                });
+        }
+
+        if (dc.strategy == MergeStrategy::Horizontal) {
+            block.rowRoots.assign(1, distinctRoots(piecesOfTile));
+        }
+        else {
+            for (int i : piecesOfTile) {
+                if (nearBlockBorder(dc.pieces[i].rect, block.area, seamReach())) {
+                    block.frontier.push_back(i);
+                }
+            }
+        }
+        if (fullWidth(block) && dc.strategy != MergeStrategy::HangingString) {
+            buildGroups(block);
+        }
+    }
+
+    // Сшивка дочерних блоков (до четырех) в блок следующего уровня
+    void mergeChildren(TileBlock& block, std::vector<TileBlock*>& children)
+    {
+        DefectComponents& dc = tiles.components;
+        if (dc.strategy == MergeStrategy::HangingString) {
+            stitchFrontier(block, children, [&](int i, int j) {
+                uniteTouching(i, j);
+                });
+            return;
+        }
+
+        // Дочерние блоки во всю ширину: строки уже объединены, сшиваются группы у шва
+        if (fullWidth(*children.front())) {
+            stitchGroups(block, children);
+            return;
+        }
+
+        // Иначе сначала сшиваются куски одних строк из соседних по горизонтали блоков
+        if (dc.strategy == MergeStrategy::Horizontal) {
+            stitchRowRoots(block, children);
+        }
+        else {
+            stitchFrontier(block, children, [&](int i, int j) {
+                if (tiles.pieceRows[i] == tiles.pieceRows[j] && dc.rowNeighbours(i, j)) {
+                    dc.unite(i, j);
+                }
+                });
+        }
+        if (fullWidth(block)) {
+            buildGroups(block);
+        }
+    }
+
+private:
+    // Наибольшее расстояние между рамками соседних кусков или групп (с учетом расширения рамки у края изображения)
+    int seamReach() const
+    {
+        return 2 * tiles.components.extension;
+    }
+
+    bool fullWidth(const TileBlock& block) const
+    {
+        return block.col0 == 0 && block.col1 == grid.cols();
+    }
+
+    // Проверка касания локальных кусков: как в mergeRow, более поздний кусок передается первым
+    void uniteTouching(int i, int j)
+    {
+        DefectComponents& dc = tiles.components;
+        int later = std::max(i, j);
+        int earlier = std::min(i, j);
+        if (dc.groupNeighbours({ dc.pieces[later].rect, later }, { dc.pieces[earlier].rect, earlier })) {
+            dc.unite(later, earlier);
+        }
+    }
+
+    std::vector<int> distinctRoots(const std::vector<int>& pieceIndices)
+    {
+        std::vector<int> roots;
+        roots.reserve(pieceIndices.size());
+        for (int i : pieceIndices) {
+            roots.push_back(tiles.components.sets.find(i));
+        }
+        std::sort(roots.begin(), roots.end());
+        roots.erase(std::unique(roots.begin(), roots.end()), roots.end());
+        return roots;
+    }
+
+    // Пары кусков у границ разных дочерних блоков, отобранные по проекции с допуском объединения
+    template <typename OnPair>
+    void stitchFrontier(TileBlock& block, std::vector<TileBlock*>& children, OnPair&& onPair)
+    {
+        DefectComponents& dc = tiles.components;
+        std::vector<Interval> intervals;
+        std::vector<int> childOf;
+        std::vector<int> pieceOf;
+        for (size_t c = 0; c < children.size(); ++c) {
+            for (int i : children[c]->frontier) {
+                Interval span = dc.projection(dc.pieces[i].rect, static_cast<int>(pieceOf.size()));
+                intervals.push_back(span);
+                childOf.push_back(static_cast<int>(c));
+                pieceOf.push_back(i);
+            }
+        }
+        forEachOverlappingPair(intervals, dc.groupReach(), [&](int a, int b) {
+            if (childOf[a] != childOf[b]) {
+                onPair(pieceOf[a], pieceOf[b]);
+            }
+            });
+
+        for (int i : pieceOf) {
+            if (nearBlockBorder(dc.pieces[i].rect, block.area, seamReach())) {
+                block.frontier.push_back(i);
+            }
+        }
+    }
+
+    // Горизонтальные куски одной строки соседствуют при пересечении по y. Компонента строки - непрерывный
+    // отрезок по y, поэтому пересечение рамок компонент равносильно пересечению каких-то их кусков
+    void stitchRowRoots(TileBlock& block, std::vector<TileBlock*>& children)
+    {
+        DefectComponents& dc = tiles.components;
+        block.rowRoots.assign(block.row1 - block.row0, {});
+        for (int row = block.row0; row < block.row1; ++row) {
+            std::vector<int> roots;
+            for (TileBlock* child : children) {
+                if (row >= child->row0 && row < child->row1) {
+                    const auto& childRoots = child->rowRoots[row - child->row0];
+                    roots.insert(roots.end(), childRoots.begin(), childRoots.end());
+                }
+            }
+            // Рамки запоминаются до объединений, как и в mergeRow
+            std::vector<cv::Rect2i> rects;
+            std::vector<Interval> intervals;
+            for (int k = 0; k < static_cast<int>(roots.size()); ++k) {
+                rects.push_back(dc.rects[roots[k]]);
+                intervals.push_back(dc.projection(rects[k], k));
+            }
+            forEachOverlappingPair(intervals, 0, [&](int a, int b) {
+                if (horizontalNeighbours(rects[a], rects[b])) {
+                    dc.unite(roots[a], roots[b]);
+                }
+                });
+            block.rowRoots[row - block.row0] = distinctRoots(roots);
+        }
+    }
+
+    // Группы строк блока во всю ширину: компоненты каждой строки, затем все пары групп, как в mergeRow
+    void buildGroups(TileBlock& block)
+    {
+        DefectComponents& dc = tiles.components;
+        std::vector<PieceGroup> groups;
+        for (int row = block.row0; row < block.row1; ++row) {
+            std::vector<int> rowPieces;
+            for (int col = 0; col < grid.cols(); ++col) {
+                const auto& piecesOfTile = tiles.tilePieces[row * grid.cols() + col];
+                rowPieces.insert(rowPieces.end(), piecesOfTile.begin(), piecesOfTile.end());
+            }
+            for (int root : distinctRoots(rowPieces)) {
+                groups.push_back({ dc.rects[root], root });
+            }
+        }
+
+        std::vector<Interval> intervals;
+        for (int g = 0; g < static_cast<int>(groups.size()); ++g) {
+            intervals.push_back(dc.projection(groups[g].rect, g));
+        }
+        forEachOverlappingPair(intervals, dc.extension, [&](int g, int h) {
+            if (dc.groupNeighbours(groups[g], groups[h])) {
+                dc.unite(groups[g].piece, groups[h].piece);
+            }
+            });
+
+        keepBorderGroups(block, groups);
+        block.rowRoots.clear();
+        block.frontier.clear();
+    }
+
+    // Сшивка групп верхнего и нижнего блоков у горизонтального шва
+    void stitchGroups(TileBlock& block, std::vector<TileBlock*>& children)
+    {
+        DefectComponents& dc = tiles.components;
+        std::vector<PieceGroup> groups;
+        std::vector<int> childOf;
+        for (size_t c = 0; c < children.size(); ++c) {
+            for (const auto& group : children[c]->groups) {
+                groups.push_back(group);
+                childOf.push_back(static_cast<int>(c));
+            }
+        }
+
+        std::vector<Interval> intervals;
+        for (int g = 0; g < static_cast<int>(groups.size()); ++g) {
+            intervals.push_back(dc.projection(groups[g].rect, g));
+        }
+        forEachOverlappingPair(intervals, dc.extension, [&](int g, int h) {
+            if (childOf[g] != childOf[h] && dc.groupNeighbours(groups[g], groups[h])) {
+                dc.unite(groups[g].piece, groups[h].piece);
+            }
+            });
+
+        keepBorderGroups(block, groups);
+    }
+
+    void keepBorderGroups(TileBlock& block, const std::vector<PieceGroup>& groups)
+    {
+        block.groups.clear();
+        for (const auto& group : groups) {
+            if (nearBlockRowBorder(group.rect, block.area, seamReach())) {
+                block.groups.push_back(group);
+            }
+        }
+    }
+
+    TileComponents& tiles;
+    const TileGrid& grid;
+};
+
+/**
+ * Параллельное объединение кусков дефектов.
+ *
+ * @param batchesDetects - строки батчей регулярной сетки, как для mergeDefectsMy
+ * @param resultDetects - результат в том же порядке, что у mergeDefectsMy
+ * @param pool - пул потоков, на котором обрабатываются блоки
+ */
+void mergeDefectsParallel(std::vector<std::vector<BatchResult>> batchesDetects, std::vector<DetectResult>& resultDetects,
+    ThreadPool& pool)
+{
+    TileGrid grid;
+    if (!regularTileGrid(batchesDetects, grid)) {
+        mergeDefectsMy(std::move(batchesDetects), resultDetects);
+        return;
+    }
+    int rows = grid.rows();
+    int cols = grid.cols();
+
+    // Раскладка кусков по типам и батчам в том же порядке обхода, что и в mergeDefectsMy.
+    // Допуски берутся один раз до запуска задач: потоки пула работают с этим снимком
+    MergeTolerances tolerances = mergeTolerances();
+    std::map<DefectType, TileComponents> components;
+    for (int row = 0; row < rows; ++row) {
+        MERGE_STATS_SPAN("classify", "row", row);
+        for (int col = 0; col < cols; ++col) {
+            for (auto& defect : batchesDetects[row][col].detects) {
+                MergePolicy policy = defectPolicy(defect.klass);
+                if (policy.strategy == MergeStrategy::None) {
+                    MERGE_STATS_COUNT(UnmergedDefects, defect.klass, 1);
+                    resultDetects.push_back(std::move(defect));
+                    continue;
+                }
+
+                auto& typeTiles = components[policy.type];
+                if (typeTiles.tilePieces.empty()) {
+                    typeTiles.components.configure(policy.type, tolerances);
+                    typeTiles.tilePieces.resize(rows * cols);
+                }
+                int index = typeTiles.components.add(std::move(defect));
+                typeTiles.tilePieces[row * cols + col].push_back(index);
+                typeTiles.pieceRows.push_back(row);
+            }
+        }
+    }
+
+    std::vector<TileComponents*> types;
+    for (auto& [defectType, typeTiles] : components) {
+        types.push_back(&typeTiles);
+    }
+
+    auto blockArea = [&](const TileBlock& block) {
+        return cv::Rect2i(grid.x[block.col0], grid.y[block.row0],
+            grid.x[block.col1] - grid.x[block.col0], grid.y[block.row1] - grid.y[block.row0]);
+    };
+
+    // Уровень 0: каждый батч
+    int blockRows = rows;
+    int blockCols = cols;
+    for (TileComponents* typeTiles : types) {
+        typeTiles->blocks.resize(rows * cols);
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                TileBlock& block = typeTiles->blocks[row * cols + col];
+                block.row0 = row;
+                block.row1 = row + 1;
+                block.col0 = col;
+                block.col1 = col + 1;
+                block.area = blockArea(block);
+            }
+        }
+    }
+    pool.parallelFor(static_cast<int>(types.size()) * blockRows * blockCols, [&](int task) {
+        MERGE_STATS_SPAN("tileMerge", "task", task);
+        TileComponents& typeTiles = *types[task / (blockRows * blockCols)];
+        QuadtreeMerger(typeTiles, grid).mergeTile(typeTiles.blocks[task % (blockRows * blockCols)]);
+        });
+
+    // Следующие уровни: блоки 2x2 предыдущего уровня, пока не останется один блок
+    while (blockRows > 1 || blockCols > 1) {
+        int parentRows = (blockRows + 1) / 2;
+        int parentCols = (blockCols + 1) / 2;
+        std::vector<std::vector<TileBlock>> parents(types.size());
+        for (size_t t = 0; t < types.size(); ++t) {
+            parents[t].resize(parentRows * parentCols);
+            for (int r = 0; r < parentRows; ++r) {
+                for (int c = 0; c < parentCols; ++c) {
+                    const TileBlock& topLeft = types[t]->blocks[2 * r * blockCols + 2 * c];
+                    const TileBlock& bottomRight = types[t]->blocks[std::min(2 * r + 1, blockRows - 1) * blockCols
+                        + std::min(2 * c + 1, blockCols - 1)];
+                    TileBlock& block = parents[t][r * parentCols + c];
+                    block.row0 = topLeft.row0;
+                    block.row1 = bottomRight.row1;
+                    block.col0 = topLeft.col0;
+                    block.col1 = bottomRight.col1;
+                    block.area = blockArea(block);
+                }
+            }
+        }
+
+        pool.parallelFor(static_cast<int>(types.size()) * parentRows * parentCols, [&](int task) {
+            MERGE_STATS_SPAN("blockMerge", "task", task);
+            int t = task / (parentRows * parentCols);
+            int r = (task % (parentRows * parentCols)) / parentCols;
+            int c = task % parentCols;
+            std::vector<TileBlock*> children;
+            for (int dRow = 0; dRow < 2 && 2 * r + dRow < blockRows; ++dRow) {
+                for (int dCol = 0; dCol < 2 && 2 * c + dCol < blockCols; ++dCol) {
+                    children.push_back(&types[t]->blocks[(2 * r + dRow) * blockCols + 2 * c + dCol]);
+                }
+            }
+            QuadtreeMerger(*types[t], grid).mergeChildren(parents[t][r * parentCols + c], children);
+            });
+
+        for (size_t t = 0; t < types.size(); ++t) {
+            types[t]->blocks = std::move(parents[t]);
+        }
+        blockRows = parentRows;
+        blockCols = parentCols;
+    }
+
+    // Сборка итоговых дефектов последовательно, в порядке типов, как в mergeDefectsMy
+    MERGE_STATS_SPAN("outputMove");
+    for (TileComponents* typeTiles : types) {
+        typeTiles->components.collect(resultDetects);
+    }
+}
+
+/**
+ * Параллельное объединение по типам дефектов. Куски разных типов никогда не объединяются,
+ *  поэтому конвейер mergeDefectsMy для каждого типа выполняется отдельной задачей пула.
+ *  Дефекты раскладываются по типам за один проход, результаты склеиваются в порядке типов,
+ *  поэтому результат совпадает с mergeDefectsMy, включая порядок. Сетка батчей может быть любой.
+ *
+ * @param batchesDetects - строки батчей, как для mergeDefectsMy
+ * @param resultDetects - результат в том же порядке, что у mergeDefectsMy
+ * @param pool - пул потоков, типы с большим числом кусков выравниваются перехватом задач
+ */
+void mergeDefectsByType(std::vector<std::vector<BatchResult>> batchesDetects, std::vector<DetectResult>& resultDetects,
+    ThreadPool& pool)
+{
+    // Куски каждого типа по строкам батчей
+    std::map<DefectType, std::vector<std::vector<DetectResult>>> typeRows;
+    for (size_t row = 0; row < batchesDetects.size(); ++row) {
+        for (auto& batch : batchesDetects[row]) {
+            for (auto& defect : batch.detects) {
+                MergePolicy policy = defectPolicy(defect.klass);
+                if (policy.strategy == MergeStrategy::None) {
+                    MERGE_STATS_COUNT(UnmergedDefects, defect.klass, 1);
+                    resultDetects.push_back(std::move(defect));
+                    continue;
+                }
+                auto& rows = typeRows[policy.type];
+                rows.resize(batchesDetects.size());
+                rows[row].push_back(std::move(defect));
+            }
+        }
+    }
+
+    std::vector<std::pair<DefectType, std::vector<std::vector<DetectResult>>*>> types;
+    for (auto& [defectType, rows] : typeRows) {
+        types.emplace_back(defectType, &rows);
+    }
+
+    MergeTolerances tolerances = mergeTolerances();
+    std::vector<std::vector<DetectResult>> typeResults(types.size());
+    pool.parallelFor(static_cast<int>(types.size()), [&](int t) {
+        MERGE_STATS_SPAN("typeMerge", "type", static_cast<int>(types[t].first));
+        DefectComponents typeComponents;
+        typeComponents.configure(types[t].first, tolerances);
+        for (auto& row : *types[t].second) {
+            for (auto& defect : row) {
+                typeComponents.add(std::move(defect));
+            }
+            typeComponents.mergeRow();
+        }
+        typeComponents.collect(typeResults[t]);
+        });
+
+    MERGE_STATS_SPAN("outputMove");
+    for (auto& typeResult : typeResults) {
+        std::move(typeResult.begin(), typeResult.end(), std::back_inserter(resultDetects));
+    }
+}
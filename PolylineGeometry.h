@@ -0,0 +1,172 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <tuple>
+#include "DataStructs.h"
+
+/**
+ * Геометрия векторных (линейных) дефектов: расстояния между ломаными, сшивка концов и растеризация.
+ *  Ломаная из одной точки считается отрезком нулевой длины.
+ */
+
+// Расстояние от точки p до отрезка [a, b]
+double pointSegmentDistance(const cv::Point2d& p, const cv::Point2d& a, const cv::Point2d& b)
+{
+    cv::Point2d ab = b - a;
+    cv::Point2d ap = p - a;
+    double lengthSquared = ab.x * ab.x + ab.y * ab.y;
+    double t = (lengthSquared > 0) ? std::clamp((ap.x * ab.x + ap.y * ab.y) / lengthSquared, 0.0, 1.0) : 0.0;
+    double dx = ap.x - t * ab.x;
+    double dy = ap.y - t * ab.y;
+    return std::sqrt(dx * dx + dy * dy);
+}
+
+// Знак векторного произведения (b - a) x (c - a)
+int orientation(const cv::Point2d& a, const cv::Point2d& b, const cv::Point2d& c)
+{
+    double cross = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    return (cross > 0) - (cross < 0);
+}
+
+// Расстояние между отрезками [a1, a2] и [b1, b2], 0 при пересечении
+double segmentDistance(const cv::Point2d& a1, const cv::Point2d& a2, const cv::Point2d& b1, const cv::Point2d& b2)
+{
+    int o1 = orientation(a1, a2, b1);
+    int o2 = orientation(a1, a2, b2);
+    int o3 = orientation(b1, b2, a1);
+    int o4 = orientation(b1, b2, a2);
+    if (o1 != o2 && o3 != o4 && o1 != 0 && o2 != 0 && o3 != 0 && o4 != 0) {
+        return 0.0;
+    }
+    // Касание и коллинеарный случай покрываются расстояниями от концов до отрезков
+    return std::min({ pointSegmentDistance(a1, b1, b2), pointSegmentDistance(a2, b1, b2),
+        pointSegmentDistance(b1, a1, a2), pointSegmentDistance(b2, a1, a2) });
+}
+
+// Зазор между краями линий двух ломаных с учетом их толщины, 0 при пересечении
+double polylineGap(const DefectPolyline& a, const DefectPolyline& b)
+{
+    double distance = HUGE_VAL;
+    size_t aSegments = std::max<size_t>(a.points.size(), 2) - 1;
+    size_t bSegments = std::max<size_t>(b.points.size(), 2) - 1;
+    for (size_t i = 0; i < aSegments && distance > 0; ++i) {
+        cv::Point2d a1(a.points[i].x, a.points[i].y);
+        cv::Point2d a2(a.points[std::min(i + 1, a.points.size() - 1)].x, a.points[std::min(i + 1, a.points.size() - 1)].y);
+        for (size_t j = 0; j < bSegments && distance > 0; ++j) {
+            cv::Point2d b1(b.points[j].x, b.points[j].y);
+            cv::Point2d b2(b.points[std::min(j + 1, b.points.size() - 1)].x, b.points[std::min(j + 1, b.points.size() - 1)].y);
+            distance = std::min(distance, segmentDistance(a1, a2, b1, b2));
+        }
+    }
+    return std::max(0.0, distance - (a.thickness + b.thickness) / 2.0);
+}
+
+// Касаются ли векторные дефекты: зазор между какими-либо их линиями не больше tolerance
+bool polylinesTouch(const std::vector<DefectPolyline>& a, const std::vector<DefectPolyline>& b, int tolerance)
+{
+    for (const auto& lineA : a) {
+        for (const auto& lineB : b) {
+            if (!lineA.points.empty() && !lineB.points.empty() && polylineGap(lineA, lineB) <= tolerance) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Соединение ломаных одинаковой толщины с совпадающими концами в одну ломаную (конец к концу).
+// Концы упорядочиваются по толщине и точке, стык соединяется, только если в точке сходятся ровно два конца разных
+// ломаных: в развилке и при разной толщине ломаные остаются отдельными. Сложность O(n log n) по числу ломаных
+void joinPolylines(std::vector<DefectPolyline>& lines)
+{
+    // Конец ломаной line: side 0 - первая точка, 1 - последняя. Номер конца - 2 * line + side
+    struct LineEnd
+    {
+        cv::Point2i point;
+        int thickness;
+        int line;
+        int side;
+    };
+    std::vector<LineEnd> ends;
+    ends.reserve(2 * lines.size());
+    for (int i = 0; i < static_cast<int>(lines.size()); ++i) {
+        if (!lines[i].points.empty()) {
+            ends.push_back({ lines[i].points.front(), lines[i].thickness, i, 0 });
+            ends.push_back({ lines[i].points.back(), lines[i].thickness, i, 1 });
+        }
+    }
+    auto key = [](const LineEnd& end) { return std::make_tuple(end.thickness, end.point.y, end.point.x); };
+    std::sort(ends.begin(), ends.end(), [&](const LineEnd& a, const LineEnd& b) { return key(a) < key(b); });
+
+    std::vector<int> partner(2 * lines.size(), -1);    // конец, с которым соединен данный
+    bool anyJoint = false;
+    for (size_t k = 0; k < ends.size();) {
+        size_t next = k + 1;
+        while (next < ends.size() && key(ends[next]) == key(ends[k])) {
+            ++next;
+        }
+        if (next - k == 2 && ends[k].line != ends[k + 1].line) {
+            partner[2 * ends[k].line + ends[k].side] = 2 * ends[k + 1].line + ends[k + 1].side;
+            partner[2 * ends[k + 1].line + ends[k + 1].side] = 2 * ends[k].line + ends[k].side;
+            anyJoint = true;
+        }
+        k = next;
+    }
+    if (!anyJoint) {
+        return;
+    }
+
+    std::vector<DefectPolyline> joined;
+    std::vector<char> used(lines.size(), 0);
+    for (int i = 0; i < static_cast<int>(lines.size()); ++i) {
+        if (used[i]) {
+            continue;
+        }
+        // Начало цепочки: идем назад до свободного конца. Замкнутая цепочка начинается с самой ломаной i
+        int line = i, side = 0;     // side - конец line, которым она примыкает к предыдущей ломаной цепочки
+        for (int end = partner[2 * line + side]; end >= 0; end = partner[2 * line + side]) {
+            line = end / 2;
+            side = 1 - end % 2;
+            if (line == i) {
+                side = 0;
+                break;
+            }
+        }
+        // Проход вперед: ломаные разворачиваются так, чтобы конец предыдущей совпадал с началом следующей,
+        // точка стыка не дублируется
+        DefectPolyline& chain = joined.emplace_back();
+        chain.thickness = lines[line].thickness;
+        while (!used[line]) {
+            used[line] = 1;
+            auto& points = lines[line].points;
+            size_t skip = chain.points.empty() ? 0 : 1;
+            if (side == 0) {
+                chain.points.insert(chain.points.end(), points.begin() + skip, points.end());
+            }
+            else {
+                chain.points.insert(chain.points.end(), points.rbegin() + skip, points.rend());
+            }
+            int end = partner[2 * line + 1 - side];
+            if (end < 0) {
+                break;
+            }
+            line = end / 2;
+            side = end % 2;
+        }
+    }
+    lines = std::move(joined);
+}
+
+// Растеризация ломаных в target, точка изображения p попадает в пиксель p + shift
+void drawPolylines(const std::vector<DefectPolyline>& lines, cv::Mat& target, const cv::Point2i& shift)
+{
+    for (const auto& line : lines) {
+        if (line.points.size() == 1) {
+            cv::line(target, line.points[0] + shift, line.points[0] + shift, cv::Scalar(255), line.thickness);
+        }
+        for (size_t i = 1; i < line.points.size(); ++i) {
+            cv::line(target, line.points[i - 1] + shift, line.points[i] + shift, cv::Scalar(255), line.thickness);
+        }
+    }
+}
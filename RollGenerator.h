@@ -0,0 +1,206 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+#include "DetectMerger.h"
+#include "LaneMerger.h"
+
+/**
+ * Генератор синтетического рулона для замеров объединения.
+ *  Дефекты размещаются на всем полотне, затем режутся по батчам, как их нашел бы детектор: у каждого куска
+ *  своя маска и рамка, плотно охватывающая его пиксели. Форма дефекта зависит от способа объединения класса:
+ *  горизонтальные - полосы поперек полотна, вертикальные - полосы вдоль рулона через несколько строк батчей,
+ *  локальные - небольшие пятна и нити. Одинаковые настройки и seed дают одинаковый рулон.
+ */
+
+// Форма маски синтетического дефекта
+enum class DefectShape {
+    Filled,     // маска заполнена целиком
+    Line,       // толстая линия вдоль дефекта, нарисованная в маске
+    Diagonal,   // диагональная нить через угол батча (куски в четырех батчах, касание по углу)
+    Polyline    // то же, что Line, но векторной ломаной без маски
+};
+
+struct RollConfig
+{
+    uint32_t seed = 1;
+    int width = 4096;               // ширина полотна, пиксели
+    int length = 100000;            // длина рулона, пиксели
+    int tileWidth = 512;            // размер батча
+    int tileHeight = 512;
+    int overlap = 0;                // перекрытие соседних батчей (детектор с перекрытием, см. OverlapTiles.h)
+    double density = 20.0;          // дефектов на мегапиксель полотна (до разрезания по батчам)
+
+    // Доли классов: номер класса и вес. По умолчанию - шов, висячая нить, близна, пятно и необъединяемый класс
+    std::vector<std::pair<int64_t, double>> classWeights = { { 11, 1.0 }, { 16, 2.0 }, { 18, 1.0 }, { 4, 3.0 }, { 23, 1.0 } };
+    std::array<double, 4> shapeWeights = { 4.0, 2.0, 1.0, 1.0 };   // веса форм, индекс - DefectShape
+};
+
+/**
+ * Генерация рулона: сетка батчей с кусками дефектов.
+ *
+ * @param config - размеры, плотность, доли классов и форм
+ * @return сетка батчей, как ее принимает mergeDefectsMy
+ */
+std::vector<std::vector<BatchResult>> generateRoll(const RollConfig& config)
+{
+    int rows = (config.length + config.tileHeight - 1) / config.tileHeight;
+    int cols = (config.width + config.tileWidth - 1) / config.tileWidth;
+    cv::Rect2i roll(0, 0, config.width, config.length);
+
+    std::vector<std::vector<BatchResult>> grid(rows, std::vector<BatchResult>(cols));
+    for (int i = 0; i < rows; ++i) {
+        for (int j = 0; j < cols; ++j) {
+            // Батч с перекрытием заходит на соседей на половину перекрытия с каждой стороны
+            grid[i][j].batchRect = cv::Rect2i(j * config.tileWidth - config.overlap / 2, i * config.tileHeight - config.overlap / 2,
+                config.tileWidth + config.overlap, config.tileHeight + config.overlap) & roll;
+        }
+    }
+
+    std::mt19937 rng(config.seed);
+    auto uniform = [&](int lo, int hi) { return std::uniform_int_distribution<int>(lo, std::max(lo, hi))(rng); };
+    std::vector<double> classWeights;
+    for (const auto& [klass, weight] : config.classWeights) {
+        classWeights.push_back(weight);
+    }
+    std::discrete_distribution<int> pickClass(classWeights.begin(), classWeights.end());
+    std::discrete_distribution<int> pickShape(config.shapeWeights.begin(), config.shapeWeights.end());
+    std::uniform_real_distribution<float> pickProb(0.3f, 1.0f);
+
+    long long count = std::llround(config.density * config.width * static_cast<double>(config.length) / 1e6);
+    for (long long n = 0; n < count && !classWeights.empty(); ++n) {
+        int64_t klass = config.classWeights[pickClass(rng)].first;
+        DefectShape shape = static_cast<DefectShape>(pickShape(rng));
+        MergeStrategy strategy = defectPolicy(klass).strategy;
+        float prob = pickProb(rng);
+
+        // Рамка дефекта на полотне и его ось (ломаная для всех форм, кроме Filled)
+        cv::Rect2i rect;
+        DefectPolyline axis;
+        if (shape == DefectShape::Diagonal && (rows > 1 || cols > 1)) {
+            // Середина нити - внутренний угол сетки батчей
+            int side = uniform(20, 200);
+            cv::Point2i corner(uniform(1, std::max(1, cols - 1)) * config.tileWidth,
+                uniform(1, std::max(1, rows - 1)) * config.tileHeight);
+            rect = cv::Rect2i(corner.x - side / 2, corner.y - side / 2, side, side);
+            bool falling = uniform(0, 1) == 0;
+            axis = { { cv::Point2i(rect.x, falling ? rect.y : rect.y + side - 1),
+                cv::Point2i(rect.x + side - 1, falling ? rect.y + side - 1 : rect.y) }, 3 };
+        }
+        else {
+            if (strategy == MergeStrategy::Horizontal) {
+                int height = uniform(4, 40);
+                int length = uniform(config.width / 4, config.width);
+                rect = cv::Rect2i(uniform(0, config.width - length), uniform(0, config.length - height), length, height);
+                int middle = rect.y + height / 2;
+                axis = { { cv::Point2i(rect.x, middle), cv::Point2i(rect.x + length - 1, middle) }, std::max(1, height / 2) };
+            }
+            else if (strategy == MergeStrategy::Vertical) {
+                int width = uniform(3, 16);
+                int length = std::min(config.length, uniform(config.tileHeight / 2, 4 * config.tileHeight));
+                rect = cv::Rect2i(uniform(0, config.width - width), uniform(0, config.length - length), width, length);
+                int middle = rect.x + width / 2;
+                axis = { { cv::Point2i(middle, rect.y), cv::Point2i(middle, rect.y + length - 1) }, std::max(1, width / 2) };
+            }
+            else {
+                int width = uniform(8, 120);
+                int height = uniform(8, 120);
+                rect = cv::Rect2i(uniform(0, config.width - width), uniform(0, config.length - height), width, height);
+                axis = { { rect.tl(), cv::Point2i(rect.x + width - 1, rect.y + height - 1) }, 3 };
+            }
+        }
+        rect &= roll;
+        if (rect.area() <= 0) {
+            continue;
+        }
+
+        // Разрезание по батчам: кусок - пиксели дефекта в батче, рамка - их плотная рамка.
+        // При перекрытии дефект в полосе перекрытия попадает в оба батча
+        int reach = config.overlap;
+        for (int i = std::max(0, (rect.y - reach) / config.tileHeight);
+            i <= std::min(rows - 1, (rect.y + rect.height - 1 + reach) / config.tileHeight); ++i) {
+            for (int j = std::max(0, (rect.x - reach) / config.tileWidth);
+                j <= std::min(cols - 1, (rect.x + rect.width - 1 + reach) / config.tileWidth); ++j) {
+                BatchResult& batch = grid[i][j];
+                cv::Rect2i pieceRect = rect & batch.batchRect;
+                if (pieceRect.area() <= 0) {
+                    continue;
+                }
+                cv::Mat mask;
+                if (shape == DefectShape::Filled) {
+                    mask = cv::Mat::ones(pieceRect.size(), CV_8UC1) * 255;
+                }
+                else {
+                    mask = cv::Mat::zeros(pieceRect.size(), CV_8UC1);
+                    drawPolylines({ axis }, mask, -pieceRect.tl());
+                }
+                cv::Rect2i bounds = nonZeroBounds(mask);
+                if (bounds.area() <= 0) {
+                    continue;
+                }
+
+                DetectResult piece;
+                piece.rect = cv::Rect2i(bounds.tl() + pieceRect.tl(), bounds.size());
+                piece.prob = prob;
+                piece.klass = klass;
+                if (shape == DefectShape::Polyline) {
+                    // Ось обрезается по куску с запасом на толщину, за рамкой куска линия все равно не рисуется
+                    DefectPolyline line = axis;
+                    int margin = line.thickness / 2 + 1;
+                    cv::Rect2i clipRect(piece.rect.x - margin, piece.rect.y - margin,
+                        piece.rect.width + 2 * margin, piece.rect.height + 2 * margin);
+                    if (!cv::clipLine(clipRect, line.points[0], line.points[1])) {
+                        continue;
+                    }
+                    piece.lines.push_back(std::move(line));
+                }
+                else {
+                    piece.mask = mask(bounds).clone();
+                }
+                batch.detects.push_back(std::move(piece));
+            }
+        }
+    }
+    return grid;
+}
+
+/**
+ * Разрезание рулона на полосы камер для замеров mergeDefectsLanes. Столбцы батчей делятся между laneCount камерами
+ *  поровну, сетка каждой камеры переводится в ее координаты (начало - левый верхний угол ее первого батча).
+ *  Общая зона соседних камер - перекрытие их крайних батчей (RollConfig::overlap).
+ *
+ * @param roll - сетка батчей рулона (generateRoll)
+ * @param laneCount - число камер, не больше числа столбцов батчей
+ */
+void splitRollLanes(std::vector<std::vector<BatchResult>> roll, int laneCount, std::vector<LaneGrid>& lanes,
+    std::vector<LaneCalibration>& calibration)
+{
+    int cols = roll.empty() ? 0 : static_cast<int>(roll.front().size());
+    laneCount = std::clamp(laneCount, 1, std::max(1, cols));
+    lanes.assign(laneCount, LaneGrid(roll.size()));
+    calibration.assign(laneCount, LaneCalibration());
+    for (int lane = 0; lane < laneCount && cols > 0; ++lane) {
+        int firstCol = lane * cols / laneCount;
+        calibration[lane].offset = roll.front()[firstCol].batchRect.tl();
+        if (lane > 0) {
+            const cv::Rect2i& previous = roll.front()[firstCol - 1].batchRect;
+            calibration[lane].overlap = previous.x + previous.width - calibration[lane].offset.x;
+        }
+    }
+    for (int lane = 0; lane < laneCount && cols > 0; ++lane) {
+        int firstCol = lane * cols / laneCount;
+        int endCol = (lane + 1) * cols / laneCount;
+        for (size_t r = 0; r < roll.size(); ++r) {
+            for (int c = firstCol; c < endCol; ++c) {
+                BatchResult& batch = roll[r][c];
+                batch.batchRect = cv::Rect2i(batch.batchRect.tl() - calibration[lane].offset, batch.batchRect.size());
+                for (auto& defect : batch.detects) {
+                    shiftDefect(defect, -calibration[lane].offset);
+                }
+                lanes[lane][r].push_back(std::move(batch));
+            }
+        }
+    }
+}
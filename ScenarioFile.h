@@ -0,0 +1,323 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <iterator>
+#include "DataStructs.h"
+#include "MergePolicy.h"
+#include "PolylineGeometry.h"
+
+/**
+ * Файл сценария: кадры с сеткой батчей и найденными в батчах дефектами в текстовом виде.
+ *  Используется для воспроизведения кадров без детектора и без интерактивного main().
+ *  Строка файла - одна команда, текст после # пропускается:
+ *
+ *    frame <rows> <cols> <batchWidth> <batchHeight>
+ *        начало кадра: регулярная сетка rows x cols батчей заданного размера от точки (0, 0)
+ *    batch <row> <col> <x> <y> <width> <height>
+ *        рамка батча [row][col] текущего кадра (для нерегулярной сетки)
+ *    defect <row> <col> <class> <x> <y> <width> <height> <prob> <геометрия>...
+ *        дефект батча [row][col]; class - шифр класса ("B.7") или его номер
+ *
+ *  Геометрия дефекта - одно или несколько описаний, маски накладываются друг на друга:
+ *    fill                                     - маска заполнена целиком
+ *    rle <n> <run1> ... <runN>                - маска построчно сериями, начиная с серии нулей
+ *    line <thickness> <n> <x1> <y1> ...       - ломаная, нарисованная в маске (координаты изображения)
+ *    polyline <thickness> <n> <x1> <y1> ...   - векторная ломаная без маски (DetectResult::lines)
+ */
+
+// Сетка батчей одного кадра, как ее принимает mergeDefectsMy
+using BatchGrid = std::vector<std::vector<BatchResult>>;
+
+// Номер класса по шифру или по записи номера, -1 если класс не распознан
+int64_t parseDefectClass(const std::string& token)
+{
+    for (const auto& info : defectClasses) {
+        if (token == info.code) {
+            return info.klass;
+        }
+    }
+    try {
+        size_t parsed = 0;
+        int64_t klass = std::stoll(token, &parsed);
+        return (parsed == token.size() && klass >= 0) ? klass : -1;
+    }
+    catch (const std::exception&) {
+        return -1;
+    }
+}
+
+// Чтение геометрии дефекта из остатка строки. Возвращает текст ошибки или пустую строку
+std::string parseDefectGeometry(std::istringstream& line, DetectResult& defect)
+{
+    auto readPoints = [&](DefectPolyline& polyline) {
+        int count = 0;
+        if (!(line >> polyline.thickness >> count) || polyline.thickness <= 0 || count <= 0) {
+            return false;
+        }
+        polyline.points.resize(count);
+        for (auto& point : polyline.points) {
+            if (!(line >> point.x >> point.y)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto maskOf = [&]() -> cv::Mat& {
+        if (defect.mask.empty()) {
+            defect.mask = cv::Mat::zeros(defect.rect.size(), CV_8UC1);
+        }
+        return defect.mask;
+    };
+
+    std::string kind;
+    bool any = false;
+    while (line >> kind) {
+        any = true;
+        if (kind == "fill") {
+            maskOf().setTo(255);
+        }
+        else if (kind == "rle") {
+            int count = 0;
+            if (!(line >> count) || count < 0) {
+                return "ожидается число серий rle";
+            }
+            cv::Mat& mask = maskOf();
+            size_t total = mask.total();
+            size_t position = 0;
+            for (int k = 0; k < count; ++k) {
+                long long run = 0;
+                if (!(line >> run) || run < 0) {
+                    return "ожидается длина серии rle";
+                }
+                if (position + run > total) {
+                    return "серии rle длиннее маски";
+                }
+                if (k % 2 == 1) {
+                    std::fill(mask.data + position, mask.data + position + run, 255);
+                }
+                position += run;
+            }
+        }
+        else if (kind == "line" || kind == "polyline") {
+            DefectPolyline polyline;
+            if (!readPoints(polyline)) {
+                return "ожидается \"" + kind + " <толщина> <число точек> <x> <y> ...\"";
+            }
+            if (kind == "line") {
+                drawPolylines({ polyline }, maskOf(), -defect.rect.tl());
+            }
+            else {
+                defect.lines.push_back(std::move(polyline));
+            }
+        }
+        else {
+            return "неизвестная геометрия " + kind;
+        }
+    }
+    return any ? std::string() : "не задана геометрия дефекта";
+}
+
+/**
+ * Чтение кадров из файла сценария.
+ *
+ * @param path - путь к файлу сценария
+ * @param frames - сюда дописываются прочитанные кадры
+ * @return false, если файл не открылся или содержит ошибки (они выводятся в std::cerr)
+ */
+bool loadScenario(const std::string& path, std::vector<BatchGrid>& frames)
+{
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << path << ": не удалось открыть файл сценария\n";
+        return false;
+    }
+
+    std::vector<BatchGrid> loaded;
+    bool valid = true;
+    std::string text;
+    for (int lineNumber = 1; std::getline(file, text); ++lineNumber) {
+        std::istringstream line(text.substr(0, text.find('#')));
+        std::string command;
+        if (!(line >> command)) {
+            continue;
+        }
+        auto fail = [&](const std::string& message) {
+            std::cerr << path << ":" << lineNumber << ": " << message << "\n";
+            valid = false;
+        };
+
+        if (command == "frame") {
+            int rows = 0, cols = 0, width = 0, height = 0;
+            if (!(line >> rows >> cols >> width >> height) || rows <= 0 || cols <= 0 || width <= 0 || height <= 0) {
+                fail("ожидается \"frame <строк> <столбцов> <ширина батча> <высота батча>\"");
+                continue;
+            }
+            BatchGrid& grid = loaded.emplace_back(rows, std::vector<BatchResult>(cols));
+            for (int i = 0; i < rows; ++i) {
+                for (int j = 0; j < cols; ++j) {
+                    grid[i][j].batchRect = cv::Rect2i(j * width, i * height, width, height);
+                }
+            }
+            continue;
+        }
+        if (command != "batch" && command != "defect") {
+            fail("неизвестная команда " + command);
+            continue;
+        }
+        if (loaded.empty()) {
+            fail("команда " + command + " до первой команды frame");
+            continue;
+        }
+
+        BatchGrid& grid = loaded.back();
+        int row = -1, col = -1;
+        line >> row >> col;
+        if (row < 0 || row >= static_cast<int>(grid.size()) || col < 0 || col >= static_cast<int>(grid[row].size())) {
+            fail("батч вне сетки кадра");
+            continue;
+        }
+
+        if (command == "batch") {
+            cv::Rect2i& rect = grid[row][col].batchRect;
+            if (!(line >> rect.x >> rect.y >> rect.width >> rect.height) || rect.width <= 0 || rect.height <= 0) {
+                fail("ожидается \"batch <строка> <столбец> <x> <y> <ширина> <высота>\"");
+            }
+        }
+        else {
+            std::string code;
+            DetectResult defect;
+            if (!(line >> code >> defect.rect.x >> defect.rect.y >> defect.rect.width >> defect.rect.height >> defect.prob)
+                || defect.rect.width <= 0 || defect.rect.height <= 0) {
+                fail("ожидается \"defect <строка> <столбец> <класс> <x> <y> <ширина> <высота> <точность> <геометрия>\"");
+                continue;
+            }
+            defect.klass = parseDefectClass(code);
+            if (defect.klass < 0) {
+                fail("неизвестный класс " + code);
+                continue;
+            }
+            std::string error = parseDefectGeometry(line, defect);
+            if (!error.empty()) {
+                fail(error);
+                continue;
+            }
+            grid[row][col].detects.push_back(std::move(defect));
+        }
+    }
+
+    if (!valid) {
+        return false;
+    }
+    std::move(loaded.begin(), loaded.end(), std::back_inserter(frames));
+    return true;
+}
+
+// Серии маски построчно, начиная с серии нулей (геометрия rle)
+std::vector<long long> maskRuns(const cv::Mat& mask)
+{
+    std::vector<long long> runs;
+    uchar current = 0;
+    long long length = 0;
+    for (int y = 0; y < mask.rows; ++y) {
+        const uchar* row = mask.ptr<uchar>(y);
+        for (int x = 0; x < mask.cols; ++x) {
+            uchar value = row[x] ? 255 : 0;
+            if (value != current) {
+                runs.push_back(length);
+                current = value;
+                length = 0;
+            }
+            ++length;
+        }
+    }
+    if (current) {
+        runs.push_back(length);     // завершающие нули не записываются
+    }
+    return runs;
+}
+
+/**
+ * Запись кадров в файл сценария, который читает loadScenario.
+ *  Рамка кадра берется по батчу [0][0], отличающиеся батчи записываются командой batch.
+ *  Маска и фрагменты дефекта записываются сериями, векторные ломаные - командой polyline.
+ *
+ * @return false, если файл не удалось записать (ошибка выводится в std::cerr)
+ */
+bool saveScenario(const std::string& path, const std::vector<BatchGrid>& frames)
+{
+    std::ofstream file(path);
+    if (!file) {
+        std::cerr << path << ": не удалось создать файл сценария\n";
+        return false;
+    }
+
+    for (const auto& grid : frames) {
+        if (grid.empty() || grid[0].empty()) {
+            continue;
+        }
+        const cv::Rect2i& first = grid[0][0].batchRect;
+        file << "frame " << grid.size() << " " << grid[0].size() << " " << first.width << " " << first.height << "\n";
+        for (int i = 0; i < static_cast<int>(grid.size()); ++i) {
+            for (int j = 0; j < static_cast<int>(grid[i].size()); ++j) {
+                const cv::Rect2i& rect = grid[i][j].batchRect;
+                if (rect != cv::Rect2i(j * first.width, i * first.height, first.width, first.height)) {
+                    file << "batch " << i << " " << j << " " << rect.x << " " << rect.y << " "
+                        << rect.width << " " << rect.height << "\n";
+                }
+            }
+        }
+
+        for (int i = 0; i < static_cast<int>(grid.size()); ++i) {
+            for (int j = 0; j < static_cast<int>(grid[i].size()); ++j) {
+                for (const auto& defect : grid[i][j].detects) {
+                    auto code = std::find_if(defectClasses.begin(), defectClasses.end(),
+                        [&](const DefectClassInfo& info) { return info.klass == defect.klass; });
+                    file << "defect " << i << " " << j << " ";
+                    if (code != defectClasses.end()) {
+                        file << code->code;
+                    }
+                    else {
+                        file << defect.klass;
+                    }
+                    file << " " << defect.rect.x << " " << defect.rect.y << " " << defect.rect.width << " "
+                        << defect.rect.height << " " << defect.prob;
+
+                    if (!defect.mask.empty() || !defect.fragments.empty()) {
+                        cv::Mat mask = cv::Mat::zeros(defect.rect.size(), CV_8UC1);
+                        if (!defect.mask.empty()) {
+                            defect.mask.copyTo(mask(cv::Rect2i(cv::Point2i(0, 0), defect.mask.size())), defect.mask);
+                        }
+                        for (const auto& fragment : defect.fragments) {
+                            fragment.mask.copyTo(mask(cv::Rect2i(fragment.offset, fragment.mask.size())), fragment.mask);
+                        }
+                        std::vector<long long> runs = maskRuns(mask);
+                        if (runs.size() == 2 && runs[0] == 0 && runs[1] == static_cast<long long>(mask.total())) {
+                            file << " fill";
+                        }
+                        else {
+                            file << " rle " << runs.size();
+                            for (long long run : runs) {
+                                file << " " << run;
+                            }
+                        }
+                    }
+                    else if (defect.lines.empty()) {
+                        file << " rle 0";   // пустая маска: геометрия обязательна
+                    }
+                    for (const auto& line : defect.lines) {
+                        file << " polyline " << line.thickness << " " << line.points.size();
+                        for (const auto& point : line.points) {
+                            file << " " << point.x << " " << point.y;
+                        }
+                    }
+                    file << "\n";
+                }
+            }
+        }
+    }
+    return static_cast<bool>(file);
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <climits>
+#include "DetectMerger.h"
+
+/**
+ * Построчное объединение дефектов для непрерывного полотна (линейная камера, рулон любой длины).
+ *  Строки батчей подаются по одной сверху вниз, батчи строки примыкают к следующей строке.
+ *  Хранятся только "открытые" дефекты, нижняя граница которых ближе допуска объединения к низу последней строки,
+ *  остальные выдаются сразу после строки, в которой они перестали расти.
+ *  Поэтому память ограничена числом открытых дефектов, а задержка выдачи - одной строкой.
+ *  Компоненты и буферы хранятся в арене объединителя (MergeArena) и переиспользуются от строки к строке.
+ *  Допуски объединения берутся в начале полотна (первая строка после создания или finish) и не меняются до его конца.
+ *
+ * Результат совпадает с mergeDefectsMy с точностью до порядка дефектов.
+ */
+class StreamingDetectMerger
+{
+public:
+    /**
+     * Добавление очередной строки батчей.
+     *
+     * @param batchesRow - батчи одной строки, координаты относительно всего полотна
+     * @param resultDetects - сюда дописываются необъединяемые дефекты строки и дефекты, которые больше не могут вырасти
+     */
+    void pushRow(std::vector<BatchResult> batchesRow, std::vector<DetectResult>& resultDetects)
+    {
+        if (!started) {
+            arena.setTolerances(mergeTolerances());
+            started = true;
+        }
+        mergeBatchesRow(arena, batchesRow, resultDetects);
+
+        // Следующая строка начнется с нижней границы текущей
+        int bottom = INT_MIN;
+        for (const auto& batch : batchesRow) {
+            bottom = std::max(bottom, batch.batchRect.y + batch.batchRect.height);
+        }
+        if (bottom == INT_MIN) {
+            return;
+        }
+
+        for (auto& typeComponents : arena.components) {
+            if (!typeComponents.pieces.empty() || !typeComponents.interior.empty()) {
+                typeComponents.collectClosed(bottom, resultDetects);
+            }
+        }
+    }
+
+    // Конец полотна: выдаются все открытые дефекты, состояние сбрасывается
+    void finish(std::vector<DetectResult>& resultDetects)
+    {
+        arena.collect(resultDetects);
+        started = false;
+    }
+
+    // Число кусков, хранимых в ожидании следующих строк
+    size_t openPieces() const
+    {
+        size_t count = 0;
+        for (const auto& typeComponents : arena.components) {
+            count += typeComponents.pieces.size();
+        }
+        return count;
+    }
+
+private:
+    MergeArena arena;
+    bool started = false;   // полотно начато: допуски взяты, до finish не обновляются
+};
@@ -0,0 +1,175 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+/**
+ * Пул потоков с перехватом задач (work stealing).
+ *  У каждого потока своя очередь: свои задачи берутся с конца (последние добавленные, еще "горячие" в кэше),
+ *  чужие перехватываются с начала. Поэтому задачи разной длины (например, типы дефектов с разным числом кусков)
+ *  не простаивают в очереди занятого потока.
+ *
+ *  Поток, вызвавший parallelFor, тоже выполняет задачи, пока ждет свои, поэтому вложенный parallelFor
+ *  из задачи пула не блокируется, а пул из одного потока вырождается в последовательный цикл.
+ */
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned threadCount = std::max(1u, std::thread::hardware_concurrency()))
+    {
+        // Очередь 0 принадлежит внешним потокам, вызывающим parallelFor, очереди 1..n-1 - рабочим потокам
+        for (unsigned i = 0; i < std::max(1u, threadCount); ++i) {
+            queues.emplace_back(std::make_unique<TaskQueue>());
+        }
+        for (unsigned i = 1; i < threadCount; ++i) {
+            workers.emplace_back([this, i] { workerLoop(static_cast<int>(i)); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return static_cast<unsigned>(queues.size()); }
+
+    // Вызов body(i) для i из [0, count) и ожидание завершения всех вызовов
+    void parallelFor(int count, const std::function<void(int)>& body)
+    {
+        if (count <= 0) {
+            return;
+        }
+        if (workers.empty() || count == 1) {
+            for (int i = 0; i < count; ++i) {
+                body(i);
+            }
+            return;
+        }
+
+        // Счетчик разделяется с задачами: задача может завершиться позже, чем вызывающий поток проснется
+        auto state = std::make_shared<ForState>();
+        int home = homeQueue();
+        for (int i = 0; i < count; ++i) {
+            // Задачи раскладываются по всем очередям начиная со своей, остальное выравнивает перехват
+            push((home + i) % static_cast<int>(queues.size()), [state, &body, i, count] {
+                body(i);
+                if (++state->done == count) {
+                    std::lock_guard<std::mutex> lock(state->doneMutex);
+                    state->allDone.notify_all();
+                }
+                });
+        }
+
+        while (state->done.load() < count) {
+            if (runTask(home)) {
+                continue;
+            }
+            // Задач в очередях нет - оставшиеся уже выполняются другими потоками
+            std::unique_lock<std::mutex> lock(state->doneMutex);
+            state->allDone.wait(lock, [&] { return state->done.load() == count; });
+        }
+    }
+
+private:
+    struct TaskQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    struct ForState
+    {
+        std::atomic<int> done{ 0 };
+        std::mutex doneMutex;
+        std::condition_variable allDone;
+    };
+
+    // Очередь текущего потока: своя для рабочего потока этого пула, общая внешняя для остальных
+    int homeQueue() const
+    {
+        return (currentPool == this) ? currentQueue : 0;
+    }
+
+    void push(int queue, std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+            queues[queue]->tasks.emplace_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            ++pending;
+        }
+        wakeUp.notify_one();
+    }
+
+    // Выполнение одной задачи: сначала с конца своей очереди, затем перехват с начала чужих
+    bool runTask(int home)
+    {
+        std::function<void()> task;
+        int queueCount = static_cast<int>(queues.size());
+        for (int k = 0; k < queueCount && !task; ++k) {
+            TaskQueue& queue = *queues[(home + k) % queueCount];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (k == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+        }
+        if (!task) {
+            return false;
+        }
+        --pending;
+        task();
+        return true;
+    }
+
+    void workerLoop(int queue)
+    {
+        currentPool = this;
+        currentQueue = queue;
+        for (;;) {
+            if (runTask(queue)) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wakeUp.wait(lock, [this] { return stopping || pending.load() > 0; });
+            if (stopping && pending.load() == 0) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleepMutex;
+    std::condition_variable wakeUp;
+    std::atomic<int> pending{ 0 };      // задачи, лежащие в очередях
+    bool stopping = false;
+
+    static inline thread_local const ThreadPool* currentPool = nullptr;
+    static inline thread_local int currentQueue = 0;
+};
@@ -0,0 +1,52 @@
+#pragma once
+#include <vector>
+#include "DataStructs.h"
+#include "MergePolicy.h"
+
+// Границы столбцов и строк регулярной сетки батчей в пикселях
+struct TileGrid
+{
+    std::vector<int> x;     // cols + 1 границ
+    std::vector<int> y;     // rows + 1 границ
+
+    int rows() const { return static_cast<int>(y.size()) - 1; }
+    int cols() const { return static_cast<int>(x.size()) - 1; }
+};
+
+// Проверка, что батчи образуют регулярную сетку, а объединяемые дефекты не выходят за свои батчи.
+// Необъединяемые дефекты в объединение не попадают и могут выходить за батч (см. resolveTileOverlaps)
+bool regularTileGrid(const std::vector<std::vector<BatchResult>>& batchesDetects, TileGrid& grid)
+{
+    if (batchesDetects.empty() || batchesDetects.front().empty()) {
+        return false;
+    }
+    const auto& firstRow = batchesDetects.front();
+    grid.x.assign(1, firstRow.front().batchRect.x);
+    for (const auto& batch : firstRow) {
+        if (batch.batchRect.x != grid.x.back()) {
+            return false;
+        }
+        grid.x.push_back(batch.batchRect.x + batch.batchRect.width);
+    }
+    grid.y.assign(1, firstRow.front().batchRect.y);
+    for (const auto& batchesRow : batchesDetects) {
+        if (batchesRow.size() != firstRow.size()) {
+            return false;
+        }
+        int top = grid.y.back();
+        int height = batchesRow.front().batchRect.height;
+        for (size_t c = 0; c < batchesRow.size(); ++c) {
+            const cv::Rect2i& tile = batchesRow[c].batchRect;
+            if (tile.x != grid.x[c] || tile.width != firstRow[c].batchRect.width || tile.y != top || tile.height != height) {
+                return false;
+            }
+            for (const auto& defect : batchesRow[c].detects) {
+                if ((defect.rect & tile) != defect.rect && defectPolicy(defect.klass).strategy != MergeStrategy::None) {
+                    return false;
+                }
+            }
+        }
+        grid.y.push_back(top + height);
+    }
+    return true;
+}
@@ -0,0 +1,539 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <span>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <climits>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "DataStructs.h"
+#include "DetectMerger.h"
+#include "ScenarioFile.h"
+
+/**
+ * Двоичная трасса выхода детектора: кадры с сеткой батчей и дефектами для записи на линии и воспроизведения.
+ *  Файл читается через отображение в память, массивы кадра лежат в нем в том виде, в котором их принимает
+ *  DetectFrameView, поэтому рамки, точности и классы не разбираются и не копируются. Маски сжаты сериями
+ *  и распаковываются по требованию.
+ *
+ *  Формат (порядок байт little-endian, все массивы выровнены на 8 байт от начала кадра):
+ *    заголовок файла   "DMTR", uint32 версия, uint32 число кадров, uint32 0, uint64 смещение индекса
+ *    кадры             заголовок кадра (uint32 строк, столбцов, дефектов, 0, uint64 байт серий масок), затем массивы
+ *                      рамок батчей (int32 x4 на батч, по строкам), смещений дефектов батчей (int32, батчей + 1),
+ *                      рамок дефектов (int32 x4), точностей (float), классов (int64),
+ *                      смещений масок в блоке серий (uint64, дефектов + 1) и блок серий
+ *    индекс            uint64 смещение каждого кадра от начала файла
+ *
+ *  Маска - длины серий построчно, начиная с серии нулей, каждая длина - беззнаковое LEB128.
+ *  Пустая маска занимает 0 байт. Векторная геометрия (DetectResult::lines) и несобранные фрагменты
+ *  при записи накладываются на маску.
+ */
+
+static_assert(sizeof(cv::Rect2i) == 4 * sizeof(int32_t) && std::is_standard_layout_v<cv::Rect2i>,
+    "рамки дефектов читаются из трассы без копирования");
+
+const uint32_t traceVersion = 1;
+
+// Смещения массивов кадра от начала кадра, одинаково вычисляются при записи и чтении
+struct TraceFrameLayout
+{
+    uint64_t batchRects = 0;
+    uint64_t tileOffsets = 0;
+    uint64_t rects = 0;
+    uint64_t probs = 0;
+    uint64_t klasses = 0;
+    uint64_t maskOffsets = 0;
+    uint64_t masks = 0;
+    uint64_t size = 0;          // размер кадра вместе с блоком серий
+
+    TraceFrameLayout(uint64_t tiles, uint64_t defects, uint64_t maskBytes)
+    {
+        auto align = [](uint64_t offset) { return (offset + 7) & ~uint64_t(7); };
+        batchRects = 24;
+        tileOffsets = align(batchRects + tiles * sizeof(cv::Rect2i));
+        rects = align(tileOffsets + (tiles + 1) * sizeof(int32_t));
+        probs = align(rects + defects * sizeof(cv::Rect2i));
+        klasses = align(probs + defects * sizeof(float));
+        maskOffsets = align(klasses + defects * sizeof(int64_t));
+        masks = align(maskOffsets + (defects + 1) * sizeof(uint64_t));
+        size = align(masks + maskBytes);
+    }
+};
+
+// Сжатие маски сериями в конец out
+void encodeMaskRuns(const cv::Mat& mask, std::vector<uint8_t>& out)
+{
+    auto put = [&](uint64_t value) {
+        do {
+            uint8_t byte = value & 0x7f;
+            value >>= 7;
+            out.push_back(byte | (value ? 0x80 : 0));
+        } while (value);
+    };
+    bool current = false;
+    uint64_t length = 0;
+    for (int y = 0; y < mask.rows; ++y) {
+        const uchar* row = mask.ptr<uchar>(y);
+        for (int x = 0; x < mask.cols; ++x) {
+            if ((row[x] != 0) != current) {
+                put(length);
+                current = !current;
+                length = 0;
+            }
+            ++length;
+        }
+    }
+    put(length);
+}
+
+// Распаковка серий в маску size. false - серии повреждены: оборваны или их сумма не равна площади маски.
+// Сумма проверяется до выделения маски, чтобы поврежденная рамка не приводила к огромному выделению
+bool decodeMaskRuns(std::span<const uint8_t> runs, cv::Size size, cv::Mat& mask)
+{
+    auto forEachRun = [&](auto&& onRun) {
+        for (size_t i = 0; i < runs.size();) {
+            uint64_t length = 0;
+            for (int shift = 0; ; shift += 7) {
+                if (i == runs.size() || shift > 63) {
+                    return false;
+                }
+                uint8_t byte = runs[i++];
+                length |= uint64_t(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) {
+                    break;
+                }
+            }
+            if (!onRun(length)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    uint64_t total = static_cast<uint64_t>(size.width) * size.height;
+    uint64_t position = 0;
+    bool counted = forEachRun([&](uint64_t length) {
+        position += length;
+        return length <= total && position <= total;
+    });
+    if (!counted || position != total) {
+        return false;
+    }
+
+    mask = cv::Mat::zeros(size, CV_8UC1);
+    position = 0;
+    bool current = false;
+    return forEachRun([&](uint64_t length) {
+        if (current) {
+            std::memset(mask.data + position, 255, length);
+        }
+        position += length;
+        current = !current;
+        return true;
+    });
+}
+
+/**
+ * Запись трассы: кадры дописываются по одному, индекс и заголовок записываются в close().
+ *  Пока close() не вызван, файл не читается TraceReader.
+ */
+class TraceWriter
+{
+public:
+    ~TraceWriter()
+    {
+        close();
+    }
+
+    bool open(const std::string& path)
+    {
+        file.open(path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            std::cerr << path << ": не удалось создать трассу\n";
+            return false;
+        }
+        frameOffsets.clear();
+        writeHeader(0);
+        return static_cast<bool>(file);
+    }
+
+    // Запись кадра: сетки батчей в том виде, в котором ее принимает mergeDefectsMy
+    bool writeFrame(const std::vector<std::vector<BatchResult>>& batchesDetects)
+    {
+        uint32_t rows = static_cast<uint32_t>(batchesDetects.size());
+        uint32_t cols = rows ? static_cast<uint32_t>(batchesDetects[0].size()) : 0;
+        if (cols == 0) {
+            rows = 0;   // строки без батчей записываются пустой сеткой: у кадра либо есть батчи, либо нет ни строк, ни столбцов
+        }
+        std::vector<cv::Rect2i> batchRects;
+        std::vector<int32_t> tileOffsets = { 0 };
+        std::vector<cv::Rect2i> rects;
+        std::vector<float> probs;
+        std::vector<int64_t> klasses;
+        std::vector<uint64_t> maskOffsets = { 0 };
+        std::vector<uint8_t> masks;
+        for (const auto& batchesRow : batchesDetects) {
+            if (batchesRow.size() != cols) {
+                std::cerr << "трасса: строки батчей кадра разной длины\n";
+                return false;
+            }
+            for (const auto& batch : batchesRow) {
+                batchRects.push_back(batch.batchRect);
+                for (const auto& defect : batch.detects) {
+                    rects.push_back(defect.rect);
+                    probs.push_back(defect.prob);
+                    klasses.push_back(defect.klass);
+                    cv::Mat mask = flatMask(defect);
+                    if (!mask.empty()) {
+                        encodeMaskRuns(mask, masks);
+                    }
+                    maskOffsets.push_back(masks.size());
+                }
+                tileOffsets.push_back(static_cast<int32_t>(rects.size()));
+            }
+        }
+
+        TraceFrameLayout layout(batchRects.size(), rects.size(), masks.size());
+        std::vector<char> frame(layout.size, 0);
+        auto put = [&](uint64_t offset, const void* data, size_t bytes) {
+            if (bytes) {
+                std::memcpy(frame.data() + offset, data, bytes);
+            }
+        };
+        uint32_t header[4] = { rows, cols, static_cast<uint32_t>(rects.size()), 0 };
+        uint64_t maskBytes = masks.size();
+        put(0, header, sizeof(header));
+        put(16, &maskBytes, sizeof(maskBytes));
+        put(layout.batchRects, batchRects.data(), batchRects.size() * sizeof(cv::Rect2i));
+        put(layout.tileOffsets, tileOffsets.data(), tileOffsets.size() * sizeof(int32_t));
+        put(layout.rects, rects.data(), rects.size() * sizeof(cv::Rect2i));
+        put(layout.probs, probs.data(), probs.size() * sizeof(float));
+        put(layout.klasses, klasses.data(), klasses.size() * sizeof(int64_t));
+        put(layout.maskOffsets, maskOffsets.data(), maskOffsets.size() * sizeof(uint64_t));
+        put(layout.masks, masks.data(), masks.size());
+
+        frameOffsets.push_back(static_cast<uint64_t>(file.tellp()));
+        file.write(frame.data(), frame.size());
+        return static_cast<bool>(file);
+    }
+
+    // Запись индекса кадров и окончательного заголовка
+    bool close()
+    {
+        if (!file.is_open()) {
+            return true;
+        }
+        uint64_t indexOffset = static_cast<uint64_t>(file.tellp());
+        file.write(reinterpret_cast<const char*>(frameOffsets.data()), frameOffsets.size() * sizeof(uint64_t));
+        file.seekp(0);
+        writeHeader(indexOffset);
+        bool written = static_cast<bool>(file);
+        file.close();
+        return written;
+    }
+
+private:
+    void writeHeader(uint64_t indexOffset)
+    {
+        uint32_t header[4] = { 0, traceVersion, static_cast<uint32_t>(frameOffsets.size()), 0 };
+        std::memcpy(header, "DMTR", 4);
+        file.write(reinterpret_cast<const char*>(header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(&indexOffset), sizeof(indexOffset));
+    }
+
+    // Маска дефекта с наложенными фрагментами и линиями, входной дефект не меняется
+    static cv::Mat flatMask(const DetectResult& defect)
+    {
+        if (!maskPending(defect)) {
+            return defect.mask;
+        }
+        cv::Mat mask = cv::Mat::zeros(defect.rect.size(), CV_8UC1);
+        drawDefectMask(defect, mask, cv::Point2i(0, 0));
+        return mask;
+    }
+
+    std::ofstream file;
+    std::vector<uint64_t> frameOffsets;
+};
+
+// Кадр трассы: массивы указывают в отображенный файл и действительны, пока открыт TraceReader
+struct TraceFrame
+{
+    int rows = 0;
+    int cols = 0;
+    std::span<const cv::Rect2i> batchRects;
+    std::span<const int32_t> tileOffsets;
+    std::span<const cv::Rect2i> rects;
+    std::span<const float> probs;
+    std::span<const int64_t> klasses;
+    std::span<const uint64_t> maskOffsets;
+    std::span<const uint8_t> maskRuns;
+
+    int defectCount() const { return static_cast<int>(rects.size()); }
+
+    // Маска дефекта i (пустая, если дефект записан без маски)
+    cv::Mat decodeMask(int i) const
+    {
+        cv::Mat mask;
+        std::span<const uint8_t> runs = maskRuns.subspan(maskOffsets[i], maskOffsets[i + 1] - maskOffsets[i]);
+        if (!runs.empty() && !decodeMaskRuns(runs, rects[i].size(), mask)) {
+            std::cerr << "трасса: повреждена маска дефекта " << i << "\n";
+            mask = cv::Mat();
+        }
+        return mask;
+    }
+
+    std::vector<cv::Mat> decodeMasks() const
+    {
+        std::vector<cv::Mat> masks;
+        masks.reserve(rects.size());
+        for (int i = 0; i < defectCount(); ++i) {
+            masks.push_back(decodeMask(i));
+        }
+        return masks;
+    }
+
+    // Кадр для mergeDefectsMy(const DetectFrameView&): рамки, точности и классы берутся прямо из трассы,
+    // маски - из masks (распакованные decodeMasks или пустой span)
+    DetectFrameView view(std::span<const cv::Mat> masks) const
+    {
+        DetectFrameView frame;
+        frame.rows = rows;
+        frame.cols = cols;
+        frame.batchRects = batchRects;
+        frame.tileOffsets = tileOffsets;
+        frame.rects = rects;
+        frame.probs = probs;
+        frame.klasses = klasses;
+        frame.masks = masks;
+        return frame;
+    }
+
+    // Сетка батчей с распакованными масками, для реализаций, принимающих BatchResult
+    std::vector<std::vector<BatchResult>> toBatches() const
+    {
+        std::vector<std::vector<BatchResult>> batchesDetects(rows, std::vector<BatchResult>(cols));
+        if (batchRects.size() != static_cast<uint64_t>(rows) * static_cast<uint64_t>(cols)) {
+            return batchesDetects;
+        }
+        for (size_t tile = 0; tile < batchRects.size(); ++tile) {
+            BatchResult& batch = batchesDetects[tile / cols][tile % cols];
+            batch.batchRect = batchRects[tile];
+            for (int i = tileOffsets[tile]; i < tileOffsets[tile + 1]; ++i) {
+                DetectResult defect;
+                defect.rect = rects[i];
+                defect.prob = probs[i];
+                defect.klass = klasses[i];
+                defect.mask = decodeMask(i);
+                batch.detects.push_back(std::move(defect));
+            }
+        }
+        return batchesDetects;
+    }
+};
+
+/**
+ * Чтение трассы через отображение файла в память. Заголовок, индекс и границы массивов каждого кадра
+ *  проверяются, поэтому поврежденный файл не приводит к чтению за его пределами.
+ */
+class TraceReader
+{
+public:
+    TraceReader() = default;
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    ~TraceReader()
+    {
+        close();
+    }
+
+    bool open(const std::string& path)
+    {
+        close();
+        if (!map(path)) {
+            std::cerr << path << ": не удалось отобразить трассу\n";
+            return false;
+        }
+
+        uint32_t header[4] = {};
+        uint64_t indexOffset = 0;
+        bool valid = size >= 24;
+        if (valid) {
+            std::memcpy(header, data, sizeof(header));
+            std::memcpy(&indexOffset, data + 16, sizeof(indexOffset));
+            valid = std::memcmp(data, "DMTR", 4) == 0 && header[1] == traceVersion
+                && indexOffset <= size && (size - indexOffset) / sizeof(uint64_t) >= header[2] && indexOffset % 8 == 0;
+        }
+        if (!valid) {
+            std::cerr << path << ": не трасса или неподдерживаемая версия\n";
+            close();
+            return false;
+        }
+        frameTotal = header[2];
+        index = reinterpret_cast<const uint64_t*>(data + indexOffset);
+        return true;
+    }
+
+    void close()
+    {
+        if (data != nullptr) {
+#ifdef _WIN32
+            UnmapViewOfFile(data);
+#else
+            munmap(const_cast<uint8_t*>(data), size);
+#endif
+        }
+        data = nullptr;
+        size = 0;
+        frameTotal = 0;
+        index = nullptr;
+    }
+
+    int frameCount() const { return static_cast<int>(frameTotal); }
+
+    // Кадр f. false - кадр выходит за пределы файла или его смещения несогласованы
+    bool frame(int f, TraceFrame& result) const
+    {
+        if (f < 0 || f >= frameCount()) {
+            return false;
+        }
+        uint64_t offset = index[f];
+        uint32_t header[4] = {};
+        uint64_t maskBytes = 0;
+        if (offset % 8 != 0 || offset > size || size - offset < 24) {
+            return false;
+        }
+        std::memcpy(header, data + offset, sizeof(header));
+        std::memcpy(&maskBytes, data + offset + 16, sizeof(maskBytes));
+        // Число батчей считается в 64 битах и должно помещаться в int: строки и столбцы сетки перемножаются в int
+        // всеми потребителями кадра. Строки без столбцов (и наоборот) в трассе не пишутся
+        uint64_t tiles = uint64_t(header[0]) * header[1];
+        if (header[0] > INT32_MAX || header[1] > INT32_MAX || tiles > INT32_MAX || (header[0] == 0) != (header[1] == 0)
+            || tiles > size || header[2] > size || maskBytes > size) {
+            return false;
+        }
+        TraceFrameLayout layout(tiles, header[2], maskBytes);
+        if (layout.size > size - offset) {
+            return false;
+        }
+
+        const uint8_t* base = data + offset;
+        TraceFrame frame;
+        frame.rows = static_cast<int>(header[0]);
+        frame.cols = static_cast<int>(header[1]);
+        frame.batchRects = { reinterpret_cast<const cv::Rect2i*>(base + layout.batchRects), tiles };
+        frame.tileOffsets = { reinterpret_cast<const int32_t*>(base + layout.tileOffsets), tiles + 1 };
+        frame.rects = { reinterpret_cast<const cv::Rect2i*>(base + layout.rects), header[2] };
+        frame.probs = { reinterpret_cast<const float*>(base + layout.probs), header[2] };
+        frame.klasses = { reinterpret_cast<const int64_t*>(base + layout.klasses), header[2] };
+        frame.maskOffsets = { reinterpret_cast<const uint64_t*>(base + layout.maskOffsets), uint64_t(header[2]) + 1 };
+        frame.maskRuns = { base + layout.masks, maskBytes };
+
+        // Смещения дефектов батчей и масок должны неубывать и оставаться в своих массивах
+        int32_t previous = 0;
+        for (int32_t tileOffset : frame.tileOffsets) {
+            if (tileOffset < previous || tileOffset > static_cast<int64_t>(header[2])) {
+                return false;
+            }
+            previous = tileOffset;
+        }
+        if (frame.tileOffsets.front() != 0 || frame.tileOffsets.back() != static_cast<int64_t>(header[2])) {
+            return false;
+        }
+        for (size_t i = 0; i + 1 < frame.maskOffsets.size(); ++i) {
+            if (frame.maskOffsets[i] > frame.maskOffsets[i + 1] || frame.maskOffsets[i + 1] > maskBytes) {
+                return false;
+            }
+        }
+        for (const auto& rect : frame.rects) {
+            if (rect.width < 0 || rect.height < 0) {
+                return false;
+            }
+        }
+        result = frame;
+        return true;
+    }
+
+private:
+    bool map(const std::string& path)
+    {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        HANDLE mapping = nullptr;
+        if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        }
+        CloseHandle(file);
+        if (mapping == nullptr) {
+            return false;
+        }
+        data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        CloseHandle(mapping);
+        size = (data != nullptr) ? static_cast<size_t>(fileSize.QuadPart) : 0;
+#else
+        int file = ::open(path.c_str(), O_RDONLY);
+        if (file < 0) {
+            return false;
+        }
+        struct stat status;
+        void* mapped = MAP_FAILED;
+        if (fstat(file, &status) == 0 && status.st_size > 0) {
+            mapped = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+        }
+        ::close(file);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        data = static_cast<const uint8_t*>(mapped);
+        size = static_cast<size_t>(status.st_size);
+#endif
+        return data != nullptr;
+    }
+
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    uint32_t frameTotal = 0;
+    const uint64_t* index = nullptr;
+};
+
+// Кадры файла сценария или трассы (по расширению .trace)
+bool loadFrames(const std::string& path, std::vector<BatchGrid>& frames)
+{
+    const std::string extension = ".trace";
+    if (path.size() < extension.size() || path.compare(path.size() - extension.size(), extension.size(), extension) != 0) {
+        return loadScenario(path, frames);
+    }
+    TraceReader reader;
+    if (!reader.open(path)) {
+        return false;
+    }
+    frames.clear();
+    for (int f = 0; f < reader.frameCount(); ++f) {
+        TraceFrame frame;
+        if (!reader.frame(f, frame)) {
+            std::cerr << path << ": поврежден кадр " << f << "\n";
+            return false;
+        }
+        frames.push_back(frame.toBatches());
+    }
+    return true;
+}
@@ -0,0 +1,368 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+#include "MergeEngines.h"
+#include "ScenarioFile.h"
+#include "TraceFile.h"
+#include "OverlapTiles.h"
+
+/**
+ * Пакетный запуск объединения дефектов: без окон и без ввода с клавиатуры, для замеров и прогонов записанных кадров.
+ *  Кадры читаются из файлов сценариев (см. ScenarioFile.h) или двоичных трасс с расширением .trace
+ *  (см. TraceFile.h), каждый кадр объединяется выбранной реализацией repeat раз, результат последнего прогона
+ *  и времена записываются в JSON или двоичном виде. --save-trace записывает все прочитанные кадры в одну трассу.
+ *  В сборке с DETECT_MERGER_STATS (см. MergeStats.h) --stats выводит счетчики объединения в stderr,
+ *  а --timeline записывает этапы всех прогонов в JSON формата Chrome trace.
+ *  Допуски объединения - из --tolerances, иначе из merge_tolerances.cfg текущего каталога (как в main.cpp),
+ *  а без него - встроенные (MergePolicy.h). Файл допусков с ошибками - ошибка запуска, в каком бы виде он ни был задан.
+ *  JSON содержит источник допусков и допуск каждого класса, с которыми объединялись кадры.
+ *  --overlap - батчи кадров перекрываются: перед объединением сетка приводится к примыкающей
+ *  (resolveTileOverlaps в OverlapTiles.h), это входит в замер.
+ *  В JSON для каждого дефекта выводится число пикселей собранной маски, а с --features - признаки дефекта
+ *  (DefectFeatures.h): у объединенных дефектов они накоплены объединением, у остальных считаются вне замера.
+ *
+ *  detectMergerBatch <сценарий>... [--merger my|stream|parallel|bytype|exact|async|none] [--threads N] [--repeat N]
+ *                    [--format json|binary] [--output путь] [--tolerances путь] [--summary] [--save-trace путь]
+ *                    [--stats] [--timeline путь] [--overlap] [--features]
+ *
+ *  Двоичный вывод (порядок байт машины):
+ *    "DMRB", uint32 версия (1), uint32 число кадров, затем для каждого кадра
+ *    uint32 дефектов на входе, uint32 дефектов на выходе, double минимальное и среднее время (мс),
+ *    и для каждого выходного дефекта int64 класс, int32 x, y, ширина, высота, float точность, int64 пикселей маски
+ *    (с --summary дефекты не записываются, число дефектов на выходе сохраняется)
+ */
+
+struct BatchOptions
+{
+    std::vector<std::string> scenarios;
+    std::string merger = "my";
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    int repeat = 1;
+    std::string format = "json";
+    std::string output;             // пустой - стандартный вывод
+    std::string tolerances;         // пустой - merge_tolerances.cfg текущего каталога, если он есть, как в main.cpp
+    bool summary = false;           // только времена и числа дефектов, без списка дефектов
+    std::string saveTrace;          // пустой - входные кадры не сохраняются
+    bool stats = false;             // счетчики объединения в stderr
+    std::string timeline;           // пустой - временная шкала не записывается
+    bool overlap = false;           // батчи перекрываются (resolveTileOverlaps перед объединением)
+    bool features = false;          // признаки дефектов в JSON (у необъединенных считаются вне замера)
+};
+
+// Итог одного кадра
+struct FrameReport
+{
+    std::string scenario;
+    int index = 0;                  // номер кадра в файле сценария
+    int inputDefects = 0;
+    std::vector<DetectResult> defects;
+    std::vector<int64_t> pixels;    // пикселей в маске каждого дефекта (считается вне замера)
+    std::vector<double> times;      // время каждого прогона, мс
+};
+
+// Файл допусков, который читается без --tolerances (тот же, что в main.cpp)
+const char* defaultTolerancesPath = "merge_tolerances.cfg";
+
+const char* usage =
+    "detectMergerBatch <сценарий>... [--merger my|stream|parallel|bytype|exact|async|none] [--threads N] [--repeat N]\n"
+    "                  [--format json|binary] [--output путь] [--tolerances путь] [--summary] [--save-trace путь]\n"
+    "                  [--stats] [--timeline путь] [--overlap] [--features]\n"
+    "  без --tolerances допуски читаются из merge_tolerances.cfg текущего каталога, если он есть,\n"
+    "  иначе используются встроенные; источник и значения допусков записываются в JSON\n";
+
+bool parseOptions(int argc, char** argv, BatchOptions& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        auto value = [&]() -> const char* {
+            return (i + 1 < argc) ? argv[++i] : nullptr;
+        };
+        const char* text = nullptr;
+        if (argument == "--summary") {
+            options.summary = true;
+        }
+        else if (argument == "--stats") {
+            options.stats = true;
+        }
+        else if (argument == "--overlap") {
+            options.overlap = true;
+        }
+        else if (argument == "--features") {
+            options.features = true;
+        }
+        else if (argument.rfind("--", 0) != 0) {
+            options.scenarios.push_back(argument);
+        }
+        else if ((text = value()) == nullptr) {
+            std::cerr << "не задано значение " << argument << "\n";
+            return false;
+        }
+        else if (argument == "--merger") {
+            options.merger = text;
+        }
+        else if (argument == "--threads") {
+            options.threads = static_cast<unsigned>(std::max(1, std::atoi(text)));
+        }
+        else if (argument == "--repeat") {
+            options.repeat = std::max(1, std::atoi(text));
+        }
+        else if (argument == "--format") {
+            options.format = text;
+        }
+        else if (argument == "--output") {
+            options.output = text;
+        }
+        else if (argument == "--tolerances") {
+            options.tolerances = text;
+        }
+        else if (argument == "--save-trace") {
+            options.saveTrace = text;
+        }
+        else if (argument == "--timeline") {
+            options.timeline = text;
+        }
+        else {
+            std::cerr << "неизвестный параметр " << argument << "\n";
+            return false;
+        }
+    }
+
+    if (!isMergeEngine(options.merger)) {
+        std::cerr << "неизвестная реализация " << options.merger << "\n";
+        return false;
+    }
+    if (options.format != "json" && options.format != "binary") {
+        std::cerr << "неизвестный формат " << options.format << "\n";
+        return false;
+    }
+    if (options.format == "binary" && options.output.empty()) {
+        std::cerr << "двоичный результат записывается только в файл (--output)\n";
+        return false;
+    }
+    if ((options.stats || !options.timeline.empty()) && !mergeStatsEnabled) {
+        std::cerr << "счетчики объединения не собраны: нужна сборка с DETECT_MERGER_STATS\n";
+        return false;
+    }
+    if (options.scenarios.empty()) {
+        std::cerr << "не заданы файлы сценариев\n";
+        return false;
+    }
+    return true;
+}
+
+// Строка JSON в кавычках (пути сценариев могут содержать обратную косую черту)
+std::string jsonString(const std::string& text)
+{
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+double minTime(const FrameReport& report)
+{
+    return *std::min_element(report.times.begin(), report.times.end());
+}
+
+double meanTime(const FrameReport& report)
+{
+    return std::accumulate(report.times.begin(), report.times.end(), 0.0) / report.times.size();
+}
+
+// tolerancesSource - путь файла допусков или builtin, допуски классов берутся из текущих (mergeTolerances)
+void writeJson(std::ostream& out, const BatchOptions& options, const std::string& tolerancesSource,
+    const std::vector<FrameReport>& reports)
+{
+    out << std::fixed << std::setprecision(4);
+    out << "{\n  \"merger\": " << jsonString(options.merger) << ",\n  \"threads\": " << options.threads
+        << ",\n  \"repeat\": " << options.repeat << ",\n  \"tolerances\": { \"source\": " << jsonString(tolerancesSource)
+        << ", \"classes\": {";
+    MergeTolerances tolerances = mergeTolerances();
+    for (size_t i = 0; i < defectClasses.size(); ++i) {
+        out << (i ? ", " : " ") << jsonString(defectClasses[i].code) << ": " << tolerances.extension(defectClasses[i].type);
+    }
+    out << " } },\n  \"frames\": [";
+
+    long long inputDefects = 0, outputDefects = 0;
+    double totalMs = 0.0;
+    for (size_t f = 0; f < reports.size(); ++f) {
+        const FrameReport& report = reports[f];
+        inputDefects += report.inputDefects;
+        outputDefects += report.defects.size();
+        totalMs += minTime(report);
+
+        out << (f ? "," : "") << "\n    { \"scenario\": " << jsonString(report.scenario) << ", \"index\": " << report.index
+            << ", \"inputDefects\": " << report.inputDefects << ", \"outputDefects\": " << report.defects.size()
+            << ", \"minMs\": " << minTime(report) << ", \"meanMs\": " << meanTime(report);
+        if (!options.summary) {
+            out << ",\n      \"defects\": [";
+            for (size_t i = 0; i < report.defects.size(); ++i) {
+                const DetectResult& defect = report.defects[i];
+                auto code = defectClassMapping.find(static_cast<int>(defect.klass));
+                out << (i ? "," : "") << "\n        { \"class\": " << defect.klass << ", \"code\": "
+                    << jsonString(code != defectClassMapping.end() ? code->second : std::string()) << ", \"rect\": ["
+                    << defect.rect.x << ", " << defect.rect.y << ", " << defect.rect.width << ", " << defect.rect.height
+                    << "], \"prob\": " << defect.prob << ", \"pixels\": " << report.pixels[i];
+                // Признаки объединенных дефектов накапливаются объединением, остальных - считаются с --features,
+                // поэтому выводятся только с --features: у всех дефектов или ни у одного
+                if (options.features) {
+                    out << ", \"features\": { \"area\": " << defect.features.area << ", \"centroid\": ["
+                        << defect.features.centroid.x << ", " << defect.features.centroid.y << "], \"length\": "
+                        << defect.features.length << ", \"orientation\": " << orientation(defect.features)
+                        << ", \"meanProb\": " << meanProb(defect.features) << " }";
+                }
+                out << " }";
+            }
+            out << (report.defects.empty() ? "]" : "\n      ]");
+        }
+        out << " }";
+    }
+
+    out << (reports.empty() ? "]" : "\n  ]") << ",\n  \"totals\": { \"frames\": " << reports.size()
+        << ", \"inputDefects\": " << inputDefects << ", \"outputDefects\": " << outputDefects
+        << ", \"minMs\": " << totalMs << ", \"defectsPerSecond\": "
+        << (totalMs > 0.0 ? inputDefects * 1000.0 / totalMs : 0.0) << " }\n}\n";
+}
+
+void writeBinary(std::ostream& out, const BatchOptions& options, const std::vector<FrameReport>& reports)
+{
+    auto write = [&](const auto& value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+    out.write("DMRB", 4);
+    write(uint32_t(1));
+    write(static_cast<uint32_t>(reports.size()));
+    for (const auto& report : reports) {
+        write(static_cast<uint32_t>(report.inputDefects));
+        write(static_cast<uint32_t>(report.defects.size()));
+        write(minTime(report));
+        write(meanTime(report));
+        if (options.summary) {
+            continue;
+        }
+        for (size_t i = 0; i < report.defects.size(); ++i) {
+            const DetectResult& defect = report.defects[i];
+            write(static_cast<int64_t>(defect.klass));
+            write(static_cast<int32_t>(defect.rect.x));
+            write(static_cast<int32_t>(defect.rect.y));
+            write(static_cast<int32_t>(defect.rect.width));
+            write(static_cast<int32_t>(defect.rect.height));
+            write(defect.prob);
+            write(report.pixels[i]);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    BatchOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        std::cerr << usage;
+        return 1;
+    }
+    // Явно заданный файл допусков обязателен. Без --tolerances, как и в main.cpp, читается merge_tolerances.cfg,
+    // а если его нет - остаются встроенные допуски (MergePolicy.h). Существующий файл с ошибками не пропускается:
+    // иначе результат молча зависел бы от того, из какого каталога запущен прогон
+    std::string tolerancesSource = options.tolerances.empty() ? defaultTolerancesPath : options.tolerances;
+    if (options.tolerances.empty() && !std::ifstream(tolerancesSource)) {
+        tolerancesSource = "builtin";
+    }
+    else if (!loadMergeTolerances(tolerancesSource)) {
+        std::cerr << tolerancesSource << ": допуски объединения не загружены\n";
+        return 1;
+    }
+
+    TraceWriter trace;
+    if (!options.saveTrace.empty() && !trace.open(options.saveTrace)) {
+        return 1;
+    }
+
+    ThreadPool pool(options.threads);
+    mergeStats().reset();
+    std::vector<FrameReport> reports;
+    for (const auto& scenario : options.scenarios) {
+        std::vector<BatchGrid> frames;
+        if (!loadFrames(scenario, frames)) {
+            return 1;
+        }
+
+        for (int f = 0; f < static_cast<int>(frames.size()); ++f) {
+            FrameReport& report = reports.emplace_back();
+            report.scenario = scenario;
+            report.index = f;
+            if (!options.saveTrace.empty() && !trace.writeFrame(frames[f])) {
+                std::cerr << options.saveTrace << ": трасса не записана\n";
+                return 1;
+            }
+            for (const auto& batchesRow : frames[f]) {
+                for (const auto& batch : batchesRow) {
+                    report.inputDefects += static_cast<int>(batch.detects.size());
+                }
+            }
+
+            // Реализации забирают входные дефекты, поэтому каждый прогон получает копию кадра, сделанную вне замера
+            for (int r = 0; r < options.repeat; ++r) {
+                BatchGrid grid = frames[f];
+                std::vector<DetectResult> resultDetects;
+                auto start = std::chrono::steady_clock::now();
+                {
+                    MERGE_STATS_SPAN("frame", "index", static_cast<int64_t>(reports.size() - 1));
+                    if (options.overlap && !resolveTileOverlaps(grid)) {
+                        std::cerr << scenario << ": кадр " << f << " не приведен к примыкающей сетке\n";
+                        return 1;
+                    }
+                    runMergeEngine(options.merger, std::move(grid), resultDetects, pool);
+                }
+                auto finish = std::chrono::steady_clock::now();
+                report.times.push_back(std::chrono::duration<double, std::milli>(finish - start).count());
+                report.defects = std::move(resultDetects);
+            }
+
+            for (auto& defect : report.defects) {
+                if (options.features) {
+                    defectFeatures(defect);
+                }
+                report.pixels.push_back(cv::countNonZero(materializeMask(defect)));
+            }
+        }
+    }
+
+    if (!trace.close()) {
+        std::cerr << options.saveTrace << ": трасса не записана\n";
+        return 1;
+    }
+    if (options.stats) {
+        mergeStats().print(std::cerr);
+    }
+    if (!options.timeline.empty() && !mergeStats().writeChromeTrace(options.timeline)) {
+        return 1;
+    }
+
+    std::ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output, std::ios::binary);
+        if (!file) {
+            std::cerr << options.output << ": не удалось открыть файл результата\n";
+            return 1;
+        }
+    }
+    std::ostream& out = options.output.empty() ? std::cout : file;
+    if (options.format == "json") {
+        writeJson(out, options, tolerancesSource, reports);
+    }
+    else {
+        writeBinary(out, options, reports);
+    }
+    return out ? 0 : 1;
+}
@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "HeapCounters.h"
+#include "CommandLine.h"
+#include "MergeEngines.h"
+#include "RollGenerator.h"
+#include "ScenarioFile.h"
+#include "OverlapTiles.h"
+#include "OverviewRenderer.h"
+
+/**
+ * Замеры объединения на синтетическом рулоне (см. RollGenerator.h).
+ *  Для каждой длины рулона из --lengths генерируется рулон, и каждая реализация из --engines объединяет его
+ *  repeat раз. Результат - таблица CSV в стандартный вывод: дефектов в секунду по лучшему прогону, число и объем
+ *  выделений памяти, пик живой кучи за прогон и пиковый RSS процесса, по которой строятся кривые масштабирования.
+ *
+ *  detectMergerBench [--seed N] [--width px] [--lengths px,...] [--tile WxH] [--overlap px] [--density d]
+ *                    [--classes шифр=вес,...] [--shapes fill=w,line=w,diagonal=w,polyline=w]
+ *                    [--engines none,my,...] [--repeat N] [--threads N] [--save сценарий] [--overview N]
+ *                    [--lanes N]
+ *
+ *  Выделения считаются заменой operator new, поэтому учитываются только контейнеры C++. Пиксели масок cv::Mat
+ *  выделяет свой распределитель OpenCV, они видны только в RSS. Пиковый RSS за время жизни процесса не убывает:
+ *  для независимого пика каждой реализации ее нужно запускать отдельным процессом.
+ *
+ *  С --overlap батчи рулона перекрываются, и в каждый прогон входит приведение сетки к примыкающей
+ *  (resolveTileOverlaps в OverlapTiles.h).
+ *
+ *  С --lanes N (N > 1) столбцы батчей делятся между N камерами (splitRollLanes в RollGenerator.h), и для каждой
+ *  длины добавляется строка lanes: объединение полос по отдельности со сшивкой на стыках (mergeDefectsLanes
+ *  в LaneMerger.h). Разрезание рулона на полосы в замер не входит.
+ *
+ *  С --overview N после реализаций для каждой длины замеряется обзор объединенного рулона (OverviewRenderer.h):
+ *  построение, весь рулон в масштабе 1/N и экран 1920x1080 в середине рулона в исходном масштабе.
+ *  Лучшие из repeat прогонов выводятся в stderr, чтобы не смешиваться с таблицей.
+ */
+
+struct BenchOptions
+{
+    RollConfig roll;
+    std::vector<int> lengths = { 100000 };
+    std::vector<std::string> engines = { "none", "my" };
+    int repeat = 3;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string save;               // файл сценария для сохранения первого рулона
+    int overview = 0;               // масштаб 1/N замера обзора, 0 - без замера
+    int lanes = 1;                  // число камер замера mergeDefectsLanes, 1 - без замера
+};
+
+const char* usage =
+    "detectMergerBench [--seed N] [--width px] [--lengths px,...] [--tile WxH] [--overlap px] [--density d]\n"
+    "                  [--classes шифр=вес,...] [--shapes fill=w,line=w,diagonal=w,polyline=w]\n"
+    "                  [--engines none,my,...] [--repeat N] [--threads N] [--save сценарий] [--overview N]\n"
+    "                  [--lanes N]\n";
+
+// Разбор "имя=вес,...": для каждой пары вызывается assign(имя, вес), false - ошибка записи или имени
+template <typename Assign>
+bool parseWeights(const std::string& text, Assign&& assign)
+{
+    for (const auto& item : splitList(text, ',')) {
+        size_t separator = item.find('=');
+        if (separator == std::string::npos) {
+            return false;
+        }
+        char* end = nullptr;
+        double weight = std::strtod(item.c_str() + separator + 1, &end);
+        if (*end != '\0' || weight < 0.0 || !assign(item.substr(0, separator), weight)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parseOptions(int argc, char** argv, BenchOptions& options)
+{
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string argument = argv[i];
+        std::string text = argv[i + 1];
+        bool valid = true;
+        if (argument == "--seed") {
+            options.roll.seed = static_cast<uint32_t>(std::strtoul(text.c_str(), nullptr, 10));
+        }
+        else if (argument == "--width") {
+            options.roll.width = std::atoi(text.c_str());
+            valid = options.roll.width > 0;
+        }
+        else if (argument == "--lengths") {
+            options.lengths.clear();
+            for (const auto& item : splitList(text, ',')) {
+                options.lengths.push_back(std::atoi(item.c_str()));
+                valid = valid && options.lengths.back() > 0;
+            }
+            valid = valid && !options.lengths.empty();
+        }
+        else if (argument == "--tile") {
+            valid = std::sscanf(text.c_str(), "%dx%d", &options.roll.tileWidth, &options.roll.tileHeight) == 2
+                && options.roll.tileWidth > 0 && options.roll.tileHeight > 0;
+        }
+        else if (argument == "--overlap") {
+            options.roll.overlap = std::atoi(text.c_str());
+            valid = options.roll.overlap >= 0;
+        }
+        else if (argument == "--density") {
+            options.roll.density = std::atof(text.c_str());
+            valid = options.roll.density >= 0.0;
+        }
+        else if (argument == "--classes") {
+            options.roll.classWeights.clear();
+            valid = parseWeights(text, [&](const std::string& code, double weight) {
+                int64_t klass = parseDefectClass(code);
+                options.roll.classWeights.push_back({ klass, weight });
+                return klass >= 0;
+                }) && !options.roll.classWeights.empty();
+        }
+        else if (argument == "--shapes") {
+            const std::vector<std::string> shapes = { "fill", "line", "diagonal", "polyline" };
+            options.roll.shapeWeights.fill(0.0);
+            valid = parseWeights(text, [&](const std::string& name, double weight) {
+                auto shape = std::find(shapes.begin(), shapes.end(), name);
+                if (shape == shapes.end()) {
+                    return false;
+                }
+                options.roll.shapeWeights[shape - shapes.begin()] = weight;
+                return true;
+                });
+        }
+        else if (argument == "--engines") {
+            options.engines = splitList(text, ',');
+            valid = !options.engines.empty() && std::all_of(options.engines.begin(), options.engines.end(), isMergeEngine);
+        }
+        else if (argument == "--repeat") {
+            options.repeat = std::max(1, std::atoi(text.c_str()));
+        }
+        else if (argument == "--threads") {
+            options.threads = static_cast<unsigned>(std::max(1, std::atoi(text.c_str())));
+        }
+        else if (argument == "--save") {
+            options.save = text;
+        }
+        else if (argument == "--overview") {
+            options.overview = std::atoi(text.c_str());
+            valid = options.overview > 0;
+        }
+        else if (argument == "--lanes") {
+            options.lanes = std::atoi(text.c_str());
+            valid = options.lanes > 0;
+        }
+        else {
+            std::cerr << "неизвестный параметр " << argument << "\n";
+            return false;
+        }
+        if (!valid) {
+            std::cerr << "неверное значение " << argument << " " << text << "\n";
+            return false;
+        }
+    }
+    if (argc % 2 == 0) {
+        std::cerr << "не задано значение " << argv[argc - 1] << "\n";
+        return false;
+    }
+    if (options.roll.overlap >= std::min(options.roll.tileWidth, options.roll.tileHeight)) {
+        std::cerr << "перекрытие батчей должно быть меньше батча\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        std::cerr << usage;
+        return 1;
+    }
+
+    ThreadPool pool(options.threads);
+    std::cout << "length,engine,tiles,detections,results,minMs,detectionsPerSecond,"
+        "allocations,allocatedMB,peakHeapMB,peakRssMB\n";
+    for (int length : options.lengths) {
+        RollConfig config = options.roll;
+        config.length = length;
+        std::vector<std::vector<BatchResult>> roll = generateRoll(config);
+
+        long long tiles = 0, detections = 0;
+        for (const auto& batchesRow : roll) {
+            tiles += batchesRow.size();
+            for (const auto& batch : batchesRow) {
+                detections += batch.detects.size();
+            }
+        }
+        if (!options.save.empty()) {
+            if (!saveScenario(options.save, { roll })) {
+                return 1;
+            }
+            options.save.clear();
+        }
+
+        // Замер одной строки таблицы: run(resultDetects) объединяет заранее сделанную копию входа
+        auto measure = [&](const std::string& name, auto&& copyInput, auto&& run) {
+            double bestMs = 0.0;
+            size_t results = 0;
+            long long allocations = 0, allocatedBytes = 0, peakHeapBytes = 0;
+            for (int r = 0; r < options.repeat; ++r) {
+                // Копия входа и вектор результата создаются и освобождаются вне замера
+                auto input = copyInput();
+                std::vector<DetectResult> resultDetects;
+                long long liveBefore = heapCounters.liveBytes.load();
+                heapCounters.reset();
+                auto start = std::chrono::steady_clock::now();
+                if (!run(std::move(input), resultDetects)) {
+                    return false;
+                }
+                auto finish = std::chrono::steady_clock::now();
+
+                double ms = std::chrono::duration<double, std::milli>(finish - start).count();
+                if (r == 0 || ms < bestMs) {
+                    bestMs = ms;
+                }
+                results = resultDetects.size();
+                allocations = heapCounters.allocations.load();
+                allocatedBytes = heapCounters.allocatedBytes.load();
+                peakHeapBytes = heapCounters.peakLiveBytes.load() - liveBefore;
+            }
+
+            const double megabyte = 1024.0 * 1024.0;
+            std::cout << length << "," << name << "," << tiles << "," << detections << "," << results << ","
+                << bestMs << "," << (bestMs > 0.0 ? detections * 1000.0 / bestMs : 0.0) << ","
+                << allocations << "," << allocatedBytes / megabyte << "," << peakHeapBytes / megabyte << ","
+                << peakRssBytes() / megabyte << std::endl;
+            return true;
+        };
+
+        for (const auto& engine : options.engines) {
+            bool measured = measure(engine, [&] { return roll; },
+                [&](std::vector<std::vector<BatchResult>> grid, std::vector<DetectResult>& resultDetects) {
+                    if (config.overlap > 0 && !resolveTileOverlaps(grid)) {
+                        return false;
+                    }
+                    runMergeEngine(engine, std::move(grid), resultDetects, pool);
+                    return true;
+                });
+            if (!measured) {
+                return 1;
+            }
+        }
+
+        if (options.lanes > 1) {
+            std::vector<LaneGrid> lanes;
+            std::vector<LaneCalibration> calibration;
+            splitRollLanes(roll, options.lanes, lanes, calibration);
+            bool measured = measure("lanes", [&] { return lanes; },
+                [&](std::vector<LaneGrid> laneGrids, std::vector<DetectResult>& resultDetects) {
+                    return mergeDefectsLanes(std::move(laneGrids), calibration, resultDetects, pool);
+                });
+            if (!measured) {
+                return 1;
+            }
+        }
+
+        if (options.overview > 0) {
+            std::vector<DetectResult> resultDetects;
+            mergeDefectsMy(roll, resultDetects);
+            cv::Rect2i rollRect(0, 0, config.width, length);
+            cv::Rect2i screen = cv::Rect2i(0, length / 2, 1920, 1080) & rollRect;
+            double buildMs = 0.0, rollMs = 0.0, screenMs = 0.0;
+            for (int r = 0; r < options.repeat; ++r) {
+                auto start = std::chrono::steady_clock::now();
+                OverviewRenderer overview(resultDetects, pool);
+                auto built = std::chrono::steady_clock::now();
+                cv::Mat rollImage = overview.render(rollRect, options.overview, pool);
+                auto rendered = std::chrono::steady_clock::now();
+                cv::Mat screenImage = overview.render(screen, 1, pool);
+                auto finish = std::chrono::steady_clock::now();
+
+                auto best = [&](double& bestMs, auto from, auto to) {
+                    double ms = std::chrono::duration<double, std::milli>(to - from).count();
+                    bestMs = (r == 0) ? ms : std::min(bestMs, ms);
+                };
+                best(buildMs, start, built);
+                best(rollMs, built, rendered);
+                best(screenMs, rendered, finish);
+            }
+            std::cerr << "обзор " << length << ": построение " << buildMs << " мс, рулон 1/" << options.overview << " "
+                << rollMs << " мс, экран " << screen.width << "x" << screen.height << " " << screenMs << " мс\n";
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,474 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "HeapCounters.h"
+#include "CommandLine.h"
+#include "MergeEngines.h"
+#include "MergeComparison.h"
+#include "IncrementalDetectMerger.h"
+#include "RollGenerator.h"
+#include "TraceFile.h"
+
+/**
+ * Сверка реализаций объединения с mergeDefectsMy и контроль их скорости относительно сохраненного базиса.
+ *  Входы - случайные рулоны (RollGenerator.h, по одному на зерно 1..seeds) и кадры записанных сценариев и трасс.
+ *  Эталон каждого входа - результат mergeDefectsMy вне замера. Каждая реализация из --engines объединяет вход
+ *  repeat раз. Результат последнего прогона реализаций из --check сравнивается с эталоном без учета порядка
+ *  (compareResults в MergeComparison.h). none (mergeDefects) показывает время переноса без объединения,
+ *  exact объединяет по пикселям и с эталоном не совпадает, поэтому по умолчанию обе только замеряются.
+ *
+ *  detectMergerCheck [сценарий]... [--seeds N] [--length px] [--engines none,my,...] [--check stream,...]
+ *                    [--repeat N] [--threads N] [--iou порог] [--prob-tolerance d] [--baseline путь]
+ *                    [--time-tolerance доля] [--alloc-tolerance доля] [--replace N] [--lanes N]
+ *
+ *  Таблица CSV в стандартный вывод: вход, реализация, лучшее время, число выделений памяти, отпечаток результата
+ *  (canonicalDigest в MergeComparison.h), значения базиса и состояние строки. Сохраненная таблица служит базисом
+ *  следующего запуска (--baseline): результат каждой реализации, включая эталонную, должен совпасть с отпечатком
+ *  базиса, поэтому изменение самой mergeDefectsMy тоже видно. Строка считается регрессией, если время хуже базиса
+ *  больше чем на time-tolerance и больше чем на timeNoiseMs, или выделений больше чем на alloc-tolerance.
+ *  Расхождения с эталоном и базисом описываются в stderr.
+ *  Код возврата 1, если есть расхождение или регрессия.
+ *
+ *  С --replace N для каждого входа добавляется строка incremental: N случайных батчей по очереди заменяются
+ *  (IncrementalDetectMerger::replaceTile), время - всех N замен. Результат сверяется с mergeDefectsMy
+ *  по итоговой сетке, а результат, собранный из разниц замен, - с итоговым результатом объединителя.
+ *
+ *  С --lanes N (N > 1) для каждого входа из примыкающих батчей с несколькими столбцами добавляется строка lanes:
+ *  столбцы делятся между N камерами (splitRollLanes в RollGenerator.h), результат mergeDefectsLanes сверяется
+ *  с mergeDefectsMy сетки целиком после resolveTileOverlaps (полосы так же обрезают куски по своим батчам).
+ *  Разрезание на полосы в замер не входит.
+ *
+ *  Состояние строки: ok, diff - результат расходится с эталоном, changed - результат отличается от сохраненного
+ *  в базисе, slower - регрессия времени, allocs - регрессия выделений, new - строки нет в базисе.
+ *  Базис без столбца digest (записанный до его появления) результаты не сверяет. Времена на разных машинах несравнимы, базис записывается на той же машине.
+ */
+
+struct CheckOptions
+{
+    std::vector<std::string> scenarios;
+    int seeds = 5;                  // случайных рулонов
+    int length = 8000;              // длина случайного рулона
+    std::vector<std::string> engines = mergeEngineNames;
+    std::vector<std::string> check = { "stream", "parallel", "bytype", "async" };
+    int repeat = 3;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    ComparisonTolerances tolerances;
+    std::string baseline;           // пустой - без контроля скорости
+    double timeTolerance = 0.2;
+    double allocTolerance = 0.05;
+    int replace = 0;                // замен батчей на вход для проверки IncrementalDetectMerger, 0 - без проверки
+    int lanes = 3;                  // камер проверки mergeDefectsLanes, 1 - без проверки
+};
+
+// Разница времени, которая не считается регрессией при любом отношении (шум коротких прогонов)
+const double timeNoiseMs = 1.0;
+
+const char* usage =
+    "detectMergerCheck [сценарий]... [--seeds N] [--length px] [--engines none,my,...] [--check stream,...]\n"
+    "                  [--repeat N] [--threads N] [--iou порог] [--prob-tolerance d] [--baseline путь]\n"
+    "                  [--time-tolerance доля] [--alloc-tolerance доля] [--replace N] [--lanes N]\n";
+
+bool parseOptions(int argc, char** argv, CheckOptions& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        if (argument.rfind("--", 0) != 0) {
+            options.scenarios.push_back(argument);
+            continue;
+        }
+        if (i + 1 == argc) {
+            std::cerr << "не задано значение " << argument << "\n";
+            return false;
+        }
+        std::string text = argv[++i];
+        bool valid = true;
+        if (argument == "--seeds") {
+            options.seeds = std::atoi(text.c_str());
+            valid = options.seeds >= 0;
+        }
+        else if (argument == "--length") {
+            options.length = std::atoi(text.c_str());
+            valid = options.length > 0;
+        }
+        else if (argument == "--engines") {
+            options.engines = splitList(text, ',');
+            valid = !options.engines.empty() && std::all_of(options.engines.begin(), options.engines.end(), isMergeEngine);
+        }
+        else if (argument == "--check") {
+            options.check = splitList(text, ',');
+            valid = std::all_of(options.check.begin(), options.check.end(), isMergeEngine);
+        }
+        else if (argument == "--repeat") {
+            options.repeat = std::max(1, std::atoi(text.c_str()));
+        }
+        else if (argument == "--threads") {
+            options.threads = static_cast<unsigned>(std::max(1, std::atoi(text.c_str())));
+        }
+        else if (argument == "--iou") {
+            options.tolerances.minMaskIoU = std::atof(text.c_str());
+            valid = options.tolerances.minMaskIoU > 0.0 && options.tolerances.minMaskIoU <= 1.0;
+        }
+        else if (argument == "--prob-tolerance") {
+            options.tolerances.probTolerance = std::atof(text.c_str());
+            valid = options.tolerances.probTolerance >= 0.0;
+        }
+        else if (argument == "--replace") {
+            options.replace = std::atoi(text.c_str());
+            valid = options.replace >= 0;
+        }
+        else if (argument == "--lanes") {
+            options.lanes = std::atoi(text.c_str());
+            valid = options.lanes >= 1;
+        }
+        else if (argument == "--baseline") {
+            options.baseline = text;
+        }
+        else if (argument == "--time-tolerance") {
+            options.timeTolerance = std::atof(text.c_str());
+            valid = options.timeTolerance >= 0.0;
+        }
+        else if (argument == "--alloc-tolerance") {
+            options.allocTolerance = std::atof(text.c_str());
+            valid = options.allocTolerance >= 0.0;
+        }
+        else {
+            std::cerr << "неизвестный параметр " << argument << "\n";
+            return false;
+        }
+        if (!valid) {
+            std::cerr << "неверное значение " << argument << " " << text << "\n";
+            return false;
+        }
+    }
+    // Проверяемые реализации всегда замеряются
+    for (const auto& engine : options.check) {
+        if (std::find(options.engines.begin(), options.engines.end(), engine) == options.engines.end()) {
+            options.engines.push_back(engine);
+        }
+    }
+    return true;
+}
+
+// Строка базиса: лучшее время, число выделений и отпечаток результата реализации на входе
+struct BaselineEntry
+{
+    double minMs = 0.0;
+    long long allocations = 0;
+    std::string digest;             // пустой - результат не сверяется
+};
+
+using Baseline = std::map<std::pair<std::string, std::string>, BaselineEntry>;
+
+// Чтение базиса - таблицы предыдущего запуска. Столбцы находятся по заголовку
+bool loadBaseline(const std::string& path, Baseline& baseline)
+{
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << path << ": не удалось открыть базис\n";
+        return false;
+    }
+    std::string line;
+    std::getline(file, line);
+    std::vector<std::string> header = splitList(line, ',');
+    auto column = [&](const std::string& name) {
+        return static_cast<size_t>(std::find(header.begin(), header.end(), name) - header.begin());
+    };
+    size_t inputColumn = column("input"), engineColumn = column("engine");
+    size_t msColumn = column("minMs"), allocationsColumn = column("allocations"), digestColumn = column("digest");
+    if (std::max({ inputColumn, engineColumn, msColumn, allocationsColumn }) >= header.size()) {
+        std::cerr << path << ": в заголовке базиса нет столбцов input, engine, minMs, allocations\n";
+        return false;
+    }
+    for (int number = 2; std::getline(file, line); ++number) {
+        std::vector<std::string> cells;
+        std::istringstream stream(line);
+        for (std::string cell; std::getline(stream, cell, ',');) {
+            cells.push_back(cell);
+        }
+        if (cells.empty()) {
+            continue;
+        }
+        if (cells.size() < header.size()) {
+            std::cerr << path << ":" << number << ": неполная строка базиса\n";
+            return false;
+        }
+        BaselineEntry& entry = baseline[{ cells[inputColumn], cells[engineColumn] }];
+        entry.minMs = std::atof(cells[msColumn].c_str());
+        entry.allocations = std::atoll(cells[allocationsColumn].c_str());
+        if (digestColumn < header.size()) {
+            entry.digest = cells[digestColumn];
+        }
+    }
+    return true;
+}
+
+// Вход сверки: имя в таблице и сетка батчей
+struct CheckInput
+{
+    std::string name;
+    BatchGrid grid;
+    BatchGrid alternate;            // сетка того же размера с другими дефектами (случайный рулон с другим зерном)
+};
+
+// Новые дефекты батча [row][col] для проверки замены: батч другой сетки того же размера, а для записанных
+// кадров - текущий батч без каждого второго дефекта
+BatchResult replacementBatch(const CheckInput& input, const BatchGrid& current, int row, int col)
+{
+    if (!input.alternate.empty()) {
+        return input.alternate[row][col];
+    }
+    BatchResult batch;
+    batch.batchRect = current[row][col].batchRect;
+    bool keep = true;
+    for (const auto& defect : current[row][col].detects) {
+        if (keep) {
+            batch.detects.push_back(defect);
+        }
+        keep = !keep;
+    }
+    return batch;
+}
+
+int main(int argc, char** argv)
+{
+    CheckOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        std::cerr << usage;
+        return 1;
+    }
+    Baseline baseline;
+    if (!options.baseline.empty() && !loadBaseline(options.baseline, baseline)) {
+        return 1;
+    }
+
+    std::vector<CheckInput> inputs;
+    for (int seed = 1; seed <= options.seeds; ++seed) {
+        RollConfig config;
+        config.seed = static_cast<uint32_t>(seed);
+        config.length = options.length;
+        BatchGrid grid = generateRoll(config);
+        BatchGrid alternate;
+        if (options.replace > 0) {
+            config.seed += static_cast<uint32_t>(options.seeds);
+            alternate = generateRoll(config);
+        }
+        inputs.push_back({ "roll" + std::to_string(seed), std::move(grid), std::move(alternate) });
+    }
+    for (const auto& scenario : options.scenarios) {
+        std::vector<BatchGrid> frames;
+        if (!loadFrames(scenario, frames)) {
+            return 1;
+        }
+        for (size_t f = 0; f < frames.size(); ++f) {
+            inputs.push_back({ scenario + "#" + std::to_string(f), std::move(frames[f]), {} });
+        }
+    }
+
+    ThreadPool pool(options.threads);
+    int failures = 0;
+    std::cout << "input,engine,detections,results,minMs,allocations,digest,baselineMs,baselineAllocations,status\n";
+    for (const auto& input : inputs) {
+        long long detections = 0;
+        for (const auto& batchesRow : input.grid) {
+            for (const auto& batch : batchesRow) {
+                detections += batch.detects.size();
+            }
+        }
+        std::vector<DetectResult> reference;
+        mergeDefectsMy(input.grid, reference);
+
+        // Сравнение с эталоном expected: расхождения описываются в stderr, false - результаты расходятся
+        auto matches = [&](const std::string& engine, std::vector<DetectResult>& expected, std::vector<DetectResult>& actual) {
+            ResultComparison comparison = compareResults(expected, actual, options.tolerances);
+            if (!comparison.equal()) {
+                std::cerr << input.name << " " << engine << ": совпало " << comparison.matched << ", нет "
+                    << comparison.missing << ", лишних " << comparison.extra << ", масок " << comparison.maskDiffs
+                    << ", точностей " << comparison.probDiffs << "\n";
+                for (const auto& detail : comparison.details) {
+                    std::cerr << "    " << detail << "\n";
+                }
+            }
+            return comparison.equal();
+        };
+
+        // Строка таблицы: сверка с базисом и состояние. Результат сворачивается в отпечаток (маски собираются)
+        auto report = [&](const std::string& engine, std::vector<DetectResult>& results, double bestMs,
+            long long allocations, bool equal) {
+            std::ostringstream digestText;
+            digestText << std::hex << std::setw(16) << std::setfill('0') << canonicalDigest(canonicalDefects(results));
+            std::string digest = digestText.str();
+
+            std::string status = equal ? "ok" : "diff";
+            std::string baselineMs, baselineAllocations;
+            auto entry = baseline.find({ input.name, engine });
+            if (entry != baseline.end()) {
+                baselineMs = std::to_string(entry->second.minMs);
+                baselineAllocations = std::to_string(entry->second.allocations);
+                if (status == "ok" && !entry->second.digest.empty() && entry->second.digest != digest) {
+                    status = "changed";
+                    std::cerr << input.name << " " << engine << ": результат отличается от базиса, отпечаток "
+                        << digest << " вместо " << entry->second.digest << "\n";
+                }
+                else if (status == "ok" && bestMs > entry->second.minMs * (1.0 + options.timeTolerance)
+                    && bestMs - entry->second.minMs > timeNoiseMs) {
+                    status = "slower";
+                }
+                else if (status == "ok" && allocations > entry->second.allocations * (1.0 + options.allocTolerance)) {
+                    status = "allocs";
+                }
+            }
+            else if (!options.baseline.empty() && status == "ok") {
+                status = "new";
+            }
+            failures += (status == "diff" || status == "changed" || status == "slower" || status == "allocs") ? 1 : 0;
+
+            std::cout << input.name << "," << engine << "," << detections << "," << results.size() << ","
+                << bestMs << "," << allocations << "," << digest << "," << baselineMs << "," << baselineAllocations << ","
+                << status << std::endl;
+        };
+
+        for (const auto& engine : options.engines) {
+            double bestMs = 0.0;
+            long long allocations = 0;
+            std::vector<DetectResult> resultDetects;
+            for (int r = 0; r < options.repeat; ++r) {
+                // Копия входа и вектор результата создаются и освобождаются вне замера
+                BatchGrid grid = input.grid;
+                resultDetects.clear();
+                heapCounters.reset();
+                auto start = std::chrono::steady_clock::now();
+                runMergeEngine(engine, std::move(grid), resultDetects, pool);
+                auto finish = std::chrono::steady_clock::now();
+
+                double ms = std::chrono::duration<double, std::milli>(finish - start).count();
+                if (r == 0 || ms < bestMs) {
+                    bestMs = ms;
+                }
+                allocations = heapCounters.allocations.load();
+            }
+
+            bool checked = std::find(options.check.begin(), options.check.end(), engine) != options.check.end();
+            bool equal = !checked || matches(engine, reference, resultDetects);
+            report(engine, resultDetects, bestMs, allocations, equal);
+        }
+
+        if (options.lanes > 1 && !input.grid.empty() && input.grid.front().size() > 1) {
+            std::vector<LaneGrid> lanes;
+            std::vector<LaneCalibration> calibration;
+            splitRollLanes(input.grid, options.lanes, lanes, calibration);
+            // Общая зона камер приводится к примыкающей сетке иначе, чем перекрытие батчей, поэтому сверяются
+            // только входы из примыкающих батчей
+            bool adjacent = std::all_of(calibration.begin(), calibration.end(),
+                [](const LaneCalibration& lane) { return lane.overlap == 0; });
+            BatchGrid resolved = input.grid;
+            if (adjacent && resolveTileOverlaps(resolved)) {
+                std::vector<DetectResult> laneReference;
+                mergeDefectsMy(std::move(resolved), laneReference);
+                double bestMs = 0.0;
+                long long allocations = 0;
+                bool merged = true;
+                std::vector<DetectResult> resultDetects;
+                for (int r = 0; r < options.repeat; ++r) {
+                    std::vector<LaneGrid> laneGrids = lanes;
+                    resultDetects.clear();
+                    heapCounters.reset();
+                    auto start = std::chrono::steady_clock::now();
+                    merged = mergeDefectsLanes(std::move(laneGrids), calibration, resultDetects, pool) && merged;
+                    auto finish = std::chrono::steady_clock::now();
+
+                    double ms = std::chrono::duration<double, std::milli>(finish - start).count();
+                    if (r == 0 || ms < bestMs) {
+                        bestMs = ms;
+                    }
+                    allocations = heapCounters.allocations.load();
+                }
+                if (!merged) {
+                    std::cerr << input.name << " lanes: полосы не объединены\n";
+                }
+                report("lanes", resultDetects, bestMs, allocations, merged && matches("lanes", laneReference, resultDetects));
+            }
+        }
+
+        if (options.replace > 0 && !input.grid.empty() && !input.grid.front().empty()) {
+            // Заменяемые батчи и их новые дефекты выбираются до замеров, одинаково для всех прогонов
+            std::mt19937 random(static_cast<uint32_t>(&input - inputs.data()) + 1);
+            std::vector<std::pair<PieceRef, BatchResult>> replacements;
+            BatchGrid updated = input.grid;
+            for (int n = 0; n < options.replace; ++n) {
+                int row = static_cast<int>(random() % updated.size());
+                int col = static_cast<int>(random() % updated[row].size());
+                BatchResult batch = replacementBatch(input, updated, row, col);
+                updated[row][col] = batch;
+                replacements.push_back({ { row, col, 0 }, std::move(batch) });
+            }
+
+            double bestMs = 0.0;
+            long long allocations = 0;
+            std::vector<DetectResult> resultDetects, appliedDetects;
+            for (int r = 0; r < options.repeat; ++r) {
+                IncrementalDetectMerger merger;
+                std::vector<DetectResult> initial;
+                merger.mergeFrame(input.grid, initial);
+                // Результат, собранный из разниц: номера начального объединения идут подряд с нуля
+                std::map<int64_t, DetectResult> applied;
+                for (size_t i = 0; i < initial.size(); ++i) {
+                    applied.emplace(static_cast<int64_t>(i), std::move(initial[i]));
+                }
+                std::vector<std::pair<PieceRef, BatchResult>> batches = replacements;
+                std::vector<MergeDiff> diffs(batches.size());
+
+                heapCounters.reset();
+                auto start = std::chrono::steady_clock::now();
+                for (size_t n = 0; n < batches.size(); ++n) {
+                    merger.replaceTile(batches[n].first.row, batches[n].first.col, std::move(batches[n].second), diffs[n]);
+                }
+                auto finish = std::chrono::steady_clock::now();
+
+                double ms = std::chrono::duration<double, std::milli>(finish - start).count();
+                if (r == 0 || ms < bestMs) {
+                    bestMs = ms;
+                }
+                allocations = heapCounters.allocations.load();
+
+                for (auto& diff : diffs) {
+                    for (int64_t id : diff.removed) {
+                        applied.erase(id);
+                    }
+                    for (auto& [id, defect] : diff.changed) {
+                        applied[id] = std::move(defect);
+                    }
+                    for (auto& [id, defect] : diff.added) {
+                        applied[id] = std::move(defect);
+                    }
+                }
+                resultDetects.clear();
+                merger.defects(resultDetects);
+                appliedDetects.clear();
+                for (auto& [id, defect] : applied) {
+                    appliedDetects.push_back(std::move(defect));
+                }
+            }
+
+            std::vector<DetectResult> updatedReference;
+            mergeDefectsMy(updated, updatedReference);
+            bool equal = matches("incremental", updatedReference, resultDetects);
+            equal = matches("incremental diff", resultDetects, appliedDetects) && equal;
+            report("incremental", resultDetects, bestMs, allocations, equal);
+        }
+    }
+    if (failures > 0) {
+        std::cerr << "расхождений и регрессий: " << failures << "\n";
+    }
+    return (failures > 0) ? 1 : 0;
+}
@@ -1,6 +1,7 @@
 #include <cmath>
 #include <iostream>
 #include "DetectMerger.h"
+#include "OverviewRenderer.h"
 #include <unordered_map>
 #include <cmath>
 #include <locale>
@@ -56,29 +57,42 @@ void addLineDefect(std::vector<std::vector<BatchResult>>& inputBatchesDefects, i
     inputBatchesDefects[i][j].detects.push_back(defect);
 }
 
-cv::Mat displayDefects(const std::vector<DetectResult>& resultDefects)
+void addPolylineDefect(std::vector<std::vector<BatchResult>>& inputBatchesDefects, int i, int j,
+    int x, int y, int width, int height, const std::string& defectClass, const DefectPolyline& line)
 {
-    cv::Mat canvas = cv::Mat::zeros(2500, 2000, CV_8UC1);
-
-    // Проходим по всем дефектам
-    for (const auto& defect : resultDefects) {
-        // Определяем ROI для текущего дефекта
-        cv::Rect roi(defect.rect.x, defect.rect.y, defect.rect.width, defect.rect.height);
-        cv::Rect maskRoi(cv::Point(0, 0), defect.mask.size());
-        cv::Mat maskROI = defect.mask(maskRoi);
+    DetectResult defect;
+    defect.rect = cv::Rect2i(x, y, width, height);
+    defect.prob = 0.95f; // пока фиксированная вероятность 
+    defect.lines.push_back(line); // маска не создается, строится из линии по требованию
 
-        // Наложение маски дефекта на полотно
-        maskROI.copyTo(canvas(roi), maskROI);
+    // Преобразуем defectClass в int (klass)
+    int klass = -1; // По умолчанию -1 или другое значение, если не найдено
+    for (const auto& pair : defectClassMapping) {
+        if (pair.second == defectClass) {
+            klass = pair.first;
+            break;
+        }
     }
-    cv::Mat resizedCanvas;
-    cv::resize(canvas, resizedCanvas, cv::Size(canvas.cols / 3, canvas.rows / 3));
+    defect.klass = klass;
+
+    inputBatchesDefects[i][j].detects.push_back(defect);
+}
 
-    return resizedCanvas;
+cv::Mat displayDefects(const std::vector<DetectResult>& resultDefects)
+{
+    // Кадр 2000x2500 рисуется сразу в масштабе 1/3, без полотна исходного размера
+    OverviewRenderer overview(resultDefects);
+    return overview.render(cv::Rect2i(0, 0, 2000, 2500), 3);
 }
 
 int main()
 {
     setlocale(LC_ALL, "xx_XX.UTF-8");
+
+    // Допуски объединения по классам, без файла настроек используются значения по умолчанию
+    if (loadMergeTolerances("merge_tolerances.cfg")) {
+        std::cout << "Допуски объединения загружены из merge_tolerances.cfg\n";
+    }
     std::vector<std::vector<BatchResult>> inputBatchesDefects(5, std::vector<BatchResult>(4));
 
     int option;
@@ -223,18 +237,16 @@ int main()
                             addLineDefect(inputBatchesDefects, i, j, 410, 410, 90, 90, "O.2.3", mask);
                         }
 
-                        // Батч (1, 1) - линия от (500, 500) до (1000, 1000)
+                        // Батч (1, 1) - линия от (500, 500) до (1000, 1000), задана ломаной вместо маски 500x500
                         if (i == 1 && j == 1) {
-                            cv::Mat mask = cv::Mat::zeros(cv::Size(500, 500), CV_8UC1);
-                            cv::line(mask, cv::Point(0, 0), cv::Point(500, 500), cv::Scalar(255), 5);  // Линия от (0, 0) до (500, 500)
-                            addLineDefect(inputBatchesDefects, i, j, 500, 500, 500, 500, "O.2.3", mask);
+                            DefectPolyline line{ { cv::Point(500, 500), cv::Point(1000, 1000) }, 5 };
+                            addPolylineDefect(inputBatchesDefects, i, j, 500, 500, 500, 500, "O.2.3", line);
                         }
 
-                        // Батч (2, 2) - линия от (1500, 1000) до (1000, 1500)
+                        // Батч (2, 2) - линия от (1500, 1000) до (1000, 1500), задана ломаной вместо маски 500x500
                         if (i == 2 && j == 2) {
-                            cv::Mat mask = cv::Mat::zeros(cv::Size(500, 500), CV_8UC1);
-                            cv::line(mask, cv::Point(500, 0), cv::Point(0, 500), cv::Scalar(255), 5);  // Линия от (0, 0) до (500, 500)
-                            addLineDefect(inputBatchesDefects, i, j, 1000, 1000, 500, 500, "O.2.3", mask);
+                            DefectPolyline line{ { cv::Point(1500, 1000), cv::Point(1000, 1500) }, 5 };
+                            addPolylineDefect(inputBatchesDefects, i, j, 1000, 1000, 500, 500, "O.2.3", line);
                         }
 
                         // Нитки "галочкой"